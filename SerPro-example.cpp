@@ -20,19 +20,19 @@ struct SerProConfig {
 
 DECLARE_SERPRO( SerProConfig, SerialWrapper, SerProHDLC, SerPro);
 
-DECLARE_FUNCTION(0)(int a, int b, int c) {
-	std::cerr<<"METHOD 0: A(int) "<<a<<",B(int) "<<b<<",C(int) "<<c<<std::endl;
+DECLARE_FUNCTION(0)(int32_t a, int32_t b, int32_t c) {
+	std::cerr<<"METHOD 0: A(int32_t) "<<a<<",B(int32_t) "<<b<<",C(int32_t) "<<c<<std::endl;
 	SerPro::send(1,a,c,b);
 }
 END_FUNCTION
 
-DECLARE_FUNCTION(1)( int a, int b, int c) {
-	std::cerr<<"METHOD 1: A(int) "<<a<<",B(int) "<<b<<",C(int) "<<c<<std::endl;
+DECLARE_FUNCTION(1)(int32_t a, int32_t b, int32_t c) {
+	std::cerr<<"METHOD 1: A(int32_t) "<<a<<",B(int32_t) "<<b<<",C(int32_t) "<<c<<std::endl;
 	SerPro::send(2,c,b,a);
 }
 END_FUNCTION
 
-DECLARE_FUNCTION(2)( int a, int b, int c ) {
+DECLARE_FUNCTION(2)(int32_t a, int32_t b, int32_t c) {
 	std::cerr<<"METHOD 2: Empty function"<<std::endl;
 	SerPro::send(3);
 }
@@ -63,11 +63,11 @@ void SerialWrapper::write(const unsigned char *buf, unsigned int size)
 
 int main()
 {
-	int myints[3];
+	int32_t myints[3];
 	myints[0] = 0x7E7D7D7E; // Special case. Will cause lots of escapes
 	myints[1] = -60;
 	myints[2] = 32178632;
 
 	char buffer[40];
-	serpro.callFunction(0, (unsigned char*)&myints,1 );
+	serpro.callFunction(0, (unsigned char*)&myints, sizeof(myints) );
 }
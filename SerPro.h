@@ -22,7 +22,8 @@
 #define __SERPRO_H__
 
 #include <stdint.h>
-#include <string.h> // For strlen
+#include <string.h> // For strlen, memchr, memcpy
+#include "config_options.h"
 
 
 // Since GCC 4.3 we cannot have storage class qualifiers on template
@@ -51,41 +52,705 @@ struct FixedBuffer {
 	unsigned char *buffer;
 };
 
-template<typename MyProtocol, typename A>
+/* Length-prefixed buffers. These are sent as a length, 7 bits per byte,
+ LSB first, with MSB set on all bytes but the last one, followed by the
+ data itself. When received, they point directly into the receive buffer,
+ so they're only valid until the function returns. Note that received
+ strings are NOT null-terminated - use size.
+
+ Functions should take these by value.
+ */
+
+struct CountedBuffer {
+	const unsigned char *buffer;
+	unsigned int size;
+	CountedBuffer(): buffer(0), size(0) {}
+	CountedBuffer(const unsigned char *b, unsigned int s): buffer(b), size(s) {}
+	unsigned char operator[](int i) const { return buffer[i]; }
+};
+
+struct CountedString {
+	const char *string;
+	unsigned int size;
+	CountedString(): string(0), size(0) {}
+	CountedString(const char *s): string(s), size(strlen(s)) {}
+	CountedString(const char *s, unsigned int l): string(s), size(l) {}
+	char operator[](int i) const { return string[i]; }
+};
+
+/* Wire format. Multi-byte values are always sent little-endian, which
+ is what AVR uses natively, so on little-endian machines this costs
+ nothing. Big-endian machines need to swap them, unless the link found
+ out during setup that the other side is big-endian too (see wireSwap()
+ on each protocol).
+
+ Only fixed-width types are portable: 'int' is 16-bit on AVR and 32-bit
+ almost everywhere else, so use int16_t/int32_t on function signatures.
+ */
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+# define SERPRO_BIG_ENDIAN
+#endif
+
+struct wire_order {
+#ifdef SERPRO_BIG_ENDIAN
+	static bool const swap = true;
+#else
+	static bool const swap = false;
+#endif
+};
+
+template<unsigned int SIZE>
+struct wire_swap {
+	static inline void copy(unsigned char *dst, const unsigned char *src) {
+		unsigned int i;
+		for (i=0; i<SIZE; i++)
+			dst[i] = src[SIZE-1-i];
+	}
+};
+
+/* Types we know how to swap. Everything else goes out as-is. */
+
+template<typename A>
+struct wire_integral {
+	static bool const value = false;
+};
+
+#define WIRE_INTEGRAL(type) \
+	template<> struct wire_integral<type> { static bool const value = true; };
+
+WIRE_INTEGRAL(uint16_t)
+WIRE_INTEGRAL(int16_t)
+WIRE_INTEGRAL(uint32_t)
+WIRE_INTEGRAL(int32_t)
+WIRE_INTEGRAL(uint64_t)
+WIRE_INTEGRAL(int64_t)
+WIRE_INTEGRAL(float)
+
+/* Types that CompactEncoding sends as varints. Signed ones are zigzag
+ encoded first, so that small negative numbers stay small. */
+
+template<typename A>
+struct wire_varint {
+	static bool const value = false;
+};
+
+#define WIRE_VARINT(type,utype,sign) \
+	template<> struct wire_varint<type> { \
+	static bool const value = true; \
+	static bool const is_signed = sign; \
+	typedef utype unsigned_type; \
+	};
+
+WIRE_VARINT(uint16_t,uint16_t,false)
+WIRE_VARINT(int16_t,uint16_t,true)
+WIRE_VARINT(uint32_t,uint32_t,false)
+WIRE_VARINT(int32_t,uint32_t,true)
+WIRE_VARINT(uint64_t,uint64_t,false)
+WIRE_VARINT(int64_t,uint64_t,true)
+
+/* Bounds checking for deserialization. 'size' is the size of the payload
+ we received. If there are not 'len' bytes left, we move pos to the end
+ of the payload and set 'failed', so that the handler knows it must not
+ call the function. Further checks on the same payload will fail too.
+ Not pos past the end: buffer_size_t may be one byte, and size 255. */
+
+template<int unused=0>
+struct deserialize_status {
+	typedef void (*commit_t)();
+	static bool failed;     // Cleared by callFunction()
+	static commit_t commit[5]; // Run once all arguments passed, see deserialize_done()
+	static uint8_t commits;
+};
+
+template<int unused>
+bool deserialize_status<unused>::failed = false;
+template<int unused>
+typename deserialize_status<unused>::commit_t deserialize_status<unused>::commit[5];
+template<int unused>
+uint8_t deserialize_status<unused>::commits = 0;
+
+template<typename buffer_size_t>
+static inline void deserialize_fail(buffer_size_t &pos, buffer_size_t size)
+{
+	pos=size;
+	deserialize_status<>::failed=true;
+}
+
+template<typename buffer_size_t>
+static inline bool deserialize_check(buffer_size_t &pos, buffer_size_t size, unsigned int len)
+{
+	if (deserialize_status<>::failed || pos>size || len>(unsigned int)(size-pos)) {
+		deserialize_fail(pos,size);
+		return false;
+	}
+	return true;
+}
+
+/* Arguments that keep state across commands (delta structs) do not
+ touch it while they are decoded, as a later argument may still fail.
+ They leave a commit here instead, which the handler runs only if all
+ of them passed, right before it calls the function. */
+
+static inline void deserialize_later(deserialize_status<>::commit_t commit)
+{
+	deserialize_status<>::commit[deserialize_status<>::commits++] = commit;
+}
+
+static inline bool deserialize_done()
+{
+	if (deserialize_status<>::failed)
+		return false;
+	uint8_t i;
+	for (i=0; i<deserialize_status<>::commits; i++)
+		deserialize_status<>::commit[i]();
+	return true;
+}
+
+/* Varints: 7 bits per byte, LSB first, MSB set on all bytes but the last
+ one. We never accept more bytes than needed to fill T, so decoding never
+ takes more than a few iterations. */
+
+template<typename SerPro, typename T>
+static inline void serialize_varint(T value) {
+	while (value>0x7F) {
+		SerPro::MyProtocol::sendData((uint8_t)(value|0x80));
+		value>>=7;
+	}
+	SerPro::MyProtocol::sendData((uint8_t)value);
+}
+
+#ifndef AVR
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+/* Host fast path: look at 8 bytes at once, find the last byte of the
+ varint from the MSBs, and squeeze out the continuation bits. Only
+ used when 8 bytes are available and no swap is needed. Returns the
+ number of bytes used, or 0 if the varint is longer than 8 bytes.
+ Only worth it for varints of two bytes or more. */
+
+static inline unsigned int varint_decode8(const unsigned char *b, uint64_t &value)
+{
+	uint64_t word;
+	memcpy(&word,b,sizeof(word));
+	uint64_t stop = ~word & 0x8080808080808080ULL;
+	if (!stop)
+		return 0;
+	unsigned int bits = __builtin_ctzll(stop);
+	word &= ~0ULL >> (63-bits);
+#ifdef __BMI2__
+	value = _pext_u64(word,0x7F7F7F7F7F7F7F7FULL);
+#else
+	value = (word & 0x7FULL)
+		| ((word >> 1) & (0x7FULL<<7))
+		| ((word >> 2) & (0x7FULL<<14))
+		| ((word >> 3) & (0x7FULL<<21))
+		| ((word >> 4) & (0x7FULL<<28))
+		| ((word >> 5) & (0x7FULL<<35))
+		| ((word >> 6) & (0x7FULL<<42))
+		| ((word >> 7) & (0x7FULL<<49));
+#endif
+	return (bits>>3)+1;
+}
+#endif
+
+template<typename T, typename buffer_size_t>
+static inline T deserialize_varint(const unsigned char *b, buffer_size_t &pos, buffer_size_t size)
+{
+	T value = 0;
+	uint8_t shift = 0;
+	uint8_t v;
+#ifndef AVR
+	/* One-byte varints are quicker the plain way */
+	if (!wire_order::swap && pos<size && (b[pos] & 0x80) && size-pos>=8) {
+		uint64_t fast;
+		unsigned int len = varint_decode8(&b[pos],fast);
+		if (len && len<=(sizeof(T)*8+6)/7) {
+			pos+=len;
+			return (T)fast;
+		}
+	}
+#endif
+	do {
+		if (shift>=sizeof(T)*8 || !deserialize_check(pos,size,1)) {
+			deserialize_fail(pos,size);
+			return 0;
+		}
+		v = b[pos++];
+		value |= (T)(v&0x7F)<<shift;
+		shift+=7;
+	} while (v&0x80);
+	return value;
+}
+
+/* Argument encodings. FixedEncoding sends every argument with its full
+ size. CompactEncoding sends 16, 32 and 64-bit integers as varints,
+ which is much shorter for small values on slow links. Both sides must
+ use the same encoding. Select with "typedef CompactEncoding encoding;"
+ in the configuration. */
+
+struct FixedEncoding {
+	template<typename SerPro, typename A>
+	static inline void encode(A value) {
+		if (wire_integral<A>::value && wire_order::swap && SerPro::MyProtocol::wireSwap()) {
+			unsigned char buf[sizeof(value)];
+			wire_swap<sizeof(value)>::copy(buf,(const unsigned char*)&value);
+			SerPro::MyProtocol::sendData(buf,sizeof(value));
+		} else {
+			SerPro::MyProtocol::sendData((unsigned char*)&value,sizeof(value));
+		}
+	}
+
+	template<typename SerPro, typename T>
+	struct decoder {
+		typedef typename SerPro::buffer_size_t buffer_size_t;
+		static inline T deser(const unsigned char *b, buffer_size_t &pos, buffer_size_t size) {
+			T value;
+			if (!deserialize_check(pos,size,sizeof(T)))
+				return 0;
+			if (wire_order::swap && SerPro::MyProtocol::wireSwap())
+				wire_swap<sizeof(T)>::copy((unsigned char*)&value,&b[pos]);
+			else
+				memcpy(&value,&b[pos],sizeof(T));
+			pos+=sizeof(T);
+			return value;
+		}
+	};
+
+	template<typename A>
+	struct max_size {
+		static unsigned int const value = sizeof(A);
+	};
+};
+
+template<typename A, bool = wire_varint<A>::value>
+struct compact_encoding {
+	template<typename SerPro>
+	static inline void encode(A value) {
+		FixedEncoding::encode<SerPro>(value);
+	}
+	template<typename SerPro>
+	struct decoder: public FixedEncoding::decoder<SerPro,A> {};
+
+	static unsigned int const max_size = sizeof(A);
+};
+
+template<typename A>
+struct compact_encoding<A,true> {
+	typedef typename wire_varint<A>::unsigned_type unsigned_type;
+	static unsigned int const bits = sizeof(A)*8;
+
+	template<typename SerPro>
+	static inline void encode(A value) {
+		unsigned_type u = (unsigned_type)value;
+		if (wire_varint<A>::is_signed)
+			u = (u<<1) ^ (unsigned_type)(value>>(bits-1));
+		serialize_varint<SerPro>(u);
+	}
+
+	template<typename SerPro>
+	struct decoder {
+		typedef typename SerPro::buffer_size_t buffer_size_t;
+		static inline A deser(const unsigned char *b, buffer_size_t &pos, buffer_size_t size) {
+			unsigned_type u = deserialize_varint<unsigned_type>(b,pos,size);
+			if (wire_varint<A>::is_signed)
+				u = (u>>1) ^ (unsigned_type)-(unsigned_type)(u&1);
+			return (A)u;
+		}
+	};
+
+	static unsigned int const max_size = (bits+6)/7;
+};
+
+struct CompactEncoding {
+	template<typename SerPro, typename A>
+	static inline void encode(A value) {
+		compact_encoding<A>::template encode<SerPro>(value);
+	}
+
+	template<typename SerPro, typename T>
+	struct decoder: public compact_encoding<T>::template decoder<SerPro> {};
+
+	template<typename A>
+	struct max_size {
+		static unsigned int const value = compact_encoding<A>::max_size;
+	};
+};
+
+CONFIG_TYPE_OPTION(encoding, FixedEncoding)
+
+template<typename SerPro, typename A>
 static inline void serialize(A value) {
-	MyProtocol::sendData((unsigned char*)&value,sizeof(value));
+	SerPro::Encoding::template encode<SerPro>(value);
 }
 
-template<typename MyProtocol>
+template<typename SerPro>
 static inline void serialize(uint8_t value) {
-	MyProtocol::sendData(value);
+	SerPro::MyProtocol::sendData(value);
 }
 
 /* This is pretty much unsafe... */
-template<typename MyProtocol>
+template<typename SerPro>
 MAYBESTATIC void serialize(const char *string) {
-	MyProtocol::sendData(string,strlen(string));
+	SerPro::MyProtocol::sendData((const unsigned char*)string,strlen(string));
 }
 
+template<typename SerPro>
+static inline void serialize(const CountedBuffer &value) {
+	serialize_varint<SerPro>(value.size);
+	SerPro::MyProtocol::sendData(value.buffer,value.size);
+}
+
+template<typename SerPro>
+static inline void serialize(const CountedString &value) {
+	serialize_varint<SerPro>(value.size);
+	SerPro::MyProtocol::sendData((const unsigned char*)value.string,value.size);
+}
+
+/* Most bytes serialize() may send for a value. Protocols use this to
+ find out if a command fits in one frame, so it must never be short. */
+
+static inline uint32_t varint_size(uint32_t value) {
+	uint32_t len = 1;
+	while (value>0x7F) {
+		value>>=7;
+		len++;
+	}
+	return len;
+}
+
+template<typename SerPro, typename A>
+static inline uint32_t serialized_size(A) {
+	return SerPro::Encoding::template max_size<A>::value;
+}
+
+template<typename SerPro>
+static inline uint32_t serialized_size(uint8_t) {
+	return 1;
+}
+
+template<typename SerPro>
+static inline uint32_t serialized_size(const char *string) {
+	return strlen(string);
+}
+
+template<typename SerPro>
+static inline uint32_t serialized_size(const CountedBuffer &value) {
+	return varint_size(value.size) + value.size;
+}
+
+template<typename SerPro>
+static inline uint32_t serialized_size(const CountedString &value) {
+	return varint_size(value.size) + value.size;
+}
+
+/* Streaming functions get their payload in chunks, as it arrives,
+ instead of deserialized arguments once the frame is complete. See
+ DECLARE_STREAM_FUNCTION below. */
+
+enum serpro_stream_event {
+	STREAM_CHUNK,   // More payload
+	STREAM_COMMIT,  // Payload ended; size is 1 if the CRC matched
+	STREAM_ABORT    // Payload was cut short, forget it
+};
+
+template<class SerPro, typename B> struct deserializer;
+
+/* Delta-encoded structs. Telemetry records that go out again and again
+ with few changes can be sent as the bytes that changed since the last
+ copy sent with the same command. Mark the type with DELTA_STRUCT(type)
+ on both sides, send it as the only argument of a command, and take it
+ as "const type*" as usual.
+
+ Each copy carries a 15-bit generation, and the sender sends all of it
+ (a keyframe) the first time, every deltaKeyframe copies, and whenever
+ that is shorter. Otherwise it sends which bytes changed, as a bitmap
+ of bitmap bytes followed by the bitmap bytes that are not zero, and
+ then those bytes:
+
+   uint16 generation, top bit set for a keyframe, little-endian
+   keyframe: the struct
+   delta:    (sizeof+63)/64 bytes, bit n set if bitmap byte n follows
+             bitmap bytes, bit n set if struct byte n follows
+             struct bytes
+
+ The receiver rebuilds the struct in its own copy, and gives the
+ function a pointer to that, which stays valid until the next copy for
+ the command arrives. Nothing changes if another argument of the
+ command fails to decode. A delta that does not follow the copy it has
+ means one was lost; those are dropped, and the function is not called,
+ until the next keyframe.
+
+ Copies are kept for deltaStreams commands per type on each side; a
+ command beyond that takes the place of another, which then starts
+ again with a keyframe. */
+
+CONFIG_OPTION(deltaKeyframe, uint8_t, 32)
+CONFIG_OPTION(deltaStreams, uint8_t, 1)
+
+template<typename STRUCT>
+struct serpro_delta {
+	static bool const value = false;
+};
+
+#define DELTA_STRUCT(type) \
+	template<> \
+	struct serpro_delta<type> { \
+	static bool const value = true; \
+	};
+
+template<bool> struct serpro_delta_tag {};
+
+template<class SerPro, class STRUCT>
+struct delta_stream
+{
+	typedef typename SerPro::config_type Config;
+	typedef typename SerPro::command_t command_t;
+	typedef typename SerPro::buffer_size_t buffer_size_t;
+
+	static unsigned int const size = sizeof(STRUCT);
+	static unsigned int const mapSize = (size+7)/8;
+	static unsigned int const topSize = (mapSize+7)/8;
+	static unsigned int const streams =
+		config_option_deltaStreams<Config>::value ? config_option_deltaStreams<Config>::value : 1;
+	static uint16_t const keyframe = 0x8000;
+	static uint16_t const genMask = 0x7FFF;
+
+	struct slot {
+		STRUCT value;
+		command_t command;
+		uint16_t gen;
+		uint8_t sinceKey;   // Copies sent since the last keyframe
+		bool valid;
+	};
+
+	static slot tx[streams], rx[streams];
+	static uint8_t txNext, rxNext; // Slot to take over next
+
+	static slot *find(slot *s, command_t command)
+	{
+		unsigned int i;
+		for (i=0; i<streams; i++)
+			if (s[i].valid && s[i].command==command)
+				return &s[i];
+		return 0;
+	}
+
+	static slot *claim(slot *s, uint8_t &next, command_t command)
+	{
+		slot *f = find(s,command);
+		if (f)
+			return f;
+		unsigned int i;
+		for (i=0; i<streams; i++)
+			if (!s[i].valid)
+				return &s[i];
+		f = &s[next];
+		next = (next+1)%streams;
+		f->valid = false;
+		return f;
+	}
+
+	static void send(command_t command, const STRUCT &value)
+	{
+		slot *s = claim(tx,txNext,command);
+		const uint8_t *v = (const uint8_t*)&value;
+		const uint8_t *old = (const uint8_t*)&s->value;
+		uint8_t map[mapSize], top[topSize];
+		unsigned int len = topSize, i;
+		bool key = !s->valid ||
+			(config_option_deltaKeyframe<Config>::value &&
+			 s->sinceKey+1 >= config_option_deltaKeyframe<Config>::value);
+
+		memset(map,0,sizeof(map));
+		memset(top,0,sizeof(top));
+		if (!key) {
+			for (i=0; i<size; i++) {
+				if (v[i]!=old[i]) {
+					map[i>>3] |= 1<<(i&7);
+					len++;
+				}
+			}
+			for (i=0; i<mapSize; i++) {
+				if (map[i]) {
+					top[i>>3] |= 1<<(i&7);
+					len++;
+				}
+			}
+			if (len>=size)
+				key = true;
+		}
+
+		uint16_t gen = s->valid ? (s->gen+1) & genMask : 0;
+		uint16_t h = key ? gen | keyframe : gen;
+		SerPro::MyProtocol::startPacket(sizeof(command)+2+(key ? size : len));
+		SerPro::MyProtocol::sendPreamble();
+		SerPro::MyProtocol::sendData(command);
+		SerPro::MyProtocol::sendData(h & 0xFF);
+		SerPro::MyProtocol::sendData(h >> 8);
+		if (key) {
+			SerPro::MyProtocol::sendData(v,size);
+		} else {
+			SerPro::MyProtocol::sendData(top,topSize);
+			for (i=0; i<mapSize; i++)
+				if (map[i])
+					SerPro::MyProtocol::sendData(map[i]);
+			for (i=0; i<size; i++)
+				if (map[i>>3] & (1<<(i&7)))
+					SerPro::MyProtocol::sendData(v[i]);
+		}
+		SerPro::MyProtocol::sendPostamble();
+		/* The peer never saw it, the next one is still against the old copy */
+		if (SerPro::MyProtocol::sendRefused())
+			return;
+
+		memcpy(&s->value,&value,size);
+		s->command = command;
+		s->gen = gen;
+		s->sinceKey = key ? 0 : s->sinceKey+1;
+		s->valid = true;
+	}
+
+	/* Start the next copy of a command with a keyframe, say after the
+	 peer was reset */
+	static void reset(command_t command)
+	{
+		slot *s = find(tx,command);
+		if (s)
+			s->valid = false;
+	}
+
+	static const STRUCT *receive(command_t command, const unsigned char *b,
+								 buffer_size_t &pos, buffer_size_t bsize)
+	{
+		if (!deserialize_check(pos,bsize,2))
+			return 0;
+		uint16_t h = b[pos] | ((uint16_t)b[pos+1]<<8);
+		uint16_t gen = h & genMask;
+		pos += 2;
+		unsigned int i;
+
+		if (h & keyframe) {
+			if (!deserialize_check(pos,bsize,size))
+				return 0;
+			memcpy(&scratch,&b[pos],size);
+			pos += size;
+			return pend(rxSlot(command),command,gen);
+		}
+
+		slot *s = find(rx,command);
+		if (!s || s->gen!=((gen-1) & genMask)) {
+			/* Missed one, wait for a keyframe */
+			deserialize_fail(pos,bsize);
+			return 0;
+		}
+		if (!deserialize_check(pos,bsize,topSize))
+			return 0;
+		const unsigned char *top = &b[pos];
+		pos += topSize;
+
+		/* All of it must be there before the copy is touched */
+		uint8_t map[mapSize];
+		unsigned int count = 0;
+		for (i=0; i<mapSize; i++) {
+			map[i] = 0;
+			if (top[i>>3] & (1<<(i&7))) {
+				if (!deserialize_check(pos,bsize,1))
+					return 0;
+				map[i] = b[pos++];
+				count += __builtin_popcount(map[i]);
+			}
+		}
+		if (!deserialize_check(pos,bsize,count))
+			return 0;
+
+		memcpy(&scratch,&s->value,size);
+		uint8_t *v = (uint8_t*)&scratch;
+		for (i=0; i<size; i++)
+			if (map[i>>3] & (1<<(i&7)))
+				v[i] = b[pos++];
+		return pend(s,command,gen);
+	}
+
+	/* The copy is rebuilt in scratch, and goes to its slot only once
+	 the other arguments passed too; commit() takes the slot rxSlot()
+	 said. The function gets a pointer to the slot, which holds the copy
+	 by then. */
+
+	static STRUCT scratch;
+	static command_t pendingCommand;
+	static uint16_t pendingGen;
+
+	/* Where a copy for command goes, as claim() would pick it, but
+	 without taking it yet */
+	static slot *rxSlot(command_t command)
+	{
+		slot *f = find(rx,command);
+		if (f)
+			return f;
+		unsigned int i;
+		for (i=0; i<streams; i++)
+			if (!rx[i].valid)
+				return &rx[i];
+		return &rx[rxNext];
+	}
+
+	static const STRUCT *pend(slot *s, command_t command, uint16_t gen)
+	{
+		pendingCommand = command;
+		pendingGen = gen;
+		deserialize_later(&commit);
+		return &s->value;
+	}
+
+	static void commit()
+	{
+		slot *s = claim(rx,rxNext,pendingCommand);
+		memcpy(&s->value,&scratch,size);
+		s->command = pendingCommand;
+		s->gen = pendingGen;
+		s->valid = true;
+	}
+};
+
+template<class SerPro, class STRUCT>
+typename delta_stream<SerPro,STRUCT>::slot delta_stream<SerPro,STRUCT>::tx[delta_stream<SerPro,STRUCT>::streams];
+template<class SerPro, class STRUCT>
+typename delta_stream<SerPro,STRUCT>::slot delta_stream<SerPro,STRUCT>::rx[delta_stream<SerPro,STRUCT>::streams];
+template<class SerPro, class STRUCT>
+uint8_t delta_stream<SerPro,STRUCT>::txNext = 0;
+template<class SerPro, class STRUCT>
+uint8_t delta_stream<SerPro,STRUCT>::rxNext = 0;
+template<class SerPro, class STRUCT>
+STRUCT delta_stream<SerPro,STRUCT>::scratch;
+template<class SerPro, class STRUCT>
+typename delta_stream<SerPro,STRUCT>::command_t delta_stream<SerPro,STRUCT>::pendingCommand;
+template<class SerPro, class STRUCT>
+uint16_t delta_stream<SerPro,STRUCT>::pendingGen = 0;
+
 /*
  Our main class definition.
  TODO: document
  */
 template<class Config, class Serial,
-template <class Config, class Ser,class Implementation> class Protocol >
+template <class Cfg, class Ser,class Implementation> class Protocol >
 struct protocolImplementation
 {
 	typedef Protocol<Config,Serial,protocolImplementation> MyProtocol;
+	typedef Config config_type;
 	/* Forwarded types */
 	typedef typename MyProtocol::command_t command_t;
 	typedef typename MyProtocol::buffer_size_t buffer_size_t;
 	typedef typename MyProtocol::RawBuffer RawBuffer;
+	typedef typename config_option_encoding<Config>::type Encoding;
 
 	// callback structure. One for each function we handle. We define both
 	// deserializer and function to call.
 
 	typedef  void (*func_type)(void);
-	typedef  void (*deserialize_func_type)(const unsigned char *, buffer_size_t&, func_type);
+	typedef  void (*deserialize_func_type)(const unsigned char *, buffer_size_t&, buffer_size_t, func_type);
 
 	struct callback {
 		deserialize_func_type deserialize;
@@ -94,6 +759,8 @@ struct protocolImplementation
 
 	static callback const PROGMEM callbacks[Config::maxFunctions];
 
+	static command_t rxCommand;     // Command in processPacket(), for delta structs
+
 	struct VariableBuffer{
 		const unsigned char *buffer;
 		unsigned int size;
@@ -109,20 +776,78 @@ struct protocolImplementation
 	static inline void callFunction(int index, const unsigned char *data, buffer_size_t size)
 	{
 		buffer_size_t pos = 0;
+		if (index<0 || index>=(int)Config::maxFunctions)
+			return;
+		deserialize_status<>::failed = false;
+		deserialize_status<>::commits = 0;
 #ifdef AVR
 		deserialize_func_type deserialize = (deserialize_func_type)pgm_read_word(&callbacks[index].deserialize);
 		func_type func = (func_type)pgm_read_word(&callbacks[index].func);
-		deserialize(data,pos,func);
+		deserialize(data,pos,size,func);
+#else
+		callbacks[index].deserialize(data,pos,size,callbacks[index].func);
+#endif
+	}
+
+	/* Streaming functions. The protocol calls these while a frame for
+	 one of them is still coming in. */
+
+	typedef deserializer<protocolImplementation,
+		void (serpro_stream_event, const unsigned char*, unsigned int)> stream_deserializer;
+
+	static inline func_type streamFunction(command_t command)
+	{
+		if (command>=Config::maxFunctions)
+			return 0;
+#ifdef AVR
+		deserialize_func_type deserialize = (deserialize_func_type)pgm_read_word(&callbacks[command].deserialize);
+		func_type func = (func_type)pgm_read_word(&callbacks[command].func);
 #else
-		callbacks[index].deserialize(data,pos,callbacks[index].func);
+		deserialize_func_type deserialize = callbacks[command].deserialize;
+		func_type func = callbacks[command].func;
 #endif
+		if (deserialize != (deserialize_func_type)&stream_deserializer::handle)
+			return 0;
+		return func;
 	}
 
+	static inline bool isStreaming(command_t command)
+	{
+		return streamFunction(command)!=0;
+	}
+
+	static void stream(command_t command, serpro_stream_event event,
+					   const unsigned char *data, unsigned int size)
+	{
+		typedef void (*stream_func_type)(serpro_stream_event, const unsigned char*, unsigned int);
+		stream_func_type func = (stream_func_type)streamFunction(command);
+		if (func)
+			func(event,data,size);
+	}
+
+	static inline void streamChunk(command_t command, const unsigned char *data, unsigned int size)
+	{
+		stream(command,STREAM_CHUNK,data,size);
+	}
+
+	static inline void streamCommit(command_t command, bool crcOk)
+	{
+		stream(command,STREAM_COMMIT,0,crcOk);
+	}
+
+	static inline void streamAbort(command_t command)
+	{
+		stream(command,STREAM_ABORT,0,0);
+	}
+
+	/* buf holds command followed by payload, size includes both */
 	static inline void processPacket(const unsigned char *buf,
 									 buffer_size_t size)
 	{
-		buffer_size_t sz = 0; // TODO - put packet size here.
-		callFunction(buf[0], buf+1, sz-1);
+		if (size==0)
+			return;
+		rxCommand = buf[0];
+		callFunction(buf[0], buf+1, size-1);
 	}
 
 	static inline void processData(uint8_t bIn)
@@ -130,6 +855,13 @@ struct protocolImplementation
 		MyProtocol::processData(bIn);
 	}
 
+	/* Protocol timers. Call this periodically; timeouts in the
+	 configuration are counted in calls to this. */
+	static inline void timerTick()
+	{
+		MyProtocol::timerTick();
+	}
+
 	static inline void send(command_t command) {
 		MyProtocol::startPacket(sizeof(command));
 		MyProtocol::sendPreamble();
@@ -139,13 +871,23 @@ struct protocolImplementation
 
 	template<typename A>
 		static void send(command_t command, A value) {
-			MyProtocol::startPacket(sizeof(A)+sizeof(command));
+			sendValue(command,value,serpro_delta_tag<serpro_delta<A>::value>());
+		};
+
+	template<typename A>
+		static void sendValue(command_t command, const A &value, serpro_delta_tag<false>) {
+			MyProtocol::startPacket(serialized_size<protocolImplementation>(value)+sizeof(command));
 			MyProtocol::sendPreamble();
 			MyProtocol::sendData(command);
-			serialize<MyProtocol,A>(value);
+			serialize<protocolImplementation>(value);
 			MyProtocol::sendPostamble();
 		};
 
+	template<typename A>
+		static void sendValue(command_t command, const A &value, serpro_delta_tag<true>) {
+			delta_stream<protocolImplementation,A>::send(command,value);
+		};
+
 	template<typename A>
 		static void send(command_t command,const RawBuffer &value) {
 			MyProtocol::startPacket(value.size + sizeof(command) );
@@ -166,22 +908,27 @@ struct protocolImplementation
 
 	template<typename A,typename B>
 	static void send(command_t command, const A value_a, const B value_b) {
-		MyProtocol::startPacket(sizeof(command)+sizeof(A)+sizeof(B));
+		MyProtocol::startPacket(sizeof(command)
+			+ serialized_size<protocolImplementation>(value_a)
+			+ serialized_size<protocolImplementation>(value_b));
 		MyProtocol::sendPreamble();
 		MyProtocol::sendData(command);
-		serialize<MyProtocol>(value_a);
-		serialize<MyProtocol>(value_b);
+		serialize<protocolImplementation>(value_a);
+		serialize<protocolImplementation>(value_b);
 		MyProtocol::sendPostamble();
 	}
 
 	template<typename A,typename B,typename C>
 	static void send(command_t command, const A value_a, const B value_b, const C value_c) {
-		MyProtocol::startPacket(sizeof(command)+ sizeof(A)+sizeof(B)+sizeof(C));
+		MyProtocol::startPacket(sizeof(command)
+			+ serialized_size<protocolImplementation>(value_a)
+			+ serialized_size<protocolImplementation>(value_b)
+			+ serialized_size<protocolImplementation>(value_c));
 		MyProtocol::sendPreamble();
 		MyProtocol::sendData(command);
-		serialize<MyProtocol>(value_a);
-		serialize<MyProtocol>(value_b);
-		serialize<MyProtocol>(value_c);
+		serialize<protocolImplementation>(value_a);
+		serialize<protocolImplementation>(value_b);
+		serialize<protocolImplementation>(value_c);
 		MyProtocol::sendPostamble();
 	}
 
@@ -189,13 +936,17 @@ struct protocolImplementation
 	static void send(command_t command, const A value_a, const B value_b,
 					 const C value_c,const D value_d) {
 		buffer_size_t length = 0;
-		MyProtocol::startPacket(sizeof(command)+ sizeof(A)+sizeof(B)+sizeof(C)+sizeof(D));
+		MyProtocol::startPacket(sizeof(command)
+			+ serialized_size<protocolImplementation>(value_a)
+			+ serialized_size<protocolImplementation>(value_b)
+			+ serialized_size<protocolImplementation>(value_c)
+			+ serialized_size<protocolImplementation>(value_d));
 		MyProtocol::sendPreamble();
 		MyProtocol::sendData(command);
-		serialize<MyProtocol>(value_a);
-		serialize<MyProtocol>(value_b);
-		serialize<MyProtocol>(value_c);
-		serialize<MyProtocol>(value_d);
+		serialize<protocolImplementation>(value_a);
+		serialize<protocolImplementation>(value_b);
+		serialize<protocolImplementation>(value_c);
+		serialize<protocolImplementation>(value_d);
 		MyProtocol::sendPostamble();
 	}
 
@@ -203,14 +954,19 @@ struct protocolImplementation
 	static void send(command_t command, const A &value_a, const B &value_b,
 					 const C &value_c,const D &value_d,
 					 const E &value_e) {
-		MyProtocol::startPacket(sizeof(command)+ sizeof(A)+sizeof(B)+sizeof(C)+sizeof(D)+sizeof(E));
+		MyProtocol::startPacket(sizeof(command)
+			+ serialized_size<protocolImplementation>(value_a)
+			+ serialized_size<protocolImplementation>(value_b)
+			+ serialized_size<protocolImplementation>(value_c)
+			+ serialized_size<protocolImplementation>(value_d)
+			+ serialized_size<protocolImplementation>(value_e));
 		MyProtocol::sendPreamble();
 		MyProtocol::sendData(command);
-		serialize<MyProtocol>(value_a);
-		serialize<MyProtocol>(value_b);
-		serialize<MyProtocol>(value_c);
-		serialize<MyProtocol>(value_d);
-		serialize<MyProtocol>(value_e);
+		serialize<protocolImplementation>(value_a);
+		serialize<protocolImplementation>(value_b);
+		serialize<protocolImplementation>(value_c);
+		serialize<protocolImplementation>(value_d);
+		serialize<protocolImplementation>(value_e);
 		MyProtocol::sendPostamble();
 	}
 
@@ -219,119 +975,265 @@ struct protocolImplementation
 					 const B value_b, const C value_c,
 					 const D value_d, const E value_e,
 					 const F value_f) {
-		MyProtocol::startPacket(sizeof(command)+ sizeof(A)+sizeof(B)+sizeof(C)+sizeof(D)+sizeof(E)+sizeof(F));
+		MyProtocol::startPacket(sizeof(command)
+			+ serialized_size<protocolImplementation>(value_a)
+			+ serialized_size<protocolImplementation>(value_b)
+			+ serialized_size<protocolImplementation>(value_c)
+			+ serialized_size<protocolImplementation>(value_d)
+			+ serialized_size<protocolImplementation>(value_e)
+			+ serialized_size<protocolImplementation>(value_f));
 		MyProtocol::sendPreamble();
 		MyProtocol::sendData(command);
-		serialize<MyProtocol>(value_a);
-		serialize<MyProtocol>(value_b);
-		serialize<MyProtocol>(value_c);
-		serialize<MyProtocol>(value_d);
-		serialize<MyProtocol>(value_e);
-		serialize<MyProtocol>(value_f);
+		serialize<protocolImplementation>(value_a);
+		serialize<protocolImplementation>(value_b);
+		serialize<protocolImplementation>(value_c);
+		serialize<protocolImplementation>(value_d);
+		serialize<protocolImplementation>(value_e);
+		serialize<protocolImplementation>(value_f);
 		MyProtocol::sendPostamble();
 	}
+
+	/* Bundled sends: same as send(), but the command is added to a
+	 bundle, which goes out as one frame with other commands when it
+	 fills up, on flushBundle(), or after a delay (see bundleSize and
+	 bundleDelay). Order is kept with respect to other sends. Protocols
+	 without bundles just send it. */
+
+	static inline void bundle(command_t command) {
+		MyProtocol::beginBundle();
+		send(command);
+	}
+
+	template<typename A>
+	static void bundle(command_t command, const A value_a) {
+		MyProtocol::beginBundle();
+		send(command,value_a);
+	}
+
+	template<typename A,typename B>
+	static void bundle(command_t command, const A value_a, const B value_b) {
+		MyProtocol::beginBundle();
+		send(command,value_a,value_b);
+	}
+
+	template<typename A,typename B,typename C>
+	static void bundle(command_t command, const A value_a, const B value_b, const C value_c) {
+		MyProtocol::beginBundle();
+		send(command,value_a,value_b,value_c);
+	}
+
+	template<typename A,typename B,typename C,typename D>
+	static void bundle(command_t command, const A value_a, const B value_b, const C value_c, const D value_d) {
+		MyProtocol::beginBundle();
+		send(command,value_a,value_b,value_c,value_d);
+	}
+
+	template<typename A,typename B,typename C,typename D,typename E>
+	static void bundle(command_t command, const A value_a, const B value_b, const C value_c, const D value_d, const E value_e) {
+		MyProtocol::beginBundle();
+		send(command,value_a,value_b,value_c,value_d,value_e);
+	}
+
+	template<typename A,typename B,typename C,typename D,typename E,typename F>
+	static void bundle(command_t command, const A value_a, const B value_b, const C value_c, const D value_d, const E value_e, const F value_f) {
+		MyProtocol::beginBundle();
+		send(command,value_a,value_b,value_c,value_d,value_e,value_f);
+	}
+
+	static inline void flushBundle() {
+		MyProtocol::flushBundle();
+	}
+
+	/* Unacknowledged sends: same as send(), but as UI frames, which
+	 carry no sequence number and get no acknowledge. A lost one is just
+	 lost. Good for telemetry. broadcast() sends it to every station.
+	 Only SerProHDLC makes a difference here. */
+
+	static inline void sendUnacknowledged(command_t command) {
+		MyProtocol::startUnacknowledged(false);
+		send(command);
+	}
+
+	template<typename A>
+	static void sendUnacknowledged(command_t command, const A value_a) {
+		MyProtocol::startUnacknowledged(false);
+		send(command,value_a);
+	}
+
+	template<typename A,typename B>
+	static void sendUnacknowledged(command_t command, const A value_a, const B value_b) {
+		MyProtocol::startUnacknowledged(false);
+		send(command,value_a,value_b);
+	}
+
+	template<typename A,typename B,typename C>
+	static void sendUnacknowledged(command_t command, const A value_a, const B value_b, const C value_c) {
+		MyProtocol::startUnacknowledged(false);
+		send(command,value_a,value_b,value_c);
+	}
+
+	template<typename A,typename B,typename C,typename D>
+	static void sendUnacknowledged(command_t command, const A value_a, const B value_b, const C value_c, const D value_d) {
+		MyProtocol::startUnacknowledged(false);
+		send(command,value_a,value_b,value_c,value_d);
+	}
+
+	template<typename A,typename B,typename C,typename D,typename E>
+	static void sendUnacknowledged(command_t command, const A value_a, const B value_b, const C value_c, const D value_d, const E value_e) {
+		MyProtocol::startUnacknowledged(false);
+		send(command,value_a,value_b,value_c,value_d,value_e);
+	}
+
+	template<typename A,typename B,typename C,typename D,typename E,typename F>
+	static void sendUnacknowledged(command_t command, const A value_a, const B value_b, const C value_c, const D value_d, const E value_e, const F value_f) {
+		MyProtocol::startUnacknowledged(false);
+		send(command,value_a,value_b,value_c,value_d,value_e,value_f);
+	}
+
+	static inline void broadcast(command_t command) {
+		MyProtocol::startUnacknowledged(true);
+		send(command);
+	}
+
+	template<typename A>
+	static void broadcast(command_t command, const A value_a) {
+		MyProtocol::startUnacknowledged(true);
+		send(command,value_a);
+	}
+
+	template<typename A,typename B>
+	static void broadcast(command_t command, const A value_a, const B value_b) {
+		MyProtocol::startUnacknowledged(true);
+		send(command,value_a,value_b);
+	}
+
+	template<typename A,typename B,typename C>
+	static void broadcast(command_t command, const A value_a, const B value_b, const C value_c) {
+		MyProtocol::startUnacknowledged(true);
+		send(command,value_a,value_b,value_c);
+	}
+
+	template<typename A,typename B,typename C,typename D>
+	static void broadcast(command_t command, const A value_a, const B value_b, const C value_c, const D value_d) {
+		MyProtocol::startUnacknowledged(true);
+		send(command,value_a,value_b,value_c,value_d);
+	}
+
+	template<typename A,typename B,typename C,typename D,typename E>
+	static void broadcast(command_t command, const A value_a, const B value_b, const C value_c, const D value_d, const E value_e) {
+		MyProtocol::startUnacknowledged(true);
+		send(command,value_a,value_b,value_c,value_d,value_e);
+	}
+
+	template<typename A,typename B,typename C,typename D,typename E,typename F>
+	static void broadcast(command_t command, const A value_a, const B value_b, const C value_c, const D value_d, const E value_e, const F value_f) {
+		MyProtocol::startUnacknowledged(true);
+		send(command,value_a,value_b,value_c,value_d,value_e,value_f);
+	}
 };
 
 
 template<class SerPro,typename A>
 	struct deserialize {
 		typedef typename SerPro::buffer_size_t buffer_size_t;
-		static A deser(const unsigned char *b, buffer_size_t &pos);
+		static A deser(const unsigned char *b, buffer_size_t &pos, buffer_size_t size);
 	};
 
 	/* To avoid possible errors with unknown structures, we define
 	 simple deserialization for POT, and leave above undefined.
 	 */
 
-	template<class SerPro>
-		struct deserialize<SerPro,uint8_t> {
-			typedef typename SerPro::buffer_size_t buffer_size_t;
-			static inline uint8_t deser(const unsigned char *b, buffer_size_t &pos) {
-				uint8_t value = *((uint8_t*)&b[pos]);
-				pos+=sizeof(uint8_t);
-				return value;
-			}
-		};
+	/* Integers go through the encoding selected in the configuration */
 
-	template<class SerPro>
-		struct deserialize<SerPro,int8_t> {
-			typedef typename SerPro::buffer_size_t buffer_size_t;
-			static inline int8_t deser(const unsigned char *b, buffer_size_t &pos) {
-				int8_t value = *(int8_t*)&b[pos];
-				pos+=sizeof(int8_t);
-				return value;
-			}
-		};
+#define DESERIALIZE_INTEGRAL(type) \
+	template<class SerPro> \
+		struct deserialize<SerPro,type>: public SerPro::Encoding::template decoder<SerPro,type> {};
 
-	template<class SerPro>
-		struct deserialize<SerPro,uint16_t> {
-			typedef typename SerPro::buffer_size_t buffer_size_t;
-			static inline uint16_t deser(const unsigned char *b, buffer_size_t &pos) {
-				uint16_t value = *(uint16_t*)&b[pos];
-				pos+=sizeof(uint16_t);
-				return value;
-			}
-		};
+	DESERIALIZE_INTEGRAL(uint8_t)
+	DESERIALIZE_INTEGRAL(int8_t)
+	DESERIALIZE_INTEGRAL(uint16_t)
+	DESERIALIZE_INTEGRAL(int16_t)
+	DESERIALIZE_INTEGRAL(uint32_t)
+	DESERIALIZE_INTEGRAL(int32_t)
+	DESERIALIZE_INTEGRAL(uint64_t)
+	DESERIALIZE_INTEGRAL(int64_t)
+	DESERIALIZE_INTEGRAL(float)
+
+	/* Old-style strings. These are not length-prefixed, so we have to
+	 scan for the terminator, and the result is only terminated if the
+	 sender included it. Use CountedString instead. */
 
 	template<class SerPro>
-		struct deserialize<SerPro,int16_t> {
+		struct deserialize<SerPro,char*> {
 			typedef typename SerPro::buffer_size_t buffer_size_t;
-			static inline int16_t deser(const unsigned char *b, buffer_size_t &pos) {
-				int8_t value = *(int8_t*)&b[pos];
-				pos+=sizeof(int16_t);
+			static char* deser(const unsigned char *b, buffer_size_t &pos, buffer_size_t size) {
+				char *value = (char*)&b[pos];
+				const unsigned char *end;
+				if (!deserialize_check(pos,size,0))
+					return value;
+				end = (const unsigned char*)memchr(&b[pos],0,size-pos);
+				pos = end ? end-b : size;
 				return value;
 			}
 		};
 
 	template<class SerPro>
-		struct deserialize<SerPro,int32_t> {
+		struct deserialize<SerPro,CountedBuffer> {
 			typedef typename SerPro::buffer_size_t buffer_size_t;
-			static inline int32_t deser(const unsigned char *b, buffer_size_t &pos) {
-				int value = *(int*)&b[pos];
-				pos+=sizeof(int32_t);
+			static inline CountedBuffer deser(const unsigned char *b, buffer_size_t &pos, buffer_size_t size) {
+				CountedBuffer value;
+				unsigned int len = deserialize_varint<unsigned int>(b,pos,size);
+				if (deserialize_check(pos,size,len)) {
+					value.buffer = &b[pos];
+					value.size = len;
+					pos+=len;
+				}
 				return value;
 			}
 		};
 
 	template<class SerPro>
-		struct deserialize<SerPro,uint32_t> {
+		struct deserialize<SerPro,CountedString> {
 			typedef typename SerPro::buffer_size_t buffer_size_t;
-			static inline uint32_t deser(const unsigned char *b, buffer_size_t &pos) {
-				uint32_t value = *(int*)&b[pos];
-				pos+=sizeof(uint32_t);
-				return value;
+			static inline CountedString deser(const unsigned char *b, buffer_size_t &pos, buffer_size_t size) {
+				CountedBuffer buf = deserialize<SerPro,CountedBuffer>::deser(b,pos,size);
+				return CountedString((const char*)buf.buffer,buf.size);
 			}
 		};
 
-	template<class SerPro>
-		struct deserialize<SerPro,char*> {
-			typedef typename SerPro::buffer_size_t buffer_size_t;
-			static char* deser(const unsigned char *b, buffer_size_t &pos) {
-				char *value = (char*)&b[pos];
-				pos+=strlen(value);
-				return value;
+	template<class SerPro, class STRUCT, bool = serpro_delta<STRUCT>::value>
+	struct deserialize_struct {
+		typedef typename SerPro::buffer_size_t buffer_size_t;
+			static const STRUCT *deser(const unsigned char *b, buffer_size_t &pos, buffer_size_t size) {
+				if (!deserialize_check(pos,size,sizeof(STRUCT)))
+					return 0;
+				STRUCT *p = (STRUCT*)&b[pos];
+				pos+=sizeof(STRUCT);
+				return p;
 			}
 		};
 
-
+	/* See DELTA_STRUCT */
 	template<class SerPro, class STRUCT>
-	struct deserialize<SerPro,const STRUCT*> {
+	struct deserialize_struct<SerPro,STRUCT,true> {
 		typedef typename SerPro::buffer_size_t buffer_size_t;
-			static const STRUCT *deser(const unsigned char *b, buffer_size_t &pos) {
-				STRUCT *p = (STRUCT*)b;
-				pos+=sizeof(STRUCT);
-				return p;
+			static inline const STRUCT *deser(const unsigned char *b, buffer_size_t &pos, buffer_size_t size) {
+				return delta_stream<SerPro,STRUCT>::receive(SerPro::rxCommand,b,pos,size);
 			}
 		};
 
+	template<class SerPro, class STRUCT>
+	struct deserialize<SerPro,const STRUCT*>: public deserialize_struct<SerPro,STRUCT> {};
+
 
 	template<class SerPro,unsigned int BUFSIZE>
 	struct deserialize < SerPro, FixedBuffer<BUFSIZE> > {
 		typedef typename SerPro::buffer_size_t buffer_size_t;
-			static FixedBuffer<BUFSIZE> deser(const unsigned char *b, buffer_size_t &pos) {
+			static FixedBuffer<BUFSIZE> deser(const unsigned char *b, buffer_size_t &pos, buffer_size_t size) {
 				FixedBuffer<BUFSIZE> buf;
 				buf.buffer=(unsigned char*)&b[pos];
-				pos+=BUFSIZE;
+				if (deserialize_check(pos,size,BUFSIZE))
+					pos+=BUFSIZE;
 				return buf;
 			}
 		};
@@ -345,7 +1247,7 @@ template<class SerPro,typename A>
 	template<class SerPro>
 	struct deserializer<SerPro, void ()> {
 		typedef typename SerPro::buffer_size_t buffer_size_t;
-			static inline void handle(const unsigned char *,buffer_size_t &pos, void (*func)(void)) {
+			static inline void handle(const unsigned char *,buffer_size_t &pos, buffer_size_t size, void (*func)(void)) {
 				func();
 			}
 		};
@@ -353,9 +1255,10 @@ template<class SerPro,typename A>
 	template<class SerPro, typename A>
 	struct deserializer<SerPro, void (A)> {
 		typedef typename SerPro::buffer_size_t buffer_size_t;
-		static inline void handle(const unsigned char *b, buffer_size_t &pos, void (*func)(A)) {
-			A val_a=deserialize<SerPro,A>::deser(b,pos);
-			func(val_a);
+		static inline void handle(const unsigned char *b, buffer_size_t &pos, buffer_size_t size, void (*func)(A)) {
+			A val_a=deserialize<SerPro,A>::deser(b,pos,size);
+			if (deserialize_done())
+				func(val_a);
 		}
 	};
 
@@ -363,46 +1266,81 @@ template<class SerPro,typename A>
 	template<class SerPro, typename A,typename B>
 	struct deserializer<SerPro, void (A,B)> {
 		typedef typename SerPro::buffer_size_t buffer_size_t;
-		static inline void handle(const unsigned char *b, buffer_size_t &pos, void (*func)(A,B)) {
-			A val_a=deserialize<SerPro,A>::deser(b,pos);
-			B val_b=deserialize<SerPro,B>::deser(b,pos);
-			func(val_a,val_b);
+		static inline void handle(const unsigned char *b, buffer_size_t &pos, buffer_size_t size, void (*func)(A,B)) {
+			A val_a=deserialize<SerPro,A>::deser(b,pos,size);
+			B val_b=deserialize<SerPro,B>::deser(b,pos,size);
+			if (deserialize_done())
+				func(val_a,val_b);
 		}
 	};
 
 	template<class SerPro, typename A,typename B, typename C>
 	struct deserializer<SerPro, void (A,B,C)> {
 		typedef typename SerPro::buffer_size_t buffer_size_t;
-		static inline void handle(const unsigned char *b, buffer_size_t &pos, void (*func)(A, B, C)) {
-			A val_a=deserialize<SerPro,A>::deser(b,pos);
-			B val_b=deserialize<SerPro,B>::deser(b,pos);
-			C val_c=deserialize<SerPro,C>::deser(b,pos);
-			func(val_a, val_b, val_c);
+		static inline void handle(const unsigned char *b, buffer_size_t &pos, buffer_size_t size, void (*func)(A, B, C)) {
+			A val_a=deserialize<SerPro,A>::deser(b,pos,size);
+			B val_b=deserialize<SerPro,B>::deser(b,pos,size);
+			C val_c=deserialize<SerPro,C>::deser(b,pos,size);
+			if (deserialize_done())
+				func(val_a, val_b, val_c);
 		}
 	};
 
 	template<class SerPro, typename A,typename B, typename C,typename D>
 	struct deserializer<SerPro, void (A,B,C,D)> {
 		typedef typename SerPro::buffer_size_t buffer_size_t;
-		static inline void handle(const unsigned char *b, buffer_size_t &pos, void (*func)(A, B, C, D)) {
-			A val_a=deserialize<SerPro,A>::deser(b,pos);
-			B val_b=deserialize<SerPro,B>::deser(b,pos);
-			C val_c=deserialize<SerPro,C>::deser(b,pos);
-			D val_d=deserialize<SerPro,D>::deser(b,pos);
-			func(val_a, val_b, val_c, val_d);
+		static inline void handle(const unsigned char *b, buffer_size_t &pos, buffer_size_t size, void (*func)(A, B, C, D)) {
+			A val_a=deserialize<SerPro,A>::deser(b,pos,size);
+			B val_b=deserialize<SerPro,B>::deser(b,pos,size);
+			C val_c=deserialize<SerPro,C>::deser(b,pos,size);
+			D val_d=deserialize<SerPro,D>::deser(b,pos,size);
+			if (deserialize_done())
+				func(val_a, val_b, val_c, val_d);
 		}
 	};
 
 	template<class SerPro, typename A,typename B, typename C,typename D,typename E>
 	struct deserializer<SerPro, void (A,B,C,D,E)> {
 		typedef typename SerPro::buffer_size_t buffer_size_t;
-		static inline void handle(const unsigned char *b, buffer_size_t &pos, void (*func)(A, B, C, D, E)) {
-			A val_a=deserialize<SerPro,A>::deser(b,pos);
-			B val_b=deserialize<SerPro,B>::deser(b,pos);
-			C val_c=deserialize<SerPro,C>::deser(b,pos);
-			D val_d=deserialize<SerPro,D>::deser(b,pos);
-			E val_e=deserialize<SerPro,E>::deser(b,pos);
-			func(val_a, val_b, val_c, val_d, val_e);
+		static inline void handle(const unsigned char *b, buffer_size_t &pos, buffer_size_t size, void (*func)(A, B, C, D, E)) {
+			A val_a=deserialize<SerPro,A>::deser(b,pos,size);
+			B val_b=deserialize<SerPro,B>::deser(b,pos,size);
+			C val_c=deserialize<SerPro,C>::deser(b,pos,size);
+			D val_d=deserialize<SerPro,D>::deser(b,pos,size);
+			E val_e=deserialize<SerPro,E>::deser(b,pos,size);
+			if (deserialize_done())
+				func(val_a, val_b, val_c, val_d, val_e);
+		}
+	};
+
+	/* Streaming functions, when the payload did not come in chunks
+	 (bundles, reassembled fragments, or protocols that don't stream):
+	 all of it goes in one chunk. */
+	template<class SerPro>
+	struct deserializer<SerPro, void (serpro_stream_event, const unsigned char*, unsigned int)> {
+		typedef typename SerPro::buffer_size_t buffer_size_t;
+		static void handle(const unsigned char *b, buffer_size_t &pos, buffer_size_t size,
+						   void (*func)(serpro_stream_event, const unsigned char*, unsigned int)) {
+			if (pos<size)
+				func(STREAM_CHUNK,&b[pos],size-pos);
+			func(STREAM_COMMIT,0,1);
+		}
+	};
+
+	template<class Handler>
+	struct streamFunctionHandler {
+		static void handle(serpro_stream_event event, const unsigned char *data, unsigned int size) {
+			switch (event) {
+			case STREAM_CHUNK:
+				Handler::onChunk(data,size);
+				break;
+			case STREAM_COMMIT:
+				Handler::onCommit(size!=0);
+				break;
+			case STREAM_ABORT:
+				Handler::onAbort();
+				break;
+			}
 		}
 	};
 
@@ -413,6 +1351,10 @@ template<class SerPro,typename A>
 		};
 
 
+/* With SerProHDLC, functions 253 to 255 are taken by compressed
+ commands, fragments and bundles, so maxFunctions must be at most 253
+ there. */
+
 #define DECLARE_FUNCTION(x) \
 	template<> \
 	struct functionHandler<x> { \
@@ -423,6 +1365,19 @@ template<class SerPro,typename A>
 	struct functionHandler<x> { \
 	static inline void handle
 
+/* Streaming function. Declare these inside:
+
+ static void onChunk(const unsigned char *data, unsigned int size);
+ static void onCommit(bool crcOk);
+ static void onAbort();
+
+ Chunks are not checked until onCommit(): undo or ignore what they did
+ if crcOk is false. Replies should be sent from onCommit(). */
+
+#define DECLARE_STREAM_FUNCTION(x) \
+	template<> \
+	struct functionHandler<x>: public streamFunctionHandler< functionHandler<x> > {
+
 #define END_FUNCTION };
 
 
@@ -430,7 +1385,7 @@ template<class SerPro,typename A>
 	typedef protocolImplementation<config,serial,proto> name; \
 	template<> \
 	struct deserializer<name, void (const name::RawBuffer &)> { \
-	static void handle(const unsigned char *b, name::buffer_size_t &pos, void (*func)(const name::RawBuffer &)) { \
+	static void handle(const unsigned char *b, name::buffer_size_t &pos, name::buffer_size_t size, void (*func)(const name::RawBuffer &)) { \
 	func( name::MyProtocol::getRawBuffer() ); \
 	} \
 	};\
@@ -444,11 +1399,12 @@ template<class SerPro,typename A>
 
 #define IMPLEMENT_SERPRO(num,name,proto) \
 	typedef void(*serpro_function_type)(void); \
-	typedef void(*serpro_deserializer_type)(const unsigned char*, name::buffer_size_t& pos,void(*)(void)); \
+	typedef void(*serpro_deserializer_type)(const unsigned char*, name::buffer_size_t& pos,name::buffer_size_t size,void(*)(void)); \
 	template<> \
 	name::callback const name::callbacks[] = { \
 	DO_EXPAND(num) \
 	}; \
+	template<> name::command_t name::rxCommand=0; \
 	IMPLEMENT_PROTOCOL_##proto(name)
 
 
@@ -0,0 +1,130 @@
+/*
+ SerPro - A serial protocol for arduino intercommunication
+ Copyright (C) 2009 Alvaro Lopes <alvieboy@alvie.com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 3 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General
+ Public License along with this library; if not, write to the
+ Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301 USA
+ */
+
+/*
+ What the benchmarks that run SerProTransfer between two processes
+ over pty pairs have in common (SerProTransfer-bench.cpp and
+ SerProBond-bench.cpp): the clock, the pty pairs, the data sent, and
+ the receiver's storage. Host only, include it once per program.
+ */
+
+#ifndef __SERPRO_BENCH_H__
+#define __SERPRO_BENCH_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <termios.h>
+#include "SerProTransfer.h"
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Timer ticks, one per millisecond, due since lastTick */
+static inline unsigned int ticksDue(double &lastTick)
+{
+	unsigned int n = 0;
+	double t = now();
+	while (t-lastTick >= 0.001) {
+		lastTick += 0.001;
+		n++;
+	}
+	return n;
+}
+
+/* A pty pair in raw mode. False, after saying why, if there is none. */
+static bool openPty(int &master, int &slave)
+{
+	master = posix_openpt(O_RDWR|O_NOCTTY);
+	if (master<0 || grantpt(master)<0 || unlockpt(master)<0) {
+		perror("pty");
+		return false;
+	}
+	slave = open(ptsname(master),O_RDWR|O_NOCTTY);
+	if (slave<0) {
+		perror(ptsname(master));
+		return false;
+	}
+	struct termios tio;
+	tcgetattr(slave,&tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave,TCSANOW,&tio);
+	return true;
+}
+
+/* What to send: the file named, or without one 'size' bytes of
+ pseudo-random data. False if the file cannot be mapped. */
+static bool benchData(const char *name, MappedFile &file, const unsigned char *&data, uint32_t &size)
+{
+	if (name) {
+		if (!file.open(name)) {
+			fprintf(stderr,"Cannot map %s\n",name);
+			return false;
+		}
+		data = file.data;
+		size = file.size;
+		return true;
+	}
+	unsigned char *d = (unsigned char*)malloc(size);
+	uint32_t x = 1;
+	for (uint32_t i=0;i<size;i++) {
+		x = x*1103515245+12345;
+		d[i] = x>>16;
+	}
+	data = d;
+	return true;
+}
+
+/* The receiver keeps it all in memory, to check it at the end */
+
+static unsigned char *received = 0;
+static uint32_t receivedSize = 0;
+static bool receiveEnded = false;
+
+struct MemoryStorage {
+	static bool begin(uint32_t, uint32_t size) {
+		free(received);
+		received = (unsigned char*)malloc(size);
+		receivedSize = size;
+		return received!=0;
+	}
+	static void write(uint32_t offset, const unsigned char *data, unsigned int size) {
+		memcpy(received+offset,data,size);
+	}
+	static void read(uint32_t offset, unsigned char *data, unsigned int size) {
+		memcpy(data,received+offset,size);
+	}
+	static void end(uint32_t, bool) {
+		receiveEnded = true;
+	}
+};
+
+static inline bool receivedMatches(const unsigned char *data, uint32_t size)
+{
+	return receivedSize==size && memcmp(received,data,size)==0;
+}
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ Link bonding benchmark: SerProTransfer over one to four pty pairs.
+
+ A pty has no baud rate, so every link here is held to -r bytes per
+ second (default 11520, a 115200 baud UART), in both directions; with
+ more links the transfer should get faster by about as many times.
+ With -l, that percent of frames is thrown away on every link. With -k,
+ the last link goes dead (in both directions) that many seconds into
+ the run, and the transfer must carry on over the others.
+
+ The parent sends 256 KiB of pseudo-random data (or a file), the child
+ receives and checks it.
+
+ Build: g++ -O2 -o bond-bench SerProBond-bench.cpp crc16.cpp
+ Run:   ./bond-bench [-n links] [-r bytes/s] [-l percent] [-k seconds] [file]
+ */
+
+#define SERPRO_NO_LOG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <vector>
+#include "SerProHDLC.h"
+#include "SerPro.h"
+#include "SerProTransfer.h"
+#include "SerProBond.h"
+#include "SerProBench.h"
+
+static unsigned int numLinks = 2;
+static double rate = 11520;
+static int lossPercent = 0;
+static double killAt = 0;
+static double startTime;
+
+/* One link: a pty, with what is still to go out at the line rate */
+struct Line {
+	int fd;
+	std::vector<unsigned char> frame;
+	std::vector<unsigned char> queue;
+	size_t queued;
+	double credit;
+
+	bool dead() const {
+		return killAt>0 && this==&lines[numLinks-1] && now()-startTime >= killAt;
+	}
+
+	void pump(double elapsed) {
+		credit += elapsed*rate;
+		if (queued==queue.size()) {
+			queue.clear();
+			queued = 0;
+			if (credit>rate/100)
+				credit = rate/100;
+			return;
+		}
+		size_t n = (size_t)credit;
+		if (n>queue.size()-queued)
+			n = queue.size()-queued;
+		if (n==0)
+			return;
+		ssize_t r = ::write(fd,&queue[queued],n);
+		if (r<=0)
+			exit(1);
+		queued += r;
+		credit -= r;
+	}
+
+	static Line lines[4];
+};
+
+Line Line::lines[4];
+
+template<unsigned int n>
+	struct LinkWrapper
+	{
+		static void write(uint8_t v) {
+			Line::lines[n].frame.push_back(v);
+		}
+		static void flush() {
+			Line &l = Line::lines[n];
+			if (n<numLinks && !l.dead() && !(lossPercent && rand()%100 < lossPercent))
+				l.queue.insert(l.queue.end(),l.frame.begin(),l.frame.end());
+			l.frame.clear();
+		}
+	};
+
+struct BenchConfig {
+	static unsigned int const maxFunctions = 5;
+	static unsigned int const maxPacketSize = 255;
+	static unsigned int const stationId = 3;
+	static uint8_t const transferWindow = 16;
+	static uint16_t const transferTimeout = 1000;
+	static uint8_t const bondReorder = 8;
+};
+
+typedef SerProBond<BenchConfig,LinkWrapper<0>,LinkWrapper<1>,LinkWrapper<2>,LinkWrapper<3> > Bond;
+
+DECLARE_SERPRO(BenchConfig,Bond,SerProHDLC,SerPro);
+
+typedef SerProTransfer<SerPro,0,(16UL<<20)/64,MemoryStorage> Transfer;
+
+DECLARE_TRANSFER_FUNCTIONS(0,Transfer)
+
+IMPLEMENT_SERPRO(5,SerPro,SerProHDLC);
+IMPLEMENT_TRANSFER(Transfer);
+IMPLEMENT_BOND(Bond);
+
+/* Move bytes both ways, and tick once per millisecond */
+static void run(double &lastTick)
+{
+	unsigned char buf[4096];
+	struct pollfd p[4];
+	unsigned int i;
+	for (i=0; i<numLinks; i++) {
+		p[i].fd = Line::lines[i].fd;
+		p[i].events = POLLIN;
+	}
+	if (poll(p,numLinks,1)>0) {
+		for (i=0; i<numLinks; i++) {
+			if (!(p[i].revents & POLLIN))
+				continue;
+			ssize_t r = read(p[i].fd,buf,sizeof(buf));
+			if (r<=0)
+				exit(1);
+			if (Line::lines[i].dead())
+				continue;
+			for (ssize_t j=0; j<r; j++)
+				Bond::processData(i,buf[j]);
+		}
+	}
+	static double lastPump = now();
+	double t = now();
+	for (i=0; i<numLinks; i++)
+		Line::lines[i].pump(t-lastPump);
+	lastPump = t;
+	unsigned int ticks = ticksDue(lastTick);
+	while (ticks--) {
+		SerPro::timerTick();
+		Transfer::timerTick();
+		Bond::timerTick();
+	}
+}
+
+int main(int argc, char **argv)
+{
+	MappedFile file;
+	const unsigned char *data;
+	uint32_t size;
+
+	int arg = 1;
+	while (arg+1<argc && argv[arg][0]=='-') {
+		if (strcmp(argv[arg],"-n")==0)
+			numLinks = atoi(argv[arg+1]);
+		else if (strcmp(argv[arg],"-r")==0)
+			rate = atof(argv[arg+1]);
+		else if (strcmp(argv[arg],"-l")==0)
+			lossPercent = atoi(argv[arg+1]);
+		else if (strcmp(argv[arg],"-k")==0)
+			killAt = atof(argv[arg+1]);
+		arg += 2;
+	}
+	if (numLinks<1 || numLinks>4) {
+		fprintf(stderr,"One to four links\n");
+		return 1;
+	}
+
+	size = 256<<10;
+	if (!benchData(argc>arg ? argv[arg] : 0,file,data,size))
+		return 1;
+
+	int masters[4], slaves[4];
+	unsigned int i;
+	for (i=0; i<numLinks; i++) {
+		if (!openPty(masters[i],slaves[i]))
+			return 1;
+	}
+
+	startTime = now();
+	double lastTick = startTime;
+	Bond::setReceiver(&SerPro::processData,SerPro::MyProtocol::escapeTx);
+
+	pid_t child = fork();
+	srand(child ? 1 : 2);
+	if (child==0) {
+		/* Receiver */
+		for (i=0; i<numLinks; i++) {
+			close(masters[i]);
+			Line::lines[i].fd = slaves[i];
+		}
+		while (!receiveEnded)
+			run(lastTick);
+		unsigned int up = Bond::linksUp();
+		/* Let the final status get out */
+		double until = now()+0.5;
+		while (now()<until)
+			run(lastTick);
+		bool same = receivedMatches(data,size);
+		printf("receiver: %u bytes, %s, links up: %u\n",
+			   receivedSize,same ? "match" : "MISMATCH",up);
+		return same ? 0 : 1;
+	}
+
+	/* Sender */
+	for (i=0; i<numLinks; i++) {
+		close(slaves[i]);
+		Line::lines[i].fd = masters[i];
+	}
+
+	/* Let the links be seen before timing */
+	while (Bond::linksUp()<numLinks && now()-startTime<1)
+		run(lastTick);
+
+	double start = now();
+	Transfer::start(1,data,size);
+	while (Transfer::getRole()==Transfer::SENDING)
+		run(lastTick);
+	double elapsed = now()-start;
+
+	printf("sender: %u links at %.0f B/s, %u bytes, %.3f s, %.1f KiB/s (%.0f%% of one link), %s\n",
+		   numLinks, rate, size, elapsed, size/elapsed/1024, 100*size/elapsed/rate,
+		   Transfer::getRole()==Transfer::DONE ? "done" : "FAILED");
+
+	int status;
+	waitpid(child,&status,0);
+	file.close();
+	return Transfer::getRole()==Transfer::DONE && WIFEXITED(status) && WEXITSTATUS(status)==0 ? 0 : 1;
+}
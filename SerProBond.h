@@ -0,0 +1,492 @@
+/*
+ SerPro - A serial protocol for arduino intercommunication
+ Copyright (C) 2009 Alvaro Lopes <alvieboy@alvie.com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 3 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General
+ Public License along with this library; if not, write to the
+ Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301 USA
+ */
+
+/*
+ Link bonding: one SerProHDLC session over two to four serial ports.
+
+ SerProBond is the Serial class given to the protocol. Each frame the
+ protocol writes goes whole to one member link, taking turns among the
+ links that are up, so all of them send at once. Right after the
+ opening flag it gets two more bytes: the bond sequence number, which
+ counts frames over all links, and the link sequence number, which
+ counts them on that link only and shows frames lost on it.
+
+ Bytes received on each member go to processData(link, byte). Frames
+ are put back in bond order before they reach the protocol, and held
+ for that in up to bondReorder slots. Each link carries frames in
+ order, so once every link that is up has gone past a sequence number
+ that never came, it was lost and we move on (the protocol's own
+ recovery takes it from there).
+
+ Links that have nothing to send get a keepalive, an empty frame,
+ every bondKeepalive ticks. It also tells the next bond sequence
+ number, so a missing frame is noticed on idle links too. A link we
+ hear nothing on for bondTimeout ticks is down: nothing is sent on it,
+ and it is not waited for. It is up again as soon as something arrives.
+
+ Both sides must use the same links in the same order. Unused ones are
+ SerProNoLink. Links must provide static write(uint8_t) and flush().
+
+ Frames reach the protocol escaped again, with the map given to
+ setReceiver(): the protocol's escapeTx, so characters it wants escaped
+ never come in bare. Without a map, control characters are escaped.
+
+ DECLARE_SERPRO(Config, Bond, SerProHDLC, SerPro);
+ Bond::setReceiver(&SerPro::processData, SerPro::MyProtocol::escapeTx);
+ */
+
+#ifndef __SERPRO_BOND_H__
+#define __SERPRO_BOND_H__
+
+#include <string.h>
+#include "config_options.h"
+#include "SerProHDLC.h"
+
+/* Ticks without sending on a link before we send a keepalive */
+CONFIG_OPTION(bondKeepalive, uint16_t, 100)
+/* Ticks without hearing a link before it is down */
+CONFIG_OPTION(bondTimeout, uint16_t, 350)
+/* Frames held back to put them in order */
+CONFIG_OPTION(bondReorder, uint8_t, 4)
+/* Largest frame we take, after unescaping. Zero is maxPacketSize plus
+ the FEC parity SerProHDLC may add to it. Frames for streaming
+ functions can be larger than maxPacketSize; make it as large as the
+ largest of those, or they are dropped. */
+CONFIG_OPTION(bondFrameSize, unsigned int, 0)
+
+struct SerProNoLink
+{
+	static inline void write(uint8_t) {}
+	static inline void flush() {}
+};
+
+template<class A>
+	struct bond_link_used {
+		static unsigned int const value = 1;
+	};
+
+template<>
+	struct bond_link_used<SerProNoLink> {
+		static unsigned int const value = 0;
+	};
+
+template<class Config, class Link0, class Link1,
+	class Link2=SerProNoLink, class Link3=SerProNoLink>
+class SerProBond
+{
+public:
+	static uint8_t const frameFlag = 0x7E;
+	static uint8_t const escapeFlag = 0x7D;
+	static uint8_t const escapeXOR = 0x20;
+
+	static unsigned int const numLinks = 2 +
+		bond_link_used<Link2>::value + bond_link_used<Link3>::value;
+	static unsigned int const fecParity =
+		config_option_fecParity<Config>::value > ReedSolomon::maxParity ?
+		ReedSolomon::maxParity : config_option_fecParity<Config>::value;
+	static unsigned int const frameSize = config_option_bondFrameSize<Config>::value ?
+		config_option_bondFrameSize<Config>::value :
+		Config::maxPacketSize + (Config::maxPacketSize/(255-fecParity)+1)*fecParity;
+	static unsigned int const reorderSlots = config_option_bondReorder<Config>::value;
+
+	struct Member {
+		/* Receiving */
+		bool inFrame;
+		bool unEscaping;
+		uint8_t header;         // Header bytes so far
+		uint8_t seq;            // Bond sequence of the frame
+		uint8_t linkSeq;        // Link sequence of the frame
+		uint8_t rxLinkSeq;      // Next link sequence expected
+		uint8_t next;           // Bond sequence after the last one here
+		uint16_t size;
+		unsigned char buf[frameSize];
+		bool up;
+		uint16_t idle;          // Ticks since we heard it
+		uint16_t lost;          // Frames missing on this link, wraps
+		/* Sending */
+		uint8_t txLinkSeq;
+		uint16_t txIdle;        // Ticks since we sent on it
+	};
+
+	struct Slot {
+		bool used;
+		uint8_t seq;
+		uint16_t size;
+		unsigned char buf[frameSize];
+	};
+
+	typedef void (*receiver_t)(uint8_t);
+
+	static Member members[numLinks];
+	static Slot slots[reorderSlots ? reorderSlots : 1];
+	static receiver_t receiver;
+	static const uint8_t *rxEscape; // Map frames are escaped with for it
+	static uint8_t expected;        // Next bond sequence to deliver
+	static uint8_t txSeq;           // Next bond sequence to send
+	static uint8_t txLink;          // Link of the frame being sent
+	static bool txInFrame;
+	static uint8_t lastLink;
+
+	static inline void setReceiver(receiver_t r, const uint8_t *escapeMap=0)
+	{
+		receiver = r;
+		rxEscape = escapeMap;
+	}
+
+	static inline bool isUp(uint8_t link)
+	{
+		return link<numLinks && members[link].up;
+	}
+
+	static uint8_t linksUp()
+	{
+		uint8_t i, n = 0;
+		for (i=0; i<numLinks; i++)
+			n += members[i].up;
+		return n;
+	}
+
+	/* Serial interface, for the protocol */
+
+	static void write(uint8_t v)
+	{
+		if (!txInFrame) {
+			if (v!=frameFlag) {
+				/* Not a frame, nothing we can do with it */
+				return;
+			}
+			txLink = pick();
+			txInFrame = true;
+			startFrame(txLink,txSeq);
+			return;
+		}
+		linkWrite(txLink,v);
+		if (v==frameFlag) {
+			txInFrame = false;
+			txSeq++;
+		}
+	}
+
+	static void flush()
+	{
+		linkFlush(txLink);
+	}
+
+	/* Bytes received on one of the links */
+	static void processData(uint8_t link, uint8_t v)
+	{
+		if (link>=numLinks)
+			return;
+		Member &m = members[link];
+
+		if (v==frameFlag) {
+			if (m.unEscaping) {
+				/* Abort sequence */
+				m.unEscaping = false;
+			} else if (m.inFrame && m.header==2) {
+				frameReceived(link);
+			}
+			m.inFrame = true;
+			m.header = 0;
+			m.size = 0;
+			return;
+		}
+		if (v==escapeFlag) {
+			m.unEscaping = true;
+			return;
+		}
+		if (m.unEscaping) {
+			v ^= escapeXOR;
+			m.unEscaping = false;
+		}
+		if (!m.inFrame)
+			return;
+
+		if (m.header==0) {
+			m.seq = v;
+			m.header++;
+		} else if (m.header==1) {
+			m.linkSeq = v;
+			m.header++;
+		} else if (m.size<frameSize) {
+			m.buf[m.size++] = v;
+		} else {
+			LOG("Bond link %u: frame too long\n", link);
+			m.inFrame = false;
+		}
+	}
+
+	static void timerTick()
+	{
+		uint8_t i;
+		for (i=0; i<numLinks; i++) {
+			Member &m = members[i];
+			if (m.up && ++m.idle >= config_option_bondTimeout<Config>::value) {
+				LOG("Bond link %u down\n", i);
+				m.up = false;
+				advance();
+			}
+			if (++m.txIdle >= config_option_bondKeepalive<Config>::value && !txInFrame) {
+				startFrame(i,txSeq);
+				linkWrite(i,frameFlag);
+				linkFlush(i);
+			}
+		}
+	}
+
+protected:
+	static void linkWrite(uint8_t link, uint8_t v)
+	{
+		switch (link) {
+		case 0: Link0::write(v); break;
+		case 1: Link1::write(v); break;
+		case 2: Link2::write(v); break;
+		case 3: Link3::write(v); break;
+		}
+	}
+
+	static void linkFlush(uint8_t link)
+	{
+		switch (link) {
+		case 0: Link0::flush(); break;
+		case 1: Link1::flush(); break;
+		case 2: Link2::flush(); break;
+		case 3: Link3::flush(); break;
+		}
+	}
+
+	static void linkWriteEscaped(uint8_t link, uint8_t v)
+	{
+		if (v==frameFlag || v==escapeFlag || v<0x20) {
+			linkWrite(link,escapeFlag);
+			linkWrite(link,v ^ escapeXOR);
+		} else {
+			linkWrite(link,v);
+		}
+	}
+
+	static void startFrame(uint8_t link, uint8_t seq)
+	{
+		Member &m = members[link];
+		linkWrite(link,frameFlag);
+		linkWriteEscaped(link,seq);
+		linkWriteEscaped(link,m.txLinkSeq++);
+		m.txIdle = 0;
+	}
+
+	/* Next link that is up, or any if none is */
+	static uint8_t pick()
+	{
+		uint8_t n;
+		for (n=1; n<=numLinks; n++) {
+			uint8_t i = (lastLink+n) % numLinks;
+			if (members[i].up) {
+				lastLink = i;
+				return i;
+			}
+		}
+		lastLink = (lastLink+1) % numLinks;
+		return lastLink;
+	}
+
+	static inline bool rxMustEscape(uint8_t v)
+	{
+		if (v==frameFlag || v==escapeFlag)
+			return true;
+		if (rxEscape)
+			return rxEscape[v>>3] & (1<<(v&7));
+		return v<0x20;
+	}
+
+	static void deliver(const unsigned char *buf, uint16_t size)
+	{
+		uint16_t i;
+		if (!receiver)
+			return;
+		receiver(frameFlag);
+		for (i=0; i<size; i++) {
+			if (rxMustEscape(buf[i])) {
+				receiver(escapeFlag);
+				receiver(buf[i] ^ escapeXOR);
+			} else {
+				receiver(buf[i]);
+			}
+		}
+		receiver(frameFlag);
+	}
+
+	static void frameReceived(uint8_t link)
+	{
+		Member &m = members[link];
+		if (!m.up) {
+			LOG("Bond link %u up\n", link);
+			m.up = true;
+		}
+		m.idle = 0;
+
+		if (m.linkSeq != m.rxLinkSeq)
+			m.lost += (uint8_t)(m.linkSeq - m.rxLinkSeq);
+		m.rxLinkSeq = m.linkSeq+1;
+
+		if (m.size==0) {
+			/* Keepalive, with the next sequence number to be sent */
+			m.next = m.seq;
+			advance();
+			return;
+		}
+		m.next = m.seq+1;
+
+		int8_t d = (int8_t)(m.seq - expected);
+		if (d < -32 || d > 32) {
+			/* Too far off to be out of order, the peer started over */
+			LOG("Bond sequence reset\n");
+			resync(m.seq);
+		}
+		while (true) {
+			d = (int8_t)(m.seq - expected);
+			if (d < 0) {
+				/* Already delivered, or given up on */
+				return;
+			}
+			if (d == 0) {
+				deliver(m.buf,m.size);
+				expected++;
+				break;
+			}
+			if (hold(m))
+				break;
+			/* No room, give up on what we are waiting for */
+			int8_t oldest = oldestHeld();
+			LOG("Bond reorder full, skipping %u\n", expected);
+			expected += d < oldest ? d : oldest;
+			deliverHeld();
+		}
+		advance();
+	}
+
+	static bool hold(const Member &m)
+	{
+		uint8_t i;
+		for (i=0; i<reorderSlots; i++) {
+			if (slots[i].used && slots[i].seq==m.seq)
+				return true;
+		}
+		for (i=0; i<reorderSlots; i++) {
+			if (!slots[i].used) {
+				slots[i].used = true;
+				slots[i].seq = m.seq;
+				slots[i].size = m.size;
+				memcpy(slots[i].buf,m.buf,m.size);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/* How far ahead the oldest frame held is */
+	static int8_t oldestHeld()
+	{
+		uint8_t i;
+		int8_t best = 127;
+		for (i=0; i<reorderSlots; i++) {
+			if (slots[i].used && (int8_t)(slots[i].seq-expected) < best)
+				best = (int8_t)(slots[i].seq-expected);
+		}
+		return best;
+	}
+
+	static bool deliverHeld()
+	{
+		uint8_t i;
+		bool progress = false;
+		for (i=0; i<reorderSlots; i++) {
+			if (slots[i].used && slots[i].seq==expected) {
+				slots[i].used = false;
+				deliver(slots[i].buf,slots[i].size);
+				expected++;
+				progress = true;
+			}
+		}
+		return progress;
+	}
+
+	/* Deliver whatever is in order now, and skip what can't come */
+	static void advance()
+	{
+		while (true) {
+			if (deliverHeld())
+				continue;
+			if (!waiting())
+				return;
+			if (passed()) {
+				LOG("Bond frame %u lost\n", expected);
+				expected++;
+			} else {
+				return;
+			}
+		}
+	}
+
+	static bool waiting()
+	{
+		uint8_t i;
+		for (i=0; i<reorderSlots; i++) {
+			if (slots[i].used)
+				return true;
+		}
+		return false;
+	}
+
+	/* Every link that is up went past 'expected' */
+	static bool passed()
+	{
+		uint8_t i;
+		bool any = false;
+		for (i=0; i<numLinks; i++) {
+			if (!members[i].up)
+				continue;
+			any = true;
+			if ((int8_t)(members[i].next - expected) <= 0)
+				return false;
+		}
+		return any;
+	}
+
+	static void resync(uint8_t seq)
+	{
+		uint8_t i;
+		for (i=0; i<reorderSlots; i++)
+			slots[i].used = false;
+		expected = seq;
+	}
+};
+
+#define IMPLEMENT_BOND(name) \
+	template<> name::Member name::members[]={}; \
+	template<> name::Slot name::slots[]={}; \
+	template<> name::receiver_t name::receiver=0; \
+	template<> const uint8_t *name::rxEscape=0; \
+	template<> uint8_t name::expected=0; \
+	template<> uint8_t name::txSeq=0; \
+	template<> uint8_t name::txLink=0; \
+	template<> bool name::txInFrame=false; \
+	template<> uint8_t name::lastLink=0;
+
+#endif
@@ -0,0 +1,316 @@
+/*
+ SerPro - A serial protocol for arduino intercommunication
+ Copyright (C) 2009 Alvaro Lopes <alvieboy@alvie.com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 3 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General
+ Public License along with this library; if not, write to the
+ Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301 USA
+ */
+
+/*
+ Capture of what goes over the line, both ways, with timestamps. Host
+ only. See SerProReplay.cpp for playing it back.
+
+ A capture file starts with a header:
+
+   "SPCAP" 0x01, uint16 reserved, uint64 start time (us, realtime)
+
+ and then records, each a run of bytes in one direction:
+
+   uint8  type       bit 7: sent by us (else received)
+                     bit 6: records were lost before this one
+   varint delta      microseconds since the previous record
+   varint length
+   bytes
+
+ Varints are 7 bits a byte, lowest first, top bit set if more follow.
+ All numbers are little-endian.
+
+ The tap sits on the protocol's thread. SerProTapSerial wraps the
+ Serial class, so everything sent goes through it; received bytes are
+ given to rx() (best a whole read() at once, each is one record with
+ one timestamp) before processData(). A run of bytes becomes a record
+ when the direction changes, on flush(), or when it fills up. Records
+ go into a ring that drain() empties, from any one other thread or from
+ the same one; neither side takes a lock, and when the ring is full
+ records are dropped rather than making the protocol wait.
+
+ typedef SerProTap<> Tap;
+ typedef SerProTapSerial<SerialWrapper,Tap> TappedSerial;
+ DECLARE_SERPRO(Config, TappedSerial, SerProHDLC, SerPro);
+ ...
+ Tap::start();
+ n = read(fd,buf,sizeof(buf)); Tap::rx(buf,n); feed buf to processData
+ ... elsewhere: Tap::drain(captureFd);
+ */
+
+#ifndef __SERPRO_CAPTURE_H__
+#define __SERPRO_CAPTURE_H__
+
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+struct SerProCaptureFormat
+{
+	static uint8_t const typeSent = 0x80;
+	static uint8_t const typeLost = 0x40;
+	static unsigned int const headerSize = 16;
+	static unsigned int const maxRecordHeader = 11;
+
+	static inline uint64_t now()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC,&ts);
+		return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+	}
+
+	static inline unsigned int putVarint(unsigned char *p, uint64_t v)
+	{
+		unsigned int n = 0;
+		while (v>=0x80) {
+			p[n++] = (v & 0x7F) | 0x80;
+			v >>= 7;
+		}
+		p[n++] = v;
+		return n;
+	}
+
+	/* Returns bytes used, zero if it runs past 'end' */
+	static inline unsigned int getVarint(const unsigned char *p, const unsigned char *end, uint64_t &v)
+	{
+		unsigned int n = 0, shift = 0;
+		v = 0;
+		while (p+n<end && shift<64) {
+			uint8_t b = p[n++];
+			v |= (uint64_t)(b & 0x7F) << shift;
+			if (!(b & 0x80))
+				return n;
+			shift += 7;
+		}
+		return 0;
+	}
+
+	static inline uint64_t wallClock()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME,&ts);
+		return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+	}
+
+	static void header(unsigned char *h, uint64_t t)
+	{
+		unsigned int i;
+		memcpy(h,"SPCAP\x01\0\0",8);
+		for (i=0; i<8; i++)
+			h[8+i] = t >> (8*i);
+	}
+};
+
+template<unsigned int ringSize=65536, unsigned int runSize=256>
+class SerProTap
+{
+public:
+	/* Ring, written by the protocol thread only */
+	static unsigned char ring[ringSize];
+	static uint32_t head;           // Published with release
+	static uint32_t tail;           // Written by drain() only
+	static bool headerDone;
+	static uint64_t startTime;      // Wall clock at start(), for the header
+
+	/* The run being collected */
+	static unsigned char run[runSize];
+	static unsigned int runLength;
+	static uint8_t runType;
+	static uint64_t runTime;
+	static uint64_t lastTime;
+	static bool lost;
+	static bool enabled;
+	static unsigned long dropped;   // Records that did not fit
+
+	static void start()
+	{
+		runLength = 0;
+		lastTime = SerProCaptureFormat::now();
+		startTime = SerProCaptureFormat::wallClock();
+		lost = false;
+		headerDone = false;
+		__atomic_store_n(&enabled,true,__ATOMIC_RELEASE);
+	}
+
+	static void stop()
+	{
+		end();
+		__atomic_store_n(&enabled,false,__ATOMIC_RELEASE);
+	}
+
+	static inline void rx(uint8_t v)
+	{
+		add(0,v);
+	}
+
+	static void rx(const unsigned char *buf, unsigned int size)
+	{
+		if (!enabled)
+			return;
+		end();
+		while (size>0) {
+			unsigned int n = size < runSize ? size : runSize;
+			memcpy(run,buf,n);
+			runLength = n;
+			runType = 0;
+			runTime = SerProCaptureFormat::now();
+			end();
+			buf += n;
+			size -= n;
+		}
+	}
+
+	static inline void tx(uint8_t v)
+	{
+		add(SerProCaptureFormat::typeSent,v);
+	}
+
+	/* Close the current run, making it a record */
+	static void end()
+	{
+		if (!runLength)
+			return;
+		unsigned char h[SerProCaptureFormat::maxRecordHeader];
+		unsigned int hl = 0;
+		h[hl++] = runType | (lost ? SerProCaptureFormat::typeLost : 0);
+		hl += SerProCaptureFormat::putVarint(h+hl,runTime-lastTime);
+		hl += SerProCaptureFormat::putVarint(h+hl,runLength);
+
+		uint32_t t = __atomic_load_n(&tail,__ATOMIC_ACQUIRE);
+		if (ringSize-(head-t) < hl+runLength) {
+			dropped++;
+			lost = true;
+		} else {
+			copyIn(0,h,hl);
+			copyIn(hl,run,runLength);
+			__atomic_store_n(&head,head+hl+runLength,__ATOMIC_RELEASE);
+			lastTime = runTime;
+			lost = false;
+		}
+		runLength = 0;
+	}
+
+	/* Write out what is in the ring, with the file header first.
+	 Returns bytes written, or -1 on a write error. */
+	static long drain(int fd)
+	{
+		long total = 0;
+		if (!headerDone) {
+			unsigned char h[SerProCaptureFormat::headerSize];
+			SerProCaptureFormat::header(h,startTime);
+			if (!writeAll(fd,h,sizeof(h)))
+				return -1;
+			headerDone = true;
+			total += sizeof(h);
+		}
+		uint32_t hd = __atomic_load_n(&head,__ATOMIC_ACQUIRE);
+		uint32_t t = tail;
+		while (t!=hd) {
+			uint32_t pos = t % ringSize;
+			uint32_t n = hd-t;
+			if (n>ringSize-pos)
+				n = ringSize-pos;
+			if (!writeAll(fd,ring+pos,n))
+				return -1;
+			t += n;
+			total += n;
+			__atomic_store_n(&tail,t,__ATOMIC_RELEASE);
+		}
+		return total;
+	}
+
+protected:
+	static inline void add(uint8_t type, uint8_t v)
+	{
+		if (!enabled)
+			return;
+		if (runLength && (type!=runType || runLength==runSize))
+			end();
+		if (!runLength) {
+			runType = type;
+			runTime = SerProCaptureFormat::now();
+		}
+		run[runLength++] = v;
+	}
+
+	/* Copy to 'at' bytes past head; head moves once the record is whole */
+	static void copyIn(uint32_t at, const unsigned char *p, unsigned int n)
+	{
+		uint32_t pos = (head+at) % ringSize;
+		unsigned int first = n < ringSize-pos ? n : ringSize-pos;
+		memcpy(ring+pos,p,first);
+		memcpy(ring,p+first,n-first);
+	}
+
+	static bool writeAll(int fd, const unsigned char *p, uint32_t n)
+	{
+		while (n>0) {
+			ssize_t r = ::write(fd,p,n);
+			if (r<=0)
+				return false;
+			p += r;
+			n -= r;
+		}
+		return true;
+	}
+};
+
+/* Serial class that taps everything sent through it */
+template<class Serial, class Tap>
+struct SerProTapSerial
+{
+	static inline void write(uint8_t v)
+	{
+		Tap::tx(v);
+		Serial::write(v);
+	}
+
+	static inline void write(const unsigned char *buf, unsigned int size)
+	{
+		unsigned int i;
+		for (i=0; i<size; i++)
+			Tap::tx(buf[i]);
+		Serial::write(buf,size);
+	}
+
+	static inline void flush()
+	{
+		Tap::end();
+		Serial::flush();
+	}
+};
+
+#define IMPLEMENT_TAP(name) \
+	template<> unsigned char name::ring[]={0}; \
+	template<> uint32_t name::head=0; \
+	template<> uint32_t name::tail=0; \
+	template<> bool name::headerDone=false; \
+	template<> uint64_t name::startTime=0; \
+	template<> unsigned char name::run[]={0}; \
+	template<> unsigned int name::runLength=0; \
+	template<> uint8_t name::runType=0; \
+	template<> uint64_t name::runTime=0; \
+	template<> uint64_t name::lastTime=0; \
+	template<> bool name::lost=false; \
+	template<> bool name::enabled=false; \
+	template<> unsigned long name::dropped=0;
+
+#endif
@@ -0,0 +1,539 @@
+/*
+ SerPro - A serial protocol for arduino intercommunication
+ Copyright (C) 2009 Alvaro Lopes <alvieboy@alvie.com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 3 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General
+ Public License along with this library; if not, write to the
+ Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301 USA
+ */
+
+/*
+ Logical channels over one SerPro link.
+
+ Channel 0 is the link itself: SerPro::send() and functions declared
+ as usual, nothing changes for them. Channels 1 to numChannels each
+ have their own queue in both directions, their own credits, and a
+ priority, so bulk traffic on one does not hold up control traffic on
+ another, and a receiver that can't keep up with one channel does not
+ stall the rest.
+
+ Commands sent on a channel are queued (SerProChannels::send()), and
+ leave in segments of at most one frame. service() sends up to
+ channelBurst segments each call, always from the most urgent channel
+ that has something queued and credits to send it; ties go
+ round-robin. So urgent commands overtake bulk ones at the next frame
+ boundary. Nothing is sent while the peer has said RNR.
+
+ On the other side, segments are queued per channel, and service()
+ runs at most one complete command per channel each call, most urgent
+ channel first. Channels can be paused, e.g. while flash is busy.
+
+ Credits: each segment takes one, and the receiver only hands out as
+ many as it has room for in the channel's queue. It sends the total
+ number of segments the sender may have sent so far (mod 256), so lost
+ or repeated CREDIT messages do no harm, and it repeats it every
+ channelCreditRefresh ticks. Call reset() on both sides whenever the
+ link is set up again.
+
+ Each segment carries the sender's segment count (mod 256), and two
+ flags in the top bits of the channel number: segFirst if it starts at
+ the beginning of a command, segLast if it ends at the end of one. A
+ gap in the count, or a segment that does not fit, loses the command
+ being received: it is dropped, and so is everything up to the next
+ segment marked segFirst. Lost segments still count as received, so
+ credits stay right; a sender left without credits answers a CREDIT
+ with an empty segment, which only carries its count.
+
+ Both sides must use the same numChannels (at most 63) and queueSize,
+ and queueSize must hold at least one segment (maxPacketSize-9 bytes).
+ Commands are limited to queueSize-2 bytes, and use the same function
+ table as channel 0; currentChannel() tells a function where its
+ command came from.
+
+ The two functions used for segments and credits must be declared
+ with DECLARE_CHANNEL_FUNCTIONS(commandBase, Channels).
+ */
+
+#ifndef __SERPRO_CHANNELS_H__
+#define __SERPRO_CHANNELS_H__
+
+#include "config_options.h"
+
+/* Segments service() may send per call */
+CONFIG_OPTION(channelBurst, uint8_t, 4)
+/* Ticks between unsolicited credit updates, zero for none */
+CONFIG_OPTION(channelCreditRefresh, uint16_t, 500)
+
+template<class SerPro, unsigned int commandBase, unsigned int numChannels, unsigned int queueSize>
+class SerProChannels
+{
+public:
+	typedef typename SerPro::MyProtocol MyProtocol;
+	typedef typename MyProtocol::config_type Config;
+	typedef typename SerPro::command_t command_t;
+	typedef typename SerPro::buffer_size_t buffer_size_t;
+
+	/* Commands queued go to processPacket() whole, and may take up to
+	 queueSize-2 bytes. Does not compile if buffer_size_t cannot hold
+	 that: it is one byte with a maxPacketSize (SerProHDLC: and
+	 maxMessageSize) up to 255. */
+	typedef char queue_size_check[queueSize-2 <= (unsigned long)(buffer_size_t)-1 ? 1 : -1];
+
+	enum command {
+		cmdSegment,
+		cmdCredit,
+		numCommands
+	};
+
+	/* Flags in the channel number of a segment */
+	static uint8_t const segFirst = 0x80;
+	static uint8_t const segLast = 0x40;
+	static uint8_t const segChannel = 0x3F;
+
+	struct Channel {
+		unsigned char tx[queueSize];
+		unsigned int txLen;
+		unsigned int txRest;    // Bytes of a command sent in part still queued
+		unsigned char rx[queueSize];
+		unsigned int rxLen;
+		unsigned int rxComplete; // Bytes of complete commands in rx
+		bool rxSkip;             // Waiting for a segment marked segFirst
+		uint8_t txCount;     // Segments sent
+		uint8_t txLimit;     // ... and how many we may send
+		uint8_t rxCount;     // Segments received
+		uint8_t rxLimit;     // ... and how many we allowed
+		uint8_t priority;    // Higher goes first
+		bool paused;
+	};
+
+	static Channel channels[numChannels];
+	static uint8_t lastServed;
+	static uint8_t rxChannel;       // Channel being dispatched, 0 if none
+	static uint16_t refreshTimer;
+
+	/* Capture: serialize() into a channel queue instead of the link */
+	static uint8_t txChannel;
+	static unsigned int txStart;
+	static bool txOverflow;
+
+	struct Capture {
+		typedef typename SerPro::Encoding Encoding;
+		struct MyProtocol {
+			static inline bool wireSwap() {
+				return SerPro::MyProtocol::wireSwap();
+			}
+			static inline void sendData(uint8_t c) {
+				put(c);
+			}
+			static inline void sendData(const unsigned char *buf, unsigned int size) {
+				while (size--)
+					put(*buf++);
+			}
+		};
+	};
+
+	static void reset()
+	{
+		uint8_t i;
+		for (i=0; i<numChannels; i++) {
+			Channel &c = channels[i];
+			c.txLen = c.rxLen = 0;
+			c.txRest = c.rxComplete = 0;
+			c.rxSkip = false;
+			c.txCount = c.txLimit = 0;
+			c.rxCount = c.rxLimit = 0;
+			c.paused = false;
+		}
+		rxChannel = 0;
+	}
+
+	static inline void setPriority(uint8_t channel, uint8_t priority)
+	{
+		if (valid(channel))
+			channels[channel-1].priority = priority;
+	}
+
+	static inline void pause(uint8_t channel, bool paused)
+	{
+		if (valid(channel))
+			channels[channel-1].paused = paused;
+	}
+
+	static inline uint8_t currentChannel()
+	{
+		return rxChannel;
+	}
+
+	/* Bytes free in a channel's send queue */
+	static inline unsigned int txFree(uint8_t channel)
+	{
+		return valid(channel) ? queueSize-channels[channel-1].txLen : 0;
+	}
+
+	/* Queue a command. False if it does not fit, nothing is queued then. */
+
+	static bool send(uint8_t channel, command_t command)
+	{
+		if (!begin(channel))
+			return false;
+		put(command);
+		return end();
+	}
+
+	template<typename A>
+	static bool send(uint8_t channel, command_t command, const A value_a)
+	{
+		if (!begin(channel))
+			return false;
+		put(command);
+		serialize<Capture>(value_a);
+		return end();
+	}
+
+	template<typename A,typename B>
+	static bool send(uint8_t channel, command_t command, const A value_a, const B value_b)
+	{
+		if (!begin(channel))
+			return false;
+		put(command);
+		serialize<Capture>(value_a);
+		serialize<Capture>(value_b);
+		return end();
+	}
+
+	template<typename A,typename B,typename C>
+	static bool send(uint8_t channel, command_t command, const A value_a, const B value_b,
+					 const C value_c)
+	{
+		if (!begin(channel))
+			return false;
+		put(command);
+		serialize<Capture>(value_a);
+		serialize<Capture>(value_b);
+		serialize<Capture>(value_c);
+		return end();
+	}
+
+	template<typename A,typename B,typename C,typename D>
+	static bool send(uint8_t channel, command_t command, const A value_a, const B value_b,
+					 const C value_c, const D value_d)
+	{
+		if (!begin(channel))
+			return false;
+		put(command);
+		serialize<Capture>(value_a);
+		serialize<Capture>(value_b);
+		serialize<Capture>(value_c);
+		serialize<Capture>(value_d);
+		return end();
+	}
+
+	template<typename A,typename B,typename C,typename D,typename E>
+	static bool send(uint8_t channel, command_t command, const A value_a, const B value_b,
+					 const C value_c, const D value_d, const E value_e)
+	{
+		if (!begin(channel))
+			return false;
+		put(command);
+		serialize<Capture>(value_a);
+		serialize<Capture>(value_b);
+		serialize<Capture>(value_c);
+		serialize<Capture>(value_d);
+		serialize<Capture>(value_e);
+		return end();
+	}
+
+	template<typename A,typename B,typename C,typename D,typename E,typename F>
+	static bool send(uint8_t channel, command_t command, const A value_a, const B value_b,
+					 const C value_c, const D value_d, const E value_e, const F value_f)
+	{
+		if (!begin(channel))
+			return false;
+		put(command);
+		serialize<Capture>(value_a);
+		serialize<Capture>(value_b);
+		serialize<Capture>(value_c);
+		serialize<Capture>(value_d);
+		serialize<Capture>(value_e);
+		serialize<Capture>(value_f);
+		return end();
+	}
+
+	/* Call often, from the main loop */
+	static void service()
+	{
+		transmit();
+		dispatch();
+		grant(false);
+	}
+
+	static void timerTick()
+	{
+		if (config_option_channelCreditRefresh<Config>::value && --refreshTimer==0) {
+			refreshTimer = config_option_channelCreditRefresh<Config>::value;
+			grant(true);
+		}
+	}
+
+	/* Functions, see DECLARE_CHANNEL_FUNCTIONS */
+
+	static void handleSegment(uint8_t tag, uint8_t seq, CountedBuffer data)
+	{
+		uint8_t channel = tag & segChannel;
+		if (!valid(channel))
+			return;
+		Channel &c = channels[channel-1];
+		int8_t gap = (int8_t)(seq - c.rxCount);
+		if (gap<0) {
+			LOG("Channel %u: old segment %u, ignored\n", channel, seq);
+			return;
+		}
+		/* Segments lost on the way were sent with credits too */
+		if (gap>0) {
+			LOG("Channel %u: %d segments lost\n", channel, gap);
+			c.rxCount = seq;
+			resync(c);
+		}
+		/* An empty segment only says how many were sent */
+		if (!data.size)
+			return;
+		c.rxCount++;
+		if (c.rxSkip) {
+			if (!(tag & segFirst))
+				return;
+			c.rxSkip = false;
+		}
+		if (data.size > queueSize-c.rxLen) {
+			LOG("Channel %u overrun, segment dropped\n", channel);
+			resync(c);
+			return;
+		}
+		memcpy(&c.rx[c.rxLen],data.buffer,data.size);
+		c.rxLen += data.size;
+		if (tag & segLast)
+			c.rxComplete = c.rxLen;
+	}
+
+	static void handleCredit(uint8_t channel, uint8_t limit)
+	{
+		if (!valid(channel))
+			return;
+		Channel &c = channels[channel-1];
+		c.txLimit = limit;
+		transmit();
+		/* Still stuck: the peer may not know about segments it lost */
+		if (c.txLen && !credits(c) && !MyProtocol::peerBusy())
+			SerPro::send(commandBase+cmdSegment, channel, c.txCount, CountedBuffer());
+	}
+
+protected:
+	static inline bool valid(uint8_t channel)
+	{
+		return channel>=1 && channel<=numChannels;
+	}
+
+	static inline unsigned int segmentSize()
+	{
+		/* Address, control, CRC, command, channel, count and length */
+		return MyProtocol::getMaxFrame()-9;
+	}
+
+	static inline unsigned int rxSegmentSize()
+	{
+		/* What the peer may send us at most */
+		return Config::maxPacketSize-9;
+	}
+
+	/* Drop the command being received, and wait for the next one */
+	static inline void resync(Channel &c)
+	{
+		c.rxLen = c.rxComplete;
+		c.rxSkip = true;
+	}
+
+	static inline uint8_t credits(const Channel &c)
+	{
+		int8_t left = (int8_t)(c.txLimit - c.txCount);
+		return left>0 ? left : 0;
+	}
+
+	/* Each command is queued as a 2-byte length, then the command */
+	static bool begin(uint8_t channel)
+	{
+		if (!valid(channel))
+			return false;
+		txChannel = channel;
+		txStart = channels[channel-1].txLen;
+		txOverflow = false;
+		put(0);
+		put(0);
+		return !txOverflow;
+	}
+
+	static void put(uint8_t v)
+	{
+		Channel &c = channels[txChannel-1];
+		if (c.txLen>=queueSize) {
+			txOverflow = true;
+			return;
+		}
+		c.tx[c.txLen++] = v;
+	}
+
+	static bool end()
+	{
+		Channel &c = channels[txChannel-1];
+		if (txOverflow) {
+			c.txLen = txStart;
+			return false;
+		}
+		unsigned int len = c.txLen-txStart-2;
+		c.tx[txStart] = len & 0xff;
+		c.tx[txStart+1] = len >> 8;
+		transmit();
+		return true;
+	}
+
+	/* Most urgent channel with data and credits, round-robin on ties */
+	static int8_t pick()
+	{
+		int8_t best = -1;
+		uint8_t n, i;
+		for (n=1; n<=numChannels; n++) {
+			i = (lastServed+n) % numChannels;
+			const Channel &c = channels[i];
+			if (!c.txLen || !credits(c))
+				continue;
+			if (best<0 || c.priority>channels[best].priority)
+				best = i;
+		}
+		return best;
+	}
+
+	static void transmit()
+	{
+		uint8_t n;
+		if (MyProtocol::peerBusy())
+			return;
+		for (n=0; n<config_option_channelBurst<Config>::value; n++) {
+			int8_t i = pick();
+			if (i<0)
+				return;
+			Channel &c = channels[i];
+			unsigned int len = c.txLen < segmentSize() ? c.txLen : segmentSize();
+			uint8_t tag = (i+1) | (c.txRest ? 0 : segFirst);
+			if (segmentEnd(c,len))
+				tag |= segLast;
+			lastServed = i;
+			SerPro::send(commandBase+cmdSegment, tag, c.txCount, CountedBuffer(c.tx,len));
+			c.txCount++;
+			memmove(c.tx,&c.tx[len],c.txLen-len);
+			c.txLen -= len;
+		}
+	}
+
+	/* Whether the first len bytes queued end a command. Updates txRest. */
+	static bool segmentEnd(Channel &c, unsigned int len)
+	{
+		unsigned int pos = c.txRest;
+		while (pos<len)
+			pos += (c.tx[pos] | ((unsigned int)c.tx[pos+1]<<8)) + 2;
+		c.txRest = pos-len;
+		return pos==len;
+	}
+
+	/* Run one complete command per channel, most urgent first */
+	static void dispatch()
+	{
+		bool ran[numChannels];
+		uint8_t n, i;
+		memset(ran,0,sizeof(ran));
+		for (n=0; n<numChannels; n++) {
+			int8_t best = -1;
+			for (i=0; i<numChannels; i++) {
+				if (ran[i] || !ready(channels[i]))
+					continue;
+				if (best<0 || channels[i].priority>channels[best].priority)
+					best = i;
+			}
+			if (best<0)
+				return;
+			ran[best] = true;
+
+			Channel &c = channels[best];
+			unsigned int len = c.rx[0] | ((unsigned int)c.rx[1]<<8);
+			if (c.rxComplete<2 || len > c.rxComplete-2) {
+				LOG("Channel %u: bad command length %u\n", best+1, len);
+				c.rxComplete = 0;
+				resync(c);
+				continue;
+			}
+			rxChannel = best+1;
+			SerPro::processPacket(&c.rx[2],len);
+			rxChannel = 0;
+			memmove(c.rx,&c.rx[len+2],c.rxLen-len-2);
+			c.rxLen -= len+2;
+			c.rxComplete -= len+2;
+		}
+	}
+
+	static inline bool ready(const Channel &c)
+	{
+		return !c.paused && c.rxComplete;
+	}
+
+	/* Let the peer send as many segments as we have room for */
+	static void grant(bool always)
+	{
+		uint8_t i;
+		for (i=0; i<numChannels; i++) {
+			Channel &c = channels[i];
+			unsigned int room = (queueSize-c.rxLen) / rxSegmentSize();
+			/* Segments already on their way need room too */
+			uint8_t inFlight = c.rxLimit - c.rxCount;
+			if (room>127)
+				room = 127;
+			if (room<inFlight)
+				continue;
+			uint8_t limit = c.rxCount + room;
+			if (limit!=c.rxLimit || always) {
+				SerPro::send(commandBase+cmdCredit, (uint8_t)(i+1), limit);
+				/* Peer busy: try again next time */
+				if (!MyProtocol::sendRefused())
+					c.rxLimit = limit;
+			}
+		}
+	}
+};
+
+#define DECLARE_CHANNEL_FUNCTIONS(base,Channels) \
+	DECLARE_FUNCTION((base)+Channels::cmdSegment)(uint8_t channel, uint8_t seq, CountedBuffer data) { \
+		Channels::handleSegment(channel,seq,data); \
+	} \
+	END_FUNCTION \
+	DECLARE_FUNCTION((base)+Channels::cmdCredit)(uint8_t channel, uint8_t limit) { \
+		Channels::handleCredit(channel,limit); \
+	} \
+	END_FUNCTION
+
+#define IMPLEMENT_CHANNELS(name) \
+	template<> name::Channel name::channels[]={}; \
+	template<> uint8_t name::lastServed=0; \
+	template<> uint8_t name::rxChannel=0; \
+	template<> uint16_t name::refreshTimer=1; \
+	template<> uint8_t name::txChannel=1; \
+	template<> unsigned int name::txStart=0; \
+	template<> bool name::txOverflow=false;
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ SerPro - A serial protocol for arduino intercommunication
+ Copyright (C) 2009 Alvaro Lopes <alvieboy@alvie.com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 3 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General
+ Public License along with this library; if not, write to the
+ Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301 USA
+ */
+
+/*
+ LZSS, in the manner of heatshrink, for compressed commands (see
+ SerProHDLC.h). A packed command is:
+
+   uint8  window bits << 4 | length bits
+   varint size unpacked
+   tokens, as a bit stream, most significant bit first
+
+ Each token is either a 1 bit and a literal byte, or a 0 bit, the
+ distance back minus one (window bits) and the length minus minMatch
+ (length bits). The last byte is padded with zeros.
+
+ Unpacking needs no memory besides the output, and no more code than
+ the loop in unpack(), so an AVR can take packed commands even if it
+ never packs any. Matches reach at most 2^windowBits bytes back, so the
+ sender's tables stay small: a hash of every two bytes, and a chain of
+ earlier places with the same hash for the last window of input. The
+ search gives up after maxChain places.
+ */
+
+#ifndef __SERPRO_COMPRESS_H__
+#define __SERPRO_COMPRESS_H__
+
+#include <inttypes.h>
+
+struct SerProLZSSFormat
+{
+	static unsigned int const minMatch = 2;
+	static unsigned int const maxWindowBits = 12;
+	static unsigned int const maxLengthBits = 8;
+	/* Parameters and a three-byte size */
+	static unsigned int const headerMax = 4;
+
+	/* Unpack 'size' bytes into 'out', which takes at most 'max'.
+	 Returns the size unpacked, or zero if the data is bad or too large. */
+	static unsigned int unpack(const uint8_t *in, unsigned int size, uint8_t *out, unsigned int max)
+	{
+		if (size<2)
+			return 0;
+		unsigned int wbits = in[0]>>4, lbits = in[0] & 0x0F;
+		if (wbits==0 || wbits>maxWindowBits || lbits==0 || lbits>maxLengthBits)
+			return 0;
+
+		unsigned int pos = 1, shift = 0;
+		uint32_t total = 0;
+		do {
+			if (pos>=size || shift>14)
+				return 0;
+			total |= (uint32_t)(in[pos] & 0x7F) << shift;
+			shift += 7;
+		} while (in[pos++] & 0x80);
+		if (total>max)
+			return 0;
+
+		unsigned int outPos = 0;
+		uint8_t bits = 0, left = 0;
+		while (outPos<total) {
+			if (!left) {
+				if (pos>=size)
+					return 0;
+				bits = in[pos++];
+				left = 8;
+			}
+			bool literal = bits & 0x80;
+			bits <<= 1;
+			left--;
+			if (literal) {
+				uint32_t v;
+				if (!readBits(in,size,pos,bits,left,8,v))
+					return 0;
+				out[outPos++] = v;
+			} else {
+				uint32_t dist, len;
+				if (!readBits(in,size,pos,bits,left,wbits,dist) ||
+					!readBits(in,size,pos,bits,left,lbits,len))
+					return 0;
+				dist++;
+				len += minMatch;
+				if (dist>outPos || len>total-outPos)
+					return 0;
+				/* Byte by byte, matches may overlap */
+				const uint8_t *from = out+outPos-dist;
+				while (len--)
+					out[outPos++] = *from++;
+			}
+		}
+		return outPos;
+	}
+
+	static inline unsigned int putVarint(uint8_t *p, uint32_t v)
+	{
+		unsigned int n = 0;
+		while (v>=0x80) {
+			p[n++] = (v & 0x7F) | 0x80;
+			v >>= 7;
+		}
+		p[n++] = v;
+		return n;
+	}
+
+protected:
+	static inline bool readBits(const uint8_t *in, unsigned int size, unsigned int &pos,
+								uint8_t &bits, uint8_t &left, unsigned int count, uint32_t &v)
+	{
+		v = 0;
+		while (count--) {
+			if (!left) {
+				if (pos>=size)
+					return false;
+				bits = in[pos++];
+				left = 8;
+			}
+			v = (v<<1) | (bits>>7);
+			bits <<= 1;
+			left--;
+		}
+		return true;
+	}
+};
+
+#ifdef AVR
+#define SERPRO_LZSS_HASHBITS 6
+#define SERPRO_LZSS_CHAIN 4
+#else
+#define SERPRO_LZSS_HASHBITS 12
+#define SERPRO_LZSS_CHAIN 32
+#endif
+
+template<unsigned int windowBits=8, unsigned int lengthBits=4,
+	unsigned int hashBits=SERPRO_LZSS_HASHBITS, unsigned int maxChain=SERPRO_LZSS_CHAIN>
+class SerProLZSS: public SerProLZSSFormat
+{
+public:
+	static unsigned int const window = 1<<windowBits;
+	static unsigned int const maxMatch = (1<<lengthBits)+minMatch-1;
+	static unsigned int const hashSize = 1<<hashBits;
+
+	/* Pack 'size' bytes (at most 65535). Returns the packed size, or
+	 zero if it does not fit in 'max' bytes. */
+	unsigned int pack(const uint8_t *in, unsigned int size, uint8_t *out, unsigned int max)
+	{
+		if (max<headerMax)
+			return 0;
+		outBuf = out;
+		out[0] = (windowBits<<4) | lengthBits;
+		outPos = 1+putVarint(out+1,size);
+		outMax = max;
+		acc = 0;
+		accBits = 0;
+
+		unsigned int i;
+		for (i=0; i<hashSize; i++)
+			head[i] = 0;
+
+		unsigned int pos = 0;
+		while (pos<size) {
+			unsigned int best = 0, bestDist = 0;
+			if (size-pos>=minMatch) {
+				unsigned int limit = size-pos < maxMatch ? size-pos : maxMatch;
+				uint16_t cand = head[hash(in+pos)];
+				unsigned int chain = maxChain;
+				/* Places are kept plus one, zero ends the chain */
+				while (cand && chain--) {
+					unsigned int at = cand-1;
+					if (pos-at>window)
+						break;
+					if (in[at+best]==in[pos+best]) {
+						unsigned int len = 0;
+						while (len<limit && in[at+len]==in[pos+len])
+							len++;
+						if (len>best) {
+							best = len;
+							bestDist = pos-at;
+							if (len==limit)
+								break;
+						}
+					}
+					cand = prev[at & (window-1)];
+				}
+			}
+
+			if (best>=minMatch) {
+				if (!putBits(0,1) || !putBits(bestDist-1,windowBits) ||
+					!putBits(best-minMatch,lengthBits))
+					return 0;
+			} else {
+				best = 1;
+				if (!putBits(0x100 | in[pos],9))
+					return 0;
+			}
+			while (best--) {
+				if (size-pos>=minMatch)
+					insert(in,pos);
+				pos++;
+			}
+		}
+		if (accBits && !putBits(0,8-accBits))
+			return 0;
+		return outPos;
+	}
+
+protected:
+	uint16_t head[hashSize];
+	uint16_t prev[window];
+	uint8_t *outBuf;
+	unsigned int outPos, outMax;
+	uint32_t acc;
+	unsigned int accBits;
+
+	static inline unsigned int hash(const uint8_t *p)
+	{
+		return (((unsigned int)p[0]<<(hashBits>8 ? hashBits-8 : 0)) ^ p[1]) & (hashSize-1);
+	}
+
+	inline void insert(const uint8_t *in, unsigned int pos)
+	{
+		unsigned int h = hash(in+pos);
+		prev[pos & (window-1)] = head[h];
+		head[h] = pos+1;
+	}
+
+	inline bool putBits(uint32_t v, unsigned int count)
+	{
+		acc = (acc<<count) | v;
+		accBits += count;
+		while (accBits>=8) {
+			if (outPos>=outMax)
+				return false;
+			accBits -= 8;
+			outBuf[outPos++] = acc>>accBits;
+		}
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ Forward error correction versus retransmission on a noisy channel.
+
+ Frames as large as the link allows are sent through SerProHDLC and
+ back, with every bit on the wire flipped at the given bit error rate,
+ for no FEC and several parity sizes. Flags and escapes get hit too, so
+ frames also get lost by running into each other, as on a real line.
+
+ For each case we report how many frames arrive intact, and goodput as
+ a fraction of line rate when every lost frame is sent again, and the
+ loss is noticed after -t byte times (a retransmit timeout, or the
+ round trip of a REJ). Whichever has the highest goodput at a given
+ error rate wins; FEC costs its parity on every frame, retransmission
+ costs the whole frame plus the wait on every loss.
+
+ Build: g++ -O2 -o fec-bench SerProFEC-bench.cpp crc16.cpp reedsolomon.cpp
+ Run:   ./fec-bench [-n frames] [-t byte-times]
+ */
+
+#define SERPRO_NO_LOG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include "SerProHDLC.h"
+#include "SerPro.h"
+
+static std::vector<unsigned char> wire;
+
+class SerialWrapper
+{
+public:
+	static void write(uint8_t v) {
+		wire.push_back(v);
+	}
+	static void flush() {
+	}
+};
+
+struct BenchConfig {
+	static unsigned int const maxFunctions = 1;
+	static unsigned int const maxPacketSize = 255;
+	static unsigned int const stationId = 3;
+	static uint8_t const fecParity = 32;
+};
+
+DECLARE_SERPRO(BenchConfig,SerialWrapper,SerProHDLC,SerPro);
+
+typedef SerPro::MyProtocol Protocol;
+
+static unsigned char payload[255];
+static unsigned int payloadSize;
+static unsigned long intact;
+
+DECLARE_FUNCTION(0)(CountedBuffer data) {
+	if (data.size==payloadSize && memcmp(data.buffer,payload,payloadSize)==0)
+		intact++;
+}
+END_FUNCTION
+
+IMPLEMENT_SERPRO(1,SerPro,SerProHDLC);
+
+/* xorshift, and the distance to the next bit error */
+static uint64_t rng = 88172645463325252ULL;
+
+static inline uint64_t next()
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+static uint64_t gap(double ber)
+{
+	double u = (next() >> 11) * (1.0/9007199254740992.0);
+	if (u<=0)
+		u = 1e-300;
+	return (uint64_t)(log(u)/log1p(-ber));
+}
+
+struct Result {
+	double loss;
+	double goodput;
+};
+
+static Result run(uint8_t parity, double ber, unsigned long frames, double timeout)
+{
+	Protocol::setFEC(parity);
+	Protocol::maxFrame = BenchConfig::maxPacketSize;
+	if (parity)
+		Protocol::maxFrame -= parity;
+	/* Address, control, CRC, command, and a 2-byte length */
+	payloadSize = Protocol::maxFrame-7;
+	intact = 0;
+
+	uint64_t bits = 0, nextError = gap(ber);
+	uint64_t wireBytes = 0;
+	unsigned long i;
+	for (i=0; i<frames; i++) {
+		unsigned int j;
+		for (j=0; j<payloadSize; j++)
+			payload[j] = next();
+		wire.clear();
+		SerPro::sendUnacknowledged(0,CountedBuffer(payload,payloadSize));
+		wireBytes += wire.size();
+		for (j=0; j<wire.size(); j++) {
+			uint8_t b = wire[j];
+			while (nextError < bits+8) {
+				b ^= 1 << (nextError-bits);
+				nextError += 1+gap(ber);
+			}
+			bits += 8;
+			SerPro::processData(b);
+		}
+	}
+	/* Whatever a broken flag left half-received */
+	SerPro::processData(Protocol::frameFlag);
+
+	Result r;
+	double p = (double)intact/frames;
+	double perFrame = (double)wireBytes/frames;
+	r.loss = 1-p;
+	/* Each frame needs 1/p tries, each failed one also waits */
+	r.goodput = p>0 ? payloadSize / (perFrame/p + timeout*(1-p)/p) : 0;
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long frames = 20000;
+	double timeout = 255;
+	int i;
+	for (i=1; i+1<argc; i+=2) {
+		if (strcmp(argv[i],"-n")==0)
+			frames = atol(argv[i+1]);
+		else if (strcmp(argv[i],"-t")==0)
+			timeout = atof(argv[i+1]);
+	}
+
+	static const double bers[] = { 1e-6, 1e-5, 1e-4, 3e-4, 1e-3, 3e-3, 1e-2 };
+	static const uint8_t parities[] = { 0, 4, 8, 16, 32 };
+	unsigned int b, p;
+
+	printf("%lu frames of up to 255 bytes per case, loss noticed after %.0f byte times\n\n",
+		   frames, timeout);
+	printf("%-8s", "BER");
+	for (p=0; p<sizeof(parities); p++) {
+		char name[16];
+		if (parities[p])
+			snprintf(name,sizeof(name),"RS parity %u",parities[p]);
+		else
+			snprintf(name,sizeof(name),"no FEC");
+		printf("  %-14s",name);
+	}
+	printf("\n");
+
+	for (b=0; b<sizeof(bers)/sizeof(bers[0]); b++) {
+		Result r[sizeof(parities)];
+		unsigned int best = 0;
+		for (p=0; p<sizeof(parities); p++) {
+			r[p] = run(parities[p],bers[b],frames,timeout);
+			if (r[p].goodput > r[best].goodput)
+				best = p;
+		}
+		printf("%-8g",bers[b]);
+		for (p=0; p<sizeof(parities); p++)
+			printf("  %5.1f%% %5.1f%%%c",100*r[p].loss,100*r[p].goodput,p==best ? '*' : ' ');
+		printf("\n");
+	}
+	printf("\nEach case: frames lost, goodput as share of line rate. * marks the best.\n");
+	return 0;
+}
@@ -29,12 +29,19 @@ http://www.acacia-net.com/wwwcla/protocol/iso_4335.htm
 #define __SERPRO_HDLC__
 
 #include <inttypes.h>
+#include <string.h> // For memmove
 #include "crc16.h"
+#include "reedsolomon.h"
+#include "SerProCompress.h"
+#include "config_options.h"
 
 
-#ifndef AVR
+/* Host builds log everything to stderr, unless SERPRO_NO_LOG is
+ defined */
+#if !defined(AVR) && !defined(SERPRO_NO_LOG)
 #include <stdio.h>
-#define LOG(m...) fprintf(stderr,"[%d] ",getpid()); fprintf(stderr,m);
+#include <unistd.h>
+#define LOG(m...) do { fprintf(stderr,"[%d] ",getpid()); fprintf(stderr,m); } while (0)
 #else
 #define LOG(m...)
 #endif
@@ -42,9 +49,9 @@ http://www.acacia-net.com/wwwcla/protocol/iso_4335.htm
 // These four templates help us to choose a good storage class for
 // the receiving buffer size, based on the maximum message size.
 
-template<unsigned int number>
+template<unsigned long number>
 	struct number_of_bytes {
-		static unsigned int const bytes = number/256 > 1 ? 2 : 1;
+		static unsigned int const bytes = number > 65535 ? 4 : number > 255 ? 2 : 1;
 	};
 
 template<unsigned int>
@@ -61,9 +68,133 @@ template<>
 		typedef uint16_t type;
 	};
 
+template<>
+	struct best_storage_class<4> {
+		typedef uint32_t type;
+	};
+
+/* Number of frames the peer may send before waiting for our ack.
+ Exchanged with XID, see below. */
+CONFIG_OPTION(windowSize, uint8_t, 7)
+
+/* How long, in timerTick() calls, we may hold an acknowledge back
+ waiting for an outgoing frame to carry it, or for more frames to
+ ack at once. Zero acks every frame right away. */
+CONFIG_OPTION(ackDelay, uint8_t, 0)
+
+/* An I-frame that comes again after it was delivered (our acknowledge
+ got lost) is not run again, only acknowledged. If replyCache is not
+ zero, up to that many bytes of the I-frame sent in reply while it was
+ handled are kept, and that frame is sent again instead. Replies sent
+ later, or in more than one frame, are not kept. */
+CONFIG_OPTION(replyCache, uint16_t, 0)
+
+/* Drop frames not addressed to us as soon as we see the address,
+ without buffering them or computing their CRC. Secondaries on a
+ multi-drop bus need it, and have it with pollSecondary. Off by default:
+ on a point-to-point link each end sends its own station ID, and peers
+ that never checked addresses have no reason to share one. */
+CONFIG_OPTION(filterAddress, bool, false)
+
+/* Secondary on a polled bus (see SerProPoller.h). The primary moves on
+ to the next station when it sees the F bit, so our I-frames go
+ without it, and each frame from the primary is answered last with RR
+ (or RNR) with F set. Leave it off elsewhere: it costs a frame per
+ reply. */
+CONFIG_OPTION(pollSecondary, bool, false)
+
+/* Bytes reserved for building command bundles, zero disables them.
+ Bundled commands wait at most bundleDelay ticks; with zero they wait
+ until the bundle is full or flushed. */
+CONFIG_OPTION(bundleSize, unsigned int, 0)
+CONFIG_OPTION(bundleDelay, uint8_t, 0)
+
+/* Largest message we can take apart when it comes in fragments, zero
+ means maxPacketSize. This only sizes buffer_size_t; the memory is
+ given with setReassemblyBuffer(). Sent as I-frames, a message must
+ also fit in one window of fragments, see fragmentCapacity(). */
+CONFIG_OPTION(maxMessageSize, unsigned long, 0)
+
+/* Receiver-not-ready. When the backlog given to setBacklog() reaches
+ rnrHighWater we send RNR, and the peer stops sending I-frames until it
+ falls to rnrLowWater and we send RR. Zero rnrHighWater disables it.
+ While the peer is busy we poll it every busyPollInterval ticks, in
+ case its RR got lost, and commands sent as I-frames are refused (see
+ sendRefused()). */
+CONFIG_OPTION(rnrHighWater, uint16_t, 0)
+CONFIG_OPTION(rnrLowWater, uint16_t, 0)
+CONFIG_OPTION(busyPollInterval, uint16_t, 100)
+
+/* Primary station, see startLink(). Link setup is tried again after
+ linkRetryMin ticks, doubling up to linkRetryMax. Once the link is up,
+ a peer silent for linkKeepalive ticks is polled (zero never polls),
+ and after linkMaxMisses unanswered polls it is taken as gone and the
+ link set up again. */
+CONFIG_OPTION(linkRetryMin, uint16_t, 100)
+CONFIG_OPTION(linkRetryMax, uint16_t, 5000)
+CONFIG_OPTION(linkKeepalive, uint16_t, 1000)
+CONFIG_OPTION(linkMaxMisses, uint8_t, 3)
+
+/* Forward error correction. Reed-Solomon parity bytes per block of up
+ to 255 bytes (at most 32), zero disables it. The link uses the lesser
+ of both sides' values, agreed with XID; none if either side has none.
+ Each frame loses ceil(size/255) times that much room, so maxFrame
+ shrinks accordingly. */
+CONFIG_OPTION(fecParity, uint8_t, 0)
+
+/* Stands in for ReedSolomon when FEC is off, so it costs nothing */
+struct NoFEC
+{
+	inline void setParity(uint8_t) {}
+	inline void reset() {}
+	inline void update(uint8_t) {}
+	inline void update(const uint8_t*, unsigned int) {}
+	inline const uint8_t *get() const { return 0; }
+	inline int decode(uint8_t*, unsigned int, uint8_t*) { return -1; }
+};
+
+template<bool enabled>
+	struct fec_type {
+		typedef ReedSolomon type;
+	};
+
+template<>
+	struct fec_type<false> {
+		typedef NoFEC type;
+	};
+
+/* Compressed commands, see compressNext(). compressSize is the largest
+ command we compress, zero never compresses (which saves the buffers
+ and the packer's tables); decompressSize is the largest we take
+ packed, zero tells the peer not to send any. Window and length are in
+ bits; the window costs the sender RAM only, the receiver unpacks into
+ its buffer whatever was used. */
+CONFIG_OPTION(compressSize, uint16_t, 0)
+CONFIG_OPTION(decompressSize, uint16_t, 0)
+CONFIG_OPTION(compressWindow, uint8_t, 8)
+CONFIG_OPTION(compressLength, uint8_t, 4)
+
+/* Stands in for SerProLZSS when we never compress */
+struct NoCompress
+{
+	inline unsigned int pack(const uint8_t*, unsigned int, uint8_t*, unsigned int) { return 0; }
+};
+
+template<bool enabled, unsigned int windowBits, unsigned int lengthBits>
+	struct compress_type {
+		typedef SerProLZSS<windowBits,lengthBits> type;
+	};
+
+template<unsigned int windowBits, unsigned int lengthBits>
+	struct compress_type<false,windowBits,lengthBits> {
+		typedef NoCompress type;
+	};
+
 template<class Config,class Serial,class Implementation> class SerProHDLC
 {
 public:
+	typedef Config config_type;
+
 	static uint8_t const frameFlag = 0x7E;
 	static uint8_t const escapeFlag = 0x7D;
 	static uint8_t const escapeXOR = 0x20;
@@ -79,7 +210,11 @@ public:
 	typedef uint8_t command_t;
 
 
-	typedef typename best_storage_class< number_of_bytes<Config::maxPacketSize>::bytes >::type buffer_size_t;
+	static unsigned long const maxMessageSize =
+		config_option_maxMessageSize<Config>::value > Config::maxPacketSize ?
+		config_option_maxMessageSize<Config>::value : Config::maxPacketSize;
+
+	typedef typename best_storage_class< number_of_bytes<maxMessageSize>::bytes >::type buffer_size_t;
 	//typedef uint16_t buffer_size_t;
 	typedef uint16_t packet_size_t;
 
@@ -89,14 +224,34 @@ public:
 	/* HDLC parameters extracted from frame */
 	static uint8_t inAddressField;
 	static uint8_t inControlField;
+	static uint8_t rxFrames;        // Good frames received, wraps
+	static uint16_t crcErrors;      // Frames dropped for a bad CRC, wraps
+
+	/* Address we send with and accept. Secondaries use their own
+	 station ID. A primary on a multi-drop bus switches it to the
+	 station it's talking to (see SerProPoller.h). Frames sent to
+	 allStations are accepted by everyone. */
+	static uint8_t linkAddress;
+	static uint8_t const allStations = 0xFF;
 
 	/* HDLC control data */
 	static uint8_t txSeqNum;        // Transmit sequence number
+	static uint8_t txAcked;         // Oldest frame the peer did not ack, N(R)
 	static uint8_t rxNextSeqNum;    // Expected receive sequence number
 
 	static bool unEscaping;
-	static bool forceEscapingLow;
 	static bool inPacket;
+	static bool inStream;           // Frame goes to a streaming function
+	static bool streamAgain;        // ... or may be one it had already
+
+	/* Escape maps, one bit per character, LSB first. Flag and escape
+	 are always in escapeTx. */
+	static uint8_t escapeLocal[32]; // What our line needs escaped
+	static uint8_t escapeTx[32];    // What we escape: ours and the peer's
+	static bool escapeRxCheck;      // Peer escapes escapeLocal too
+#ifndef AVR
+	static bool escapeTable[256];   // escapeTx, one load per byte
+#endif
 
 	struct RawBuffer {
 		unsigned char *buffer;
@@ -107,6 +262,152 @@ public:
 
 #define LINK_FLAG_LINKUP 1
 #define LINK_FLAG_PACKETSENT 2
+#define LINK_FLAG_NATIVE 4     /* Peer shares our byte order */
+#define LINK_FLAG_XIDSENT 8    /* We sent XID, next one is the reply */
+#define LINK_FLAG_PRIMARY 16   /* We poll, and never answer polls */
+#define LINK_FLAG_LOCALBUSY 32 /* We sent RNR */
+#define LINK_FLAG_PEERBUSY 64  /* Peer sent RNR, hold I-frames */
+#define LINK_FLAG_BUSYPOLL 128 /* We polled the busy peer, next F is its answer */
+
+	/* What the frame being sent is. Reset once it's out. */
+	static uint8_t txFlags;
+
+#define TX_FLAG_UI 1           /* Frame being sent is UI, not I */
+#define TX_FLAG_BCAST 2        /* ... and goes to all stations */
+#define TX_FLAG_BUNDLE 4       /* Record for the bundle, not a frame */
+#define TX_FLAG_TOOBIG 8       /* Bundle record larger than it said, drop it */
+#define TX_FLAG_FRAGMENT 16    /* Command is sent in fragments */
+#define TX_FLAG_COMPRESS 32    /* Compress the next command */
+#define TX_FLAG_STAGED 64      /* Command goes to compressBuf, not out */
+#define TX_FLAG_DROP 128       /* Command refused, nothing goes out */
+
+	static bool txRefused;          // Last command was not sent, see sendRefused()
+
+	/* Link parameters. These start with our own values, and are
+	 lowered to what the peer supports when we exchange XID. */
+	static packet_size_t maxFrame;  // Largest frame, both directions
+	static uint8_t window;          // Frames outstanding before ack
+	static uint8_t features;        // Optional features both sides have
+	static bool featuresKnown;      // ... as far as XID told us
+
+	/* Delayed acknowledge (T2) */
+	static uint8_t ackTimer;        // Ticks left, zero if not running
+	static uint8_t ackPending;      // Frames received but not yet acked
+
+	static uint16_t busyTimer;      // Ticks to next poll of a busy peer
+
+	/* Duplicate I-frames. We remember the CRC of the last frame
+	 delivered with each sequence number, and the reply sent to it. */
+	static crc_t rxFrameCRC[8];
+	static uint8_t rxDelivered;     // Sequence numbers delivered since link setup
+	static unsigned int const replyCacheSize = config_option_replyCache<Config>::value;
+	static unsigned char replyBuf[replyCacheSize ? 8*replyCacheSize : 1];
+	static uint16_t replyLen[8];    // Zero if there is no reply to send again
+	static uint8_t replySeq;        // Frame whose reply we are keeping
+	static uint8_t replyState;
+
+	/* Primary station */
+	static bool linkManaged;        // startLink() was called
+	static bool linkBalanced;       // ... with SABM instead of SNRM
+	static uint16_t linkTimer;      // Ticks to next setup try or poll
+	static uint16_t linkRetry;      // Current setup backoff
+	static uint8_t linkMisses;      // Polls in a row without answer
+	static uint8_t linkRxFrames;    // rxFrames when we last heard the peer
+	static bool xidRefused;         // Peer answered XID with DM or FRMR
+
+	/* Round trip probes */
+	typedef void (*test_handler_t)(const unsigned char *data, packet_size_t size);
+	static test_handler_t testHandler;
+
+	/* Forward error correction. Parity for each full block is kept
+	 until the frame ends, then all of it goes after the CRC. */
+	static uint8_t const fecMax =
+		config_option_fecParity<Config>::value > ReedSolomon::maxParity ?
+		ReedSolomon::maxParity : config_option_fecParity<Config>::value;
+	typedef typename fec_type<(fecMax>0)>::type FEC;
+	static unsigned int const fecMaxBlocks = Config::maxPacketSize/(255-fecMax)+1;
+
+	static uint8_t fecParity;       // In use on the link, zero if none
+	static FEC infec,outfec;
+	static uint8_t fecTxParity[fecMax ? fecMaxBlocks*fecMax : 1];
+	static uint8_t fecTxUsed;       // Bytes in the block being sent
+	static uint8_t fecTxBlocks;     // Full blocks in this frame
+	static uint16_t fecCorrected;   // Bytes fixed so far, wraps
+
+	/* Command bundles */
+	static unsigned int const bundleSize = config_option_bundleSize<Config>::value;
+	static unsigned char bundleBuf[bundleSize ? bundleSize : 1];
+	static buffer_size_t bundlePtr;     // End of bundled data
+	static buffer_size_t bundleRecord;  // Start of record being added
+	static uint8_t bundleTimer;
+
+	/* Fragments */
+	enum fragment_event {
+		FRAGMENT_DATA,    // More of the message
+		FRAGMENT_END,     // Last piece of the message
+		FRAGMENT_ABORT    // A fragment was lost, forget the message
+	};
+
+	typedef void (*fragment_handler_t)(const unsigned char *data, packet_size_t size,
+									   uint32_t offset, fragment_event event);
+
+	static uint8_t txFragSeq;          // Trailer of fragment being sent
+	static packet_size_t txFragUsed;   // Bytes in it so far
+	static bool inFragments;           // Receiving a fragmented message
+	static uint8_t rxFragSeq;          // Next fragment expected
+	static uint32_t rxFragOffset;      // Bytes of the message received
+	static bool fragStream;            // ... and they go to a streaming function
+	static command_t fragCommand;      // Which one
+	static unsigned char *reassemblyBuf;
+	static buffer_size_t reassemblySize;
+	static fragment_handler_t fragmentHandler;
+
+	/* Compressed commands */
+	static unsigned int const compressSize = config_option_compressSize<Config>::value;
+	static unsigned int const decompressSize = config_option_decompressSize<Config>::value;
+	typedef typename compress_type<(compressSize>0),
+		config_option_compressWindow<Config>::value,
+		config_option_compressLength<Config>::value>::type Compressor;
+
+	static Compressor compressor;
+	static unsigned char compressBuf[compressSize ? compressSize : 1];
+	static unsigned char compressOut[compressSize ? compressSize : 1];
+	static uint16_t compressPtr;        // Bytes of the staged command
+	static uint8_t compressCommands[32]; // Always compressed, one bit each
+	static bool compressAny;            // Some bit is set in there
+	static bool compressSending;        // Staged command is going out
+	static uint32_t compressRaw;        // Bytes of commands sent compressed, wraps
+	static uint32_t compressPacked;     // ... and what they took, wraps
+	static unsigned char decompressBuf[decompressSize ? decompressSize : 1];
+	static const unsigned char *rawData; // Arguments, when not in pBuf
+	static buffer_size_t rawSize;
+
+	/* Information field of SNRM/UA. If both sides send it, and both
+	 have the same byte order, we can skip the little-endian wire
+	 format and send values as they are in memory. */
+	static uint8_t const wireBigEndian = 0x01;
+
+	static inline uint8_t wireFlags()
+	{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+		return wireBigEndian;
+#else
+		return 0;
+#endif
+	}
+
+	static inline bool wireSwap()
+	{
+		return !(linkFlags & LINK_FLAG_NATIVE);
+	}
+
+	static inline void checkWireFlags()
+	{
+		linkFlags &= ~LINK_FLAG_NATIVE;
+		if (lastPacketSize>0 && ((pBuf[2] ^ wireFlags()) & wireBigEndian)==0) {
+			linkFlags |= LINK_FLAG_NATIVE;
+		}
+	}
 
 	struct HDLC_header {
 		uint8_t address;
@@ -141,9 +442,65 @@ public:
 	};
 
 
+	/* Characters the line cannot carry as they are, like XON/XOFF when
+	 there is software flow control. We escape them, and ask the peer to
+	 do the same when XID is exchanged; once it has, any that come in
+	 unescaped were put there by the line and are dropped. Set before
+	 the link comes up. setEscapeLow() is all 32 control characters.
+	 Peers without maps only hear whether we need any control character
+	 escaped, and then escape them all. */
+	static void setEscapeMap(const uint8_t *map)
+	{
+		memcpy(escapeLocal,map,sizeof(escapeLocal));
+		resetEscapes();
+	}
+
+	static inline void setEscape(uint8_t c, bool on=true)
+	{
+		if (on)
+			escapeLocal[c>>3] |= 1<<(c&7);
+		else
+			escapeLocal[c>>3] &= ~(1<<(c&7));
+		resetEscapes();
+	}
+
 	static inline void setEscapeLow(bool a)
 	{
-		forceEscapingLow=a;
+		memset(escapeLocal,a ? 0xFF : 0,4);
+		resetEscapes();
+	}
+
+	static inline bool inEscapeMap(const uint8_t *map, uint8_t c)
+	{
+		return map[c>>3] & (1<<(c&7));
+	}
+
+	static inline bool mustEscape(uint8_t c)
+	{
+#ifndef AVR
+		return escapeTable[c];
+#else
+		return inEscapeMap(escapeTx,c);
+#endif
+	}
+
+	static void escapeTxChanged()
+	{
+#ifndef AVR
+		unsigned int c;
+		for (c=0; c<256; c++)
+			escapeTable[c] = inEscapeMap(escapeTx,c);
+#endif
+	}
+
+	/* Back to our own map, until the peer tells its own */
+	static void resetEscapes()
+	{
+		memcpy(escapeTx,escapeLocal,sizeof(escapeTx));
+		escapeTx[frameFlag>>3] |= 1<<(frameFlag&7);
+		escapeTx[escapeFlag>>3] |= 1<<(escapeFlag&7);
+		escapeRxCheck = false;
+		escapeTxChanged();
 	}
 
 	static inline void dumpPacket() { /* Debuggin only */
@@ -158,6 +515,11 @@ public:
 	static inline RawBuffer getRawBuffer()
 	{
 		RawBuffer r;
+		if (rawData) {
+			r.buffer = (unsigned char*)rawData;
+			r.size = rawSize;
+			return r;
+		}
 		r.buffer = pBuf+3;
 		r.size = lastPacketSize;
 		LOG("getRawBuffer() : size %u %u\n", r.size,lastPacketSize);
@@ -166,7 +528,16 @@ public:
 
 	static inline void sendByte(uint8_t byte)
 	{
-		if (byte==frameFlag || byte==escapeFlag || (forceEscapingLow&&byte<0x20)) {
+		if (fecMax && fecParity)
+			fecUpdate(byte);
+		if (replyCacheSize && replyState==REPLY_KEEPING)
+			keepReply(byte);
+		sendEscaped(byte);
+	}
+
+	static inline void sendEscaped(uint8_t byte)
+	{
+		if (mustEscape(byte)) {
 			Serial::write(escapeFlag);
 			Serial::write(byte ^ escapeXOR);
 		} else
@@ -216,7 +587,7 @@ public:
 		SARME       = 0x4C, // 11-010 Set Asynchronous Response Mode Extended
 		SNRME       = 0xCC, // 11-011 Set Normal Response Mode Extended
 		SARM        = 0x2C, // 11-100 Set Asynchronous Response Mode
-		// SABM        // 11-101 Set Asynchronous Balanced Mode DUP
+		SABM        = 0x2C, // 11-100 Set Asynchronous Balanced Mode, same code as SARM
 		XID         = 0xAC, // 11-101 Exchange identification
 		SABME       = 0x6C  // 11-110 Set Asynchronous Balanced Mode Extended
 		// 11-111 Not used
@@ -225,50 +596,562 @@ public:
 	static inline void sendInformationControlField()
 	{
 		uint8_t ifield;
-		ifield = txSeqNum<<1 | rxNextSeqNum<<5 | 0x10;
+		ifield = txSeqNum<<1 | rxNextSeqNum<<5;
+		if (!config_option_pollSecondary<Config>::value)
+			ifield |= 0x10;
+		if (replyCacheSize && replyState)
+			startReply();
 		sendByte( ifield );
 		outcrc.update( ifield );
 	}
 
-	static void startPacket(packet_size_t len)
+	/* len is the most the command may take, including the command
+	 itself. S and U frames pass zero. */
+	static void startPacket(uint32_t len)
 	{
+		if (len) {
+			txRefused = false;
+			if (txFlags & TX_FLAG_UI) {
+				if (featuresKnown && !(features & featureUI)) {
+					refusePacket();
+					return;
+				}
+			} else if (peerBusy()) {
+				/* No I-frames until the peer sends RR */
+				refusePacket();
+				return;
+			}
+		}
+		if (compressSize && !compressSending && (features & featureCompress) &&
+			((txFlags & TX_FLAG_COMPRESS) || compressAny) &&
+			len>=compressMin && len<=compressSize) {
+			txFlags |= TX_FLAG_STAGED;
+			compressPtr = 0;
+			return;
+		}
+		if (txFlags & TX_FLAG_BUNDLE) {
+			/* Length, and the record itself */
+			if ((features & featureBundle) && len+(len>0x7F ? 2 : 1) <= bundleCapacity()) {
+				startBundleRecord();
+				return;
+			}
+			/* Peer does not take bundles, or it would not fit even
+			 alone: goes in its own frame */
+			txFlags &= ~TX_FLAG_BUNDLE;
+		}
+		/* Anything bundled goes first, to keep commands in order */
+		if (bundlePtr)
+			flushBundle();
 		outcrc.reset();
-		pBufPtr=0;
+		/* Address, control and CRC */
+		if (len > (uint32_t)maxFrame-4) {
+			if (!(features & featureFragment) ||
+				(!(txFlags & TX_FLAG_UI) &&
+				 (len+fragmentCapacity()-1)/fragmentCapacity() > (uint32_t)window-unacked())) {
+				/* Peer does not take fragments, or not all of them
+				 fit in the window */
+				refusePacket();
+				return;
+			}
+			txFlags |= TX_FLAG_FRAGMENT;
+			txFragSeq = fragmentFirst;
+			txFragUsed = 0;
+		}
+	}
+
+	static inline void refusePacket()
+	{
+		LOG("Command refused, not sent\n");
+		txFlags |= TX_FLAG_DROP;
+		txRefused = true;
+	}
+
+	/* True if the last command sent was thrown away instead: the peer
+	 is busy (RNR), or it needs more fragments than the window has room
+	 for, or something the peer did not agree to in XID (fragments, UI
+	 frames). Nothing of it went out, send it again later. */
+	static inline bool sendRefused()
+	{
+		return txRefused;
+	}
+
+	/* Bundles: several commands in one I-frame, to save on framing
+	 overhead. The frame carries bundleCommand, followed by records,
+	 each a varint length and then command and arguments as usual.
+
+	 Records are built in bundleBuf, and the frame goes out when the
+	 next record does not fit, on flushBundle(), when bundleDelay ticks
+	 passed since the first record, or before any other I-frame. A
+	 command too large for the bundle goes in a frame of its own. */
+
+	static command_t const bundleCommand = 0xFF;
+
+	static inline void beginBundle()
+	{
+		if (bundleSize)
+			txFlags |= TX_FLAG_BUNDLE;
+	}
+
+	static inline buffer_size_t bundleCapacity()
+	{
+		/* Address, control, bundle command and CRC */
+		packet_size_t max = maxFrame-5;
+		return max < bundleSize ? max : bundleSize;
+	}
+
+	static void startBundleRecord()
+	{
+		bundleRecord = bundlePtr;
+		txFlags &= ~TX_FLAG_TOOBIG;
+		bundleAppend(0); // Length, filled in at the end
+	}
+
+	static void bundleAppend(uint8_t c)
+	{
+		if (txFlags & TX_FLAG_TOOBIG)
+			return;
+		if (bundlePtr >= bundleCapacity()) {
+			/* Send previous records, move this one to the front */
+			sendBundle(bundleRecord);
+			if (bundlePtr >= bundleCapacity()) {
+				LOG("Command larger than it said, dropping it\n");
+				bundlePtr = bundleRecord;
+				txFlags |= TX_FLAG_TOOBIG;
+				return;
+			}
+		}
+		bundleBuf[bundlePtr++] = c;
+	}
+
+	static void endBundleRecord()
+	{
+		txFlags &= ~TX_FLAG_BUNDLE;
+		if (!bundleSize || (txFlags & TX_FLAG_TOOBIG))
+			return;
+
+		buffer_size_t len = bundlePtr-bundleRecord-1;
+		if (bundleSize>0x7F && len>0x7F) {
+			/* Needs a two-byte length */
+			bundleAppend(0);
+			if (txFlags & TX_FLAG_TOOBIG)
+				return;
+			memmove(&bundleBuf[bundleRecord+2],&bundleBuf[bundleRecord+1],len);
+			bundleBuf[bundleRecord+1] = len>>7;
+			bundleBuf[bundleRecord] = (len & 0x7F) | 0x80;
+		} else {
+			bundleBuf[bundleRecord] = len;
+		}
+
+		if (!bundleTimer)
+			bundleTimer = config_option_bundleDelay<Config>::value;
+	}
+
+	/* Send the first 'size' bytes of the bundle, keep the rest */
+	static void sendBundle(buffer_size_t size)
+	{
+		uint8_t flags = txFlags;
+		buffer_size_t rest = bundlePtr-size;
+
+		if (size && peerBusy()) {
+			/* Keep it all, the timer tries again */
+			if (!bundleTimer)
+				bundleTimer = 1;
+			return;
+		}
+		if (size) {
+			bundlePtr = 0;
+			txFlags &= ~(TX_FLAG_BUNDLE|TX_FLAG_UI|TX_FLAG_BCAST);
+			startPacket(size+1);
+			sendPreamble();
+			sendData(bundleCommand);
+			sendData(bundleBuf,size);
+			sendPostamble();
+			txFlags = flags;
+			memmove(bundleBuf,&bundleBuf[size],rest);
+		}
+		bundlePtr = rest;
+		bundleRecord = 0;
+		bundleTimer = 0;
+	}
+
+	static void flushBundle()
+	{
+		sendBundle(bundlePtr);
+	}
+
+	/* Fragments: a command too large for one frame is split across
+	 several frames, I or UI, as it's being sent. Each one carries
+	 fragmentCommand, the next piece of the command and its arguments,
+	 and a trailer byte with the fragment sequence and first/last flags.
+	 The trailer goes last since we only know which fragment is the last
+	 one when the sender is done, and we never hold more than the byte
+	 being sent.
+
+	 The receiver puts the pieces together in the buffer given with
+	 setReassemblyBuffer(), and runs the command when the last one
+	 arrives. Without one, pieces go to the handler given with
+	 setFragmentHandler() as they come, so large blobs can be consumed
+	 with little memory. A missing fragment drops the whole message.
+
+	 I-frames are never sent again, and fragments are no different: a
+	 message goes out only if all of its fragments fit in the window
+	 left, and is refused otherwise (see sendRefused()). So the largest
+	 one is window*fragmentCapacity() bytes. */
+
+	static command_t const fragmentCommand = 0xFE;
+	static uint8_t const fragmentFirst = 0x80;
+	static uint8_t const fragmentLast = 0x40;
+	static uint8_t const fragmentSeqMask = 0x3F;
+
+	static inline void setReassemblyBuffer(unsigned char *buf, buffer_size_t size)
+	{
+		reassemblyBuf = buf;
+		reassemblySize = size;
+	}
+
+	static inline void setFragmentHandler(fragment_handler_t handler)
+	{
+		fragmentHandler = handler;
+	}
+
+	static inline packet_size_t fragmentCapacity()
+	{
+		/* Address, control, fragment command, trailer and CRC */
+		return maxFrame-6;
+	}
+
+	/* I-frames sent the peer did not ack yet */
+	static inline uint8_t unacked()
+	{
+		return (txSeqNum-txAcked) & 7;
+	}
+
+	/* N(R) of a frame from the peer: it has all frames before that one */
+	static void ackReceived(uint8_t nr)
+	{
+		if (((nr-txAcked) & 7) <= unacked())
+			txAcked = nr;
+	}
+
+	static void sendFragmentByte(uint8_t c)
+	{
+		if (txFragUsed >= fragmentCapacity()) {
+			/* This one is full, and there is more to come */
+			endFragment(0);
+			txFragSeq = (txFragSeq+1) & fragmentSeqMask;
+			txFragUsed = 0;
+			outcrc.reset();
+			sendPreamble();
+		}
+		outcrc.update(c);
+		sendByte(c);
+		txFragUsed++;
+	}
+
+	static void endFragment(uint8_t flags)
+	{
+		uint8_t trailer = flags | txFragSeq;
+		outcrc.update(trailer);
+		sendByte(trailer);
+		endFrame();
+	}
+
+	static void abortFragments()
+	{
+		if (inFragments) {
+			if (fragStream)
+				Implementation::streamAbort(fragCommand);
+			else if (!reassemblyBuf && fragmentHandler)
+				fragmentHandler(0,0,rxFragOffset,FRAGMENT_ABORT);
+		}
+		inFragments = false;
+	}
+
+	static void reassemble(const unsigned char *buf, packet_size_t size)
+	{
+		if (size==0)
+			return;
+		uint8_t trailer = buf[--size];
+
+		if (trailer & fragmentFirst) {
+			if (inFragments) {
+				LOG("Fragmented message cut short\n");
+				abortFragments();
+			}
+			inFragments = true;
+			rxFragSeq = 0;
+			rxFragOffset = 0;
+			fragStream = size && Implementation::isStreaming(buf[0]);
+			if (fragStream) {
+				fragCommand = buf[0];
+				buf++;
+				size--;
+			}
+		} else if (!inFragments) {
+			return;
+		} else if ((trailer & fragmentSeqMask) != (rxFragSeq & fragmentSeqMask)) {
+			LOG("Lost fragment %u\n", rxFragSeq);
+			abortFragments();
+			return;
+		}
+		rxFragSeq++;
+
+		bool last = trailer & fragmentLast;
+
+		if (fragStream) {
+			if (size)
+				Implementation::streamChunk(fragCommand,buf,size);
+			rxFragOffset += size;
+			if (last) {
+				inFragments = false;
+				Implementation::streamCommit(fragCommand,true);
+			}
+		} else if (reassemblyBuf) {
+			if (size > reassemblySize-rxFragOffset) {
+				LOG("Fragmented message too large, dropping it\n");
+				inFragments = false;
+				return;
+			}
+			memcpy(&reassemblyBuf[rxFragOffset],buf,size);
+			rxFragOffset += size;
+			if (last) {
+				inFragments = false;
+				deliver(reassemblyBuf,rxFragOffset);
+			}
+		} else if (fragmentHandler) {
+			fragmentHandler(buf,size,rxFragOffset,last ? FRAGMENT_END : FRAGMENT_DATA);
+			rxFragOffset += size;
+			if (last)
+				inFragments = false;
+		} else {
+			LOG("Fragment received, but nowhere to put it\n");
+			inFragments = false;
+		}
+	}
+
+	/* Compressed commands: one marked with setCompress(), or the next
+	 one after compressNext(), is packed with LZSS (SerProCompress.h)
+	 before it goes out, if the peer takes them and it comes out
+	 smaller. The frame carries compressedCommand and the packed
+	 command, and it can be bundled or fragmented like any other. The
+	 receiver unpacks it in decompressBuf and runs it from there. */
+
+	static command_t const compressedCommand = 0xFD;
+	/* Shorter ones hardly ever shrink */
+	static unsigned int const compressMin = 16;
+
+	/* compressedCommand, fragmentCommand and bundleCommand would hide
+	 functions 253 to 255. Does not compile if maxFunctions reaches
+	 them. */
+	typedef char reserved_commands_check[Config::maxFunctions<=compressedCommand ? 1 : -1];
+
+	static inline void compressNext()
+	{
+		if (compressSize)
+			txFlags |= TX_FLAG_COMPRESS;
+	}
+
+	static void setCompress(command_t command, bool on=true)
+	{
+		if (on)
+			compressCommands[command>>3] |= 1<<(command&7);
+		else
+			compressCommands[command>>3] &= ~(1<<(command&7));
+		uint8_t i, any = 0;
+		for (i=0; i<sizeof(compressCommands); i++)
+			any |= compressCommands[i];
+		compressAny = any!=0;
+	}
+
+	static void stageData(uint8_t c)
+	{
+		if (compressPtr<compressSize) {
+			compressBuf[compressPtr++] = c;
+		} else {
+			LOG("Command larger than it said, cutting it\n");
+		}
+	}
+
+	/* Send the staged command, packed if that is worth it */
+	static void sendStaged()
+	{
+		const unsigned char *buf = compressBuf;
+		uint16_t size = compressPtr;
+		bool wanted = (txFlags & TX_FLAG_COMPRESS) ||
+			(size && (compressCommands[compressBuf[0]>>3] & (1<<(compressBuf[0]&7))));
+
+		txFlags &= ~(TX_FLAG_STAGED|TX_FLAG_COMPRESS);
+		if (wanted && size>=compressMin) {
+			/* Must save at least a byte, with compressedCommand */
+			unsigned int packed = compressor.pack(compressBuf,size,compressOut+1,size-2);
+			if (packed) {
+				compressOut[0] = compressedCommand;
+				compressRaw += size;
+				compressPacked += packed+1;
+				buf = compressOut;
+				size = packed+1;
+			}
+		}
+		compressSending = true;
+		startPacket(size);
+		sendPreamble();
+		sendData(buf,size);
+		sendPostamble();
+		compressSending = false;
+	}
+
+	/* Run one command, unpacking it first if it's compressed */
+	static void deliver(const unsigned char *buf, buffer_size_t size)
+	{
+		if (!size || buf[0]!=compressedCommand) {
+			Implementation::processPacket(buf,size);
+			return;
+		}
+		if (!decompressSize) {
+			LOG("Compressed command, but we cannot take them\n");
+			return;
+		}
+		unsigned int n = SerProLZSSFormat::unpack(buf+1,size-1,decompressBuf,decompressSize);
+		if (!n) {
+			LOG("Bad compressed command, dropping it\n");
+			return;
+		}
+		rawData = decompressBuf+1;
+		rawSize = n-1;
+		Implementation::processPacket(decompressBuf,n);
+		rawData = 0;
+	}
+
+	/* Hand a received command to the implementation, unpacking it first
+	 if it's a bundle */
+	static void dispatch(const unsigned char *buf, packet_size_t size)
+	{
+		if (size && buf[0]==fragmentCommand) {
+			reassemble(buf+1,size-1);
+			return;
+		}
+		if (size==0 || buf[0]!=bundleCommand) {
+			deliver(buf,size);
+			return;
+		}
+		packet_size_t pos = 1;
+		while (pos<size) {
+			packet_size_t len = buf[pos++];
+			if (len & 0x80) {
+				if (pos>=size)
+					break;
+				len = (len & 0x7F) | ((packet_size_t)buf[pos++]<<7);
+			}
+			if (len>size-pos)
+				break;
+			deliver(buf+pos,len);
+			pos+=len;
+		}
+	}
+
+	/* Make the next frame an Unnumbered Information one. These carry
+	 commands just like I-frames, but have no sequence number and are
+	 never acknowledged or retransmitted. */
+	static inline void startUnacknowledged(bool broadcast)
+	{
+		txFlags |= TX_FLAG_UI;
+		if (broadcast)
+			txFlags |= TX_FLAG_BCAST;
 	}
 
 	static void sendPreamble()
 	{
+		if (txFlags & (TX_FLAG_BUNDLE|TX_FLAG_STAGED|TX_FLAG_DROP))
+			return;
+		uint8_t address = txFlags & TX_FLAG_BCAST ? allStations : linkAddress;
 		Serial::write( frameFlag );
-		sendByte( (uint8_t)Config::stationId );
-		outcrc.update( (uint8_t)Config::stationId );
-		sendInformationControlField();
+		sendByte( address );
+		outcrc.update( address );
+		if (txFlags & TX_FLAG_UI) {
+			uint8_t v = (uint8_t)UI | 0x03;
+			sendByte(v);
+			outcrc.update(v);
+		} else {
+			sendInformationControlField();
+		}
+		if (txFlags & TX_FLAG_FRAGMENT) {
+			outcrc.update(fragmentCommand);
+			sendByte(fragmentCommand);
+		}
 	}
 
 	static void sendPostamble()
+	{
+		if (txFlags & TX_FLAG_DROP) {
+			txFlags &= ~(TX_FLAG_DROP|TX_FLAG_UI|TX_FLAG_BCAST|TX_FLAG_BUNDLE|TX_FLAG_COMPRESS);
+			return;
+		}
+		if (txFlags & TX_FLAG_STAGED) {
+			sendStaged();
+			return;
+		}
+		/* Not compressed after all, too small or too large */
+		txFlags &= ~TX_FLAG_COMPRESS;
+		if (txFlags & TX_FLAG_BUNDLE) {
+			endBundleRecord();
+			return;
+		}
+
+		if (txFlags & TX_FLAG_FRAGMENT)
+			endFragment(fragmentLast);
+		else
+			endFrame();
+		txFlags &= ~(TX_FLAG_UI|TX_FLAG_BCAST|TX_FLAG_FRAGMENT);
+	}
+
+	static void endFrame()
 	{
 		CRC16_ccitt::crc_t crc = outcrc.get();
 		sendByte(crc & 0xff);
 		sendByte(crc>>8);
-		Serial::write(frameFlag);
+		closeFrame();
 		Serial::flush();
 
+		if (txFlags & TX_FLAG_UI) {
+			/* No sequence, and no N(R) in it */
+			return;
+		}
+
 		txSeqNum++;
 		txSeqNum&=0x7; // Cap at 3-bits only.
 
 		linkFlags |= LINK_FLAG_PACKETSENT;
+		ackSent(); // N(R) went out with this frame
 	}
 	static void sendSUPostamble()
 	{
 		CRC16_ccitt::crc_t crc = outcrc.get();
 		sendByte(crc & 0xff);
 		sendByte(crc>>8);
-		Serial::write(frameFlag);
+		closeFrame();
 		Serial::flush();
 	}
 
 	static void sendData(const unsigned char * const buf, packet_size_t size)
 	{
 		packet_size_t i;
+		if (txFlags & TX_FLAG_DROP)
+			return;
+		if (txFlags & TX_FLAG_STAGED) {
+			for (i=0;i<size;i++)
+				stageData(buf[i]);
+			return;
+		}
+		if (txFlags & TX_FLAG_BUNDLE) {
+			for (i=0;i<size;i++)
+				bundleAppend(buf[i]);
+			return;
+		}
+		if (txFlags & TX_FLAG_FRAGMENT) {
+			for (i=0;i<size;i++)
+				sendFragmentByte(buf[i]);
+			return;
+		}
 		LOG("Sending %d payload\n",size);
 		for (i=0;i<size;i++) {
 			outcrc.update(buf[i]);
@@ -278,6 +1161,20 @@ public:
 
 	static void sendData(unsigned char c)
 	{
+		if (txFlags & TX_FLAG_DROP)
+			return;
+		if (txFlags & TX_FLAG_STAGED) {
+			stageData(c);
+			return;
+		}
+		if (txFlags & TX_FLAG_BUNDLE) {
+			bundleAppend(c);
+			return;
+		}
+		if (txFlags & TX_FLAG_FRAGMENT) {
+			sendFragmentByte(c);
+			return;
+		}
 		outcrc.update(c);
 		sendByte(c);
 	}
@@ -314,13 +1211,34 @@ public:
 		HDLC_header *h = (HDLC_header*)pBuf;
 		supervisory_command c = (supervisory_command)(h->control.sframe.function);
 		LOG("Got supervisory frame 0x%02x\n", c);
+		/* A poll bit right after our own poll is the peer's answer */
+		bool polled = h->control.sframe.poll && !(linkFlags & (LINK_FLAG_PRIMARY|LINK_FLAG_BUSYPOLL));
+		if (h->control.sframe.poll)
+			linkFlags &= ~LINK_FLAG_BUSYPOLL;
+		ackReceived(h->control.sframe.seq);
+
 		switch (c) {
 		case RR:
 			LOG("RR, ack'ed 0x%02x\n", h->control.sframe.seq);
+			if (linkFlags & LINK_FLAG_PEERBUSY) {
+				LOG("Peer ready again\n");
+				linkFlags &= ~LINK_FLAG_PEERBUSY;
+			}
+			break;
+		case RNR:
+			LOG("RNR, ack'ed 0x%02x\n", h->control.sframe.seq);
+			if (!(linkFlags & LINK_FLAG_PEERBUSY)) {
+				linkFlags |= LINK_FLAG_PEERBUSY;
+				busyTimer = config_option_busyPollInterval<Config>::value;
+			}
 			break;
 		default:
 			LOG("Unhandled supervisory frame\n");
 		}
+		if (polled) {
+			/* Polled, and nothing else to say */
+			sendSupervisoryFrame(readyCommand(),true);
+		}
 
 	}
 
@@ -331,23 +1249,100 @@ public:
 		LOG("Unnumbered frame 0x%02x (0x%02x)\n",c,h->control.value);
 		switch(c) {
 		case SNRM:
-			sendUnnumberedFrame(UA);
+		case SABM:
+			checkWireFlags();
+			{
+				/* F answers P */
+				unnumbered_command ua = (unnumbered_command)(UA | (h->control.value & 0x10));
+				if (lastPacketSize>0) {
+					uint8_t flags = wireFlags();
+					sendUnnumberedFrame(ua,&flags,1);
+				} else {
+					sendUnnumberedFrame(ua);
+				}
+			}
 			linkFlags |= LINK_FLAG_LINKUP;
+			linkFlags &= ~(LINK_FLAG_PEERBUSY|LINK_FLAG_BUSYPOLL);
 			// Reset tx/rx sequences
 			txSeqNum=0;
+			txAcked=0;
 			rxNextSeqNum=0;
+			rxDelivered=0;
+			resetEscapes();
+			/* Maybe another peer, XID tells again */
+			features=0;
+			featuresKnown=xidRefused;
 			LOG("Link up, NRM\n");
 			break;
 		case DM:
+		case FRMR:
+			if (linkFlags & LINK_FLAG_XIDSENT) {
+				/* Older peer, it does not know XID, and may have
+				 dropped the link along with the DM. Set it up again
+				 and stay with the defaults. */
+				LOG("Peer has no XID, keeping defaults\n");
+				xidDefaults();
+				xidRefused = true;
+				if (linkManaged)
+					sendLinkSetup();
+				break;
+			}
+			if (c==FRMR) {
+				/* As for any other we do not handle */
+				sendUnnumberedFrame(DM);
+				linkFlags &= ~LINK_FLAG_LINKUP;
+				LOG("Link down\n");
+				break;
+			}
 			linkFlags &= ~LINK_FLAG_LINKUP;
 			LOG("Link down\n");
+			if (linkManaged)
+				linkTimer = linkRetry;
 			break;
 		case UA:
+			checkWireFlags();
 			linkFlags |= LINK_FLAG_LINKUP;
+			linkFlags &= ~(LINK_FLAG_PEERBUSY|LINK_FLAG_BUSYPOLL);
 			// Reset tx/rx sequences
 			txSeqNum=0;
+			txAcked=0;
 			rxNextSeqNum=0;
+			rxDelivered=0;
+			resetEscapes();
+			/* Maybe another peer, XID tells again */
+			features=0;
+			featuresKnown=xidRefused;
 			LOG("Link up, by our request\n");
+			if (linkManaged) {
+				linkRetry = config_option_linkRetryMin<Config>::value;
+				linkMisses = 0;
+				linkRxFrames = rxFrames;
+				linkTimer = config_option_linkKeepalive<Config>::value;
+				if (!xidRefused)
+					requestXID();
+			}
+			break;
+
+		case XID:
+			handleXID();
+			break;
+
+		case TEST:
+			/* Echo a probe right away, as a response (P/F clear), so
+			 the peer times the line and not us. Works with the link
+			 down too. */
+			if (h->control.value & 0x10)
+				sendUnnumberedFrame(TEST,pBuf+2,lastPacketSize);
+			else if (testHandler)
+				testHandler(pBuf+2,lastPacketSize);
+			break;
+
+		case UI:
+			/* Connectionless, works even with link down. Never
+			 acknowledged. Functions called from a broadcast should not
+			 reply on a shared bus, or all stations will talk at once. */
+			if (lastPacketSize>0)
+				dispatch(pBuf+2,lastPacketSize);
 			break;
 
 		default:
@@ -358,7 +1353,384 @@ public:
 		}
 	}
 
-	static void sendUnnumberedFrame(unnumbered_command c)
+	/* XID information field. A list of parameters, each as
+	 <id> <length> <value>, values little-endian. Unknown parameters are
+	 skipped, so new ones can be added later. All values describe what
+	 the sender can cope with. */
+
+	enum xid_parameter {
+		XID_MAXFRAME = 0x01, // Largest frame we can receive (2 bytes)
+		XID_WINDOW   = 0x02, // Frames we accept before acking (1 byte)
+		XID_CHECKSUM = 0x03, // Checksums we support, bitmask (1 byte)
+		XID_ESCAPE   = 0x04, // We need control chars escaped (1 byte)
+		XID_FEATURES = 0x05, // Optional features, bitmask (1 byte)
+		XID_FEC      = 0x06, // Reed-Solomon parity bytes per block (1 byte)
+		XID_ACCM     = 0x07  // Characters we need escaped, bitmap (0-32 bytes)
+	};
+
+	static uint8_t const xidChecksumCCITT = 0x01;
+
+	/* Optional features. Peers that don't know about a feature drop
+	 the link when they see it, so we only use one once XID says the
+	 peer has it. Until then commands go one per frame, and those that
+	 need fragments are refused. UI frames are the exception: they work
+	 with no link at all (SerProTransfer), so they are only refused once
+	 XID told us the peer does not take them. */
+	static uint8_t const featureUI = 0x01;   // UI frames and broadcast
+	static uint8_t const featureBundle = 0x02; // Command bundles
+	static uint8_t const featureFragment = 0x04; // Fragmented commands
+	/* We send it if we unpack compressed commands. In 'features' it
+	 means the peer does, and we pack them. */
+	static uint8_t const featureCompress = 0x08;
+
+	static uint8_t localFeatures()
+	{
+		return featureUI | featureBundle | featureFragment |
+			(decompressSize ? featureCompress : 0);
+	}
+
+	static void sendXID()
+	{
+		unsigned char info[19+2+32];
+		info[0] = XID_MAXFRAME;
+		info[1] = 2;
+		info[2] = Config::maxPacketSize & 0xff;
+		info[3] = Config::maxPacketSize >> 8;
+		info[4] = XID_WINDOW;
+		info[5] = 1;
+		info[6] = config_option_windowSize<Config>::value;
+		info[7] = XID_CHECKSUM;
+		info[8] = 1;
+		info[9] = xidChecksumCCITT;
+		info[10] = XID_ESCAPE;
+		info[11] = 1;
+		info[12] = (escapeLocal[0] | escapeLocal[1] | escapeLocal[2] | escapeLocal[3]) ? 1 : 0;
+		info[13] = XID_FEATURES;
+		info[14] = 1;
+		info[15] = localFeatures();
+		info[16] = XID_FEC;
+		info[17] = 1;
+		info[18] = fecMax;
+		/* Only tell about FEC if we have it */
+		uint8_t n = fecMax ? 19 : 16;
+		uint8_t len = sizeof(escapeLocal);
+		while (len && !escapeLocal[len-1])
+			len--;
+		info[n++] = XID_ACCM;
+		info[n++] = len;
+		memcpy(info+n,escapeLocal,len);
+		sendUnnumberedFrame(XID,info,n+len);
+	}
+
+	static void handleXID()
+	{
+		const unsigned char *p = pBuf+2;
+		packet_size_t left = lastPacketSize;
+		uint8_t checksums = xidChecksumCCITT;
+		uint8_t fec = 0;
+		bool peerMap = false, peerLow = false;
+		uint8_t peerFeatures = 0;
+		uint8_t i;
+
+		/* Defaults for parameters the peer did not send */
+		maxFrame = Config::maxPacketSize;
+		window = config_option_windowSize<Config>::value;
+		features = localFeatures();
+		featuresKnown = true;
+		resetEscapes();
+
+		while (left>=2 && (packet_size_t)p[1]+2 <= left) {
+			const unsigned char *v = p+2;
+			switch (p[0]) {
+			case XID_MAXFRAME:
+				if (p[1]>=2) {
+					packet_size_t peer = v[0] | ((packet_size_t)v[1]<<8);
+					if (peer<maxFrame)
+						maxFrame = peer;
+				}
+				break;
+			case XID_WINDOW:
+				if (p[1]>=1 && v[0]<window)
+					window = v[0];
+				break;
+			case XID_CHECKSUM:
+				if (p[1]>=1)
+					checksums &= v[0];
+				break;
+			case XID_ESCAPE:
+				if (p[1]>=1 && v[0])
+					peerLow = true;
+				break;
+			case XID_ACCM:
+				for (i=0; i<p[1] && i<sizeof(escapeTx); i++)
+					escapeTx[i] |= v[i];
+				peerMap = true;
+				break;
+			case XID_FEATURES:
+				if (p[1]>=1) {
+					features &= v[0];
+					peerFeatures = v[0];
+				}
+				break;
+			case XID_FEC:
+				if (p[1]>=1)
+					fec = v[0] < fecMax ? v[0] : fecMax;
+				break;
+			default:
+				break;
+			}
+			left -= p[1]+2;
+			p += p[1]+2;
+		}
+
+		if (window==0)
+			window = 1;
+
+		/* Compression goes one way: what counts is whether the peer
+		 unpacks and we pack */
+		features &= ~featureCompress;
+		if (compressSize)
+			features |= peerFeatures & featureCompress;
+
+		/* The map says more, if the peer has one */
+		if (peerLow && !peerMap)
+			memset(escapeTx,0xFF,4);
+		escapeTxChanged();
+
+		if (fec) {
+			/* maxFrame is the same on both sides, so is this */
+			maxFrame -= (maxFrame+254)/255*fec;
+		}
+
+		LOG("XID: frame %u, window %u, checksums 0x%02x, features 0x%02x, FEC %u\n",
+			maxFrame, window, checksums, features, fec);
+
+		if (!checksums) {
+			/* No common checksum, we cannot talk to this peer */
+			sendUnnumberedFrame(DM);
+			linkFlags &= ~LINK_FLAG_LINKUP;
+			return;
+		}
+
+		if (linkFlags & LINK_FLAG_XIDSENT) {
+			/* This was the reply to our own XID */
+			linkFlags &= ~LINK_FLAG_XIDSENT;
+		} else {
+			sendXID();
+		}
+		/* Our reply went out as before, what follows is protected */
+		setFEC(fec);
+		escapeRxCheck = peerMap;
+	}
+
+	/* Link parameters for a peer that answered our XID with DM or FRMR:
+	 our own limits, and nothing optional */
+	static void xidDefaults()
+	{
+		linkFlags &= ~LINK_FLAG_XIDSENT;
+		maxFrame = Config::maxPacketSize;
+		window = config_option_windowSize<Config>::value;
+		features = 0;
+		featuresKnown = true;
+		resetEscapes();
+		setFEC(0);
+		escapeRxCheck = false;
+	}
+
+	/* Start the exchange. The peer's reply is handled by handleXID() */
+	static void requestXID()
+	{
+		linkFlags |= LINK_FLAG_XIDSENT;
+		sendXID();
+	}
+
+	/* Encoder side of FEC, fed every byte of the frame */
+	static void fecUpdate(uint8_t byte)
+	{
+		outfec.update(byte);
+		if (++fecTxUsed == 255-fecParity) {
+			if (fecTxBlocks < fecMaxBlocks)
+				memcpy(&fecTxParity[fecTxBlocks*fecParity],outfec.get(),fecParity);
+			fecTxBlocks++;
+			fecTxUsed = 0;
+			outfec.reset();
+		}
+	}
+
+	/* Parity (if any), and the closing flag */
+	static void closeFrame()
+	{
+		if (replyCacheSize && replyState==REPLY_KEEPING) {
+			/* Without the CRC */
+			replyLen[replySeq] -= 2;
+			replyState = REPLY_KEPT;
+		}
+		if (fecMax && fecParity) {
+			unsigned int i;
+			for (i=0; i<(unsigned int)fecTxBlocks*fecParity; i++)
+				sendEscaped(fecTxParity[i]);
+			if (fecTxUsed) {
+				const uint8_t *p = outfec.get();
+				for (i=0; i<fecParity; i++)
+					sendEscaped(p[i]);
+			}
+			fecTxUsed = 0;
+			fecTxBlocks = 0;
+			outfec.reset();
+		}
+		Serial::write(frameFlag);
+	}
+
+	static void setFEC(uint8_t parity)
+	{
+		if (parity>fecMax)
+			parity = fecMax;
+		fecParity = parity;
+		infec.setParity(parity);
+		outfec.setParity(parity);
+		fecTxUsed = 0;
+		fecTxBlocks = 0;
+	}
+
+	/* Correct a received frame and strip its parity. Frames sent
+	 without it, before both sides agreed, still pass on their CRC. */
+	static void fecDecode()
+	{
+		buffer_size_t len = pBufPtr;
+		buffer_size_t blocks = (len+254)/255;
+		uint8_t k = 255-fecParity;
+		buffer_size_t i;
+		bool clean = true;
+
+		if (len < blocks*fecParity+4)
+			return;
+		buffer_size_t n = len - blocks*fecParity;
+
+		for (i=0; i<blocks && clean; i++) {
+			buffer_size_t size = i+1<blocks ? k : n-i*k;
+			infec.reset();
+			infec.update(pBuf+i*k,size);
+			clean = memcmp(infec.get(),pBuf+n+i*fecParity,fecParity)==0;
+		}
+		infec.reset();
+		if (clean) {
+			pBufPtr = n;
+			return;
+		}
+
+		CRCTYPE crc;
+		crc.reset();
+		for (i=0; i<len-2; i++)
+			crc.update(pBuf[i]);
+		if (crc.get() == *((crc_t*)&pBuf[len-2])) {
+			LOG("Frame without FEC\n");
+			return;
+		}
+
+		for (i=0; i<blocks; i++) {
+			buffer_size_t size = i+1<blocks ? k : n-i*k;
+			int fixed = infec.decode(pBuf+i*k,size,pBuf+n+i*fecParity);
+			if (fixed<0) {
+				LOG("FEC cannot correct block %u\n",i);
+				return;
+			}
+			fecCorrected += fixed;
+		}
+		LOG("FEC corrected frame\n");
+		pBufPtr = n;
+	}
+
+	/* Primary station: set the link up ourselves, try again until the
+	 peer answers, and set it up again whenever the peer goes away.
+	 Call timerTick() for all of it. */
+	static void startLink(bool balanced=false)
+	{
+		linkManaged = true;
+		linkBalanced = balanced;
+		linkFlags |= LINK_FLAG_PRIMARY;
+		linkFlags &= ~LINK_FLAG_LINKUP;
+		linkRetry = config_option_linkRetryMin<Config>::value;
+		xidRefused = false;
+		sendLinkSetup();
+	}
+
+	static void stopLink()
+	{
+		linkManaged = false;
+		linkFlags &= ~LINK_FLAG_PRIMARY;
+		if (linkFlags & LINK_FLAG_LINKUP) {
+			/* Peer answers with DM */
+			sendUnnumberedFrame(RD);
+			linkFlags &= ~LINK_FLAG_LINKUP;
+		}
+	}
+
+	static inline bool isLinkUp()
+	{
+		return linkFlags & LINK_FLAG_LINKUP;
+	}
+
+	/* TEST frames. One with the poll bit set is sent back as it is,
+	 without the poll bit; that one goes to the handler given with
+	 setTestHandler(). See SerProRTT.h. */
+
+	static inline void sendTest(const unsigned char *data, packet_size_t size)
+	{
+		sendUnnumberedFrame((unnumbered_command)(TEST|0x10),data,size);
+	}
+
+	static inline void setTestHandler(test_handler_t handler)
+	{
+		testHandler = handler;
+	}
+
+	static void sendLinkSetup()
+	{
+		uint8_t flags = wireFlags();
+		sendUnnumberedFrame(linkBalanced ? SABM : SNRM,&flags,1);
+		linkTimer = linkRetry;
+	}
+
+	static void linkTick()
+	{
+		if (!(linkFlags & LINK_FLAG_LINKUP)) {
+			if (linkTimer && --linkTimer)
+				return;
+			LOG("No answer to link setup, trying again\n");
+			linkRetry = linkRetry < config_option_linkRetryMax<Config>::value/2 ?
+				linkRetry*2 : config_option_linkRetryMax<Config>::value;
+			sendLinkSetup();
+			return;
+		}
+
+		if (rxFrames != linkRxFrames) {
+			/* Heard from the peer */
+			linkRxFrames = rxFrames;
+			linkMisses = 0;
+			linkTimer = config_option_linkKeepalive<Config>::value;
+			return;
+		}
+		if (!config_option_linkKeepalive<Config>::value || (linkTimer && --linkTimer))
+			return;
+
+		if (linkMisses >= config_option_linkMaxMisses<Config>::value) {
+			LOG("Peer lost, setting link up again\n");
+			linkFlags &= ~LINK_FLAG_LINKUP;
+			linkRetry = config_option_linkRetryMin<Config>::value;
+			sendLinkSetup();
+			return;
+		}
+		linkMisses++;
+		sendSupervisoryFrame(readyCommand(),true);
+		linkTimer = config_option_linkRetryMin<Config>::value;
+	}
+
+	static inline packet_size_t getMaxFrame()
+	{
+		return maxFrame;
+	}
+
+	static void sendUnnumberedFrame(unnumbered_command c, const unsigned char *info=0, packet_size_t size=0)
 	{
 		uint8_t v = (uint8_t)c;
 		v |= 0x03;
@@ -366,32 +1738,124 @@ public:
 		startPacket(0);
 		LOG("V: %02x c=%02x\n",v,c);
 		Serial::write( frameFlag );
-		sendByte( (uint8_t)Config::stationId );
-		outcrc.update( (uint8_t)Config::stationId );
+		sendByte( linkAddress );
+		outcrc.update( linkAddress );
 		sendByte(v);
 		outcrc.update(v);
+		if (size)
+			sendData(info,size);
 		sendSUPostamble();
 	}
 
-	static void sendSupervisoryFrame(supervisory_command c)
+	static void sendSupervisoryFrame(supervisory_command c, bool poll=false)
 	{
 		uint8_t v = 0x01;
 		v |= c<<2;
 		v |= (rxNextSeqNum<<5);
+		if (poll)
+			v |= 0x10;
 
 		startPacket(0);
 		
 		Serial::write( frameFlag );
-		sendByte( (uint8_t)Config::stationId );
-		outcrc.update( (uint8_t)Config::stationId );
+		sendByte( linkAddress );
+		outcrc.update( linkAddress );
 		sendByte(v);
 		outcrc.update(v);
 		sendSUPostamble();
+		ackSent();
+	}
+
+	/* What our acks say: RNR while we are busy */
+	static inline supervisory_command readyCommand()
+	{
+		return linkFlags & LINK_FLAG_LOCALBUSY ? RNR : RR;
+	}
+
+	static inline bool peerBusy()
+	{
+		return linkFlags & LINK_FLAG_PEERBUSY;
+	}
+
+	/* Tell how much work is waiting for the application (queued
+	 commands, bytes, whatever unit rnrHighWater is in). Frames already
+	 on their way when we send RNR are still taken. */
+	static void setBacklog(uint16_t level)
+	{
+		if (!config_option_rnrHighWater<Config>::value)
+			return;
+		if (!(linkFlags & LINK_FLAG_LOCALBUSY)) {
+			if (level < config_option_rnrHighWater<Config>::value)
+				return;
+			LOG("Backlog %u, receiver not ready\n", level);
+			linkFlags |= LINK_FLAG_LOCALBUSY;
+		} else {
+			if (level > config_option_rnrLowWater<Config>::value)
+				return;
+			LOG("Backlog %u, receiver ready\n", level);
+			linkFlags &= ~LINK_FLAG_LOCALBUSY;
+		}
+		if (linkFlags & LINK_FLAG_LINKUP)
+			sendSupervisoryFrame(readyCommand());
+	}
+
+	static inline void ackSent()
+	{
+		ackPending = 0;
+		ackTimer = 0;
+	}
+
+	/* Called after an I-frame was handled */
+	static void answerFrame()
+	{
+		if (config_option_pollSecondary<Config>::value) {
+			/* Last frame of our answer */
+			sendSupervisoryFrame(readyCommand(),true);
+		} else if ((linkFlags & LINK_FLAG_PRIMARY) && !linkManaged) {
+			/* SerProPoller: the station may still be talking, our
+			 next frame to it carries the ack */
+		} else if (!(linkFlags & LINK_FLAG_PACKETSENT)) {
+			ackDelayed();
+		}
+	}
+
+	/* Called after we accepted an I-frame the handler did not reply to.
+	 Ack at once if delay is off or the peer's window is full, otherwise
+	 wait for the handler's reply or the timer. */
+	static void ackDelayed()
+	{
+		ackPending++;
+		if (config_option_ackDelay<Config>::value==0 || ackPending>=window) {
+			ackLastFrame();
+		} else if (!ackTimer) {
+			ackTimer = config_option_ackDelay<Config>::value;
+		}
+	}
+
+	static void timerTick()
+	{
+		if (bundleTimer && --bundleTimer==0) {
+			if (peerBusy())
+				bundleTimer = 1;
+			else
+				flushBundle();
+		}
+		if (ackTimer && --ackTimer==0) {
+			LOG("Ack delay expired, %u frames\n", ackPending);
+			ackLastFrame();
+		}
+		if (linkManaged)
+			linkTick();
+		if (peerBusy() && busyTimer && --busyTimer==0) {
+			busyTimer = config_option_busyPollInterval<Config>::value;
+			linkFlags |= LINK_FLAG_BUSYPOLL;
+			sendSupervisoryFrame(readyCommand(),true);
+		}
 	}
 
 	static void ackLastFrame()
 	{
-		uint8_t v = RR << 2;
+		uint8_t v = readyCommand() << 2;
 		v|= 0x01;
 		v|= (rxNextSeqNum & 0x7)<<5;
 
@@ -399,11 +1863,117 @@ public:
 
 		startPacket(0);
 		Serial::write( frameFlag );
-		sendByte( (uint8_t)Config::stationId );
-		outcrc.update( (uint8_t)Config::stationId );
+		sendByte( linkAddress );
+		outcrc.update( linkAddress );
 		sendByte(v);
 		outcrc.update(v);
 		sendSUPostamble();
+		ackSent();
+	}
+
+	enum reply_state {
+		REPLY_NONE,
+		REPLY_WAITING,      // Handling a frame, nothing sent yet
+		REPLY_KEEPING,      // Sending the reply, keeping it
+		REPLY_KEPT,
+		REPLY_SPOILED       // Too large, or more than one frame
+	};
+
+	static void startReply()
+	{
+		if (replyState==REPLY_WAITING) {
+			replyState = REPLY_KEEPING;
+		} else {
+			replyLen[replySeq] = 0;
+			replyState = REPLY_SPOILED;
+		}
+	}
+
+	static inline void keepReply(uint8_t byte)
+	{
+		uint16_t &len = replyLen[replySeq];
+		if (len<replyCacheSize) {
+			replyBuf[replySeq*replyCacheSize+len++] = byte;
+		} else {
+			len = 0;
+			replyState = REPLY_SPOILED;
+		}
+	}
+
+	/* Delivered a few frames back, and not a new one */
+	static bool wasDelivered(uint8_t seq)
+	{
+		uint8_t behind = (rxNextSeqNum-seq) & 0x7;
+		/* After a lost frame the peer's next ones are up to window-1
+		 ahead, which is 9-window and more behind. Only what is closer
+		 cannot be one of those. */
+		uint8_t range = window<=4 ? window : window<8 ? 8-window : 0;
+		return (linkFlags & LINK_FLAG_LINKUP) && behind>=1 && behind<=range &&
+			(rxDelivered & (1<<seq));
+	}
+
+	/* ... and the same frame as then */
+	static inline bool isDuplicate(uint8_t seq, crc_t crc)
+	{
+		return wasDelivered(seq) && rxFrameCRC[seq]==crc;
+	}
+
+	/* An I-frame we ran already, or one after a frame we lost */
+	static void outOfSequence(uint8_t seq, crc_t crc)
+	{
+		if (isDuplicate(seq,crc)) {
+			LOG("Frame %u again, not running it\n",seq);
+			if (!sendReplyAgain(seq) || config_option_pollSecondary<Config>::value)
+				sendSupervisoryFrame(readyCommand(),config_option_pollSecondary<Config>::value);
+		} else {
+			sendSupervisoryFrame(REJ,config_option_pollSecondary<Config>::value);
+			LOG("************* INVALID FRAME RECEIVED ***************\n");
+		}
+	}
+
+	/* Around running an I-frame in sequence: remember it, and keep the
+	 reply sent meanwhile if there is room */
+	static inline void startDelivery(uint8_t seq, crc_t crc)
+	{
+		rxFrameCRC[seq] = crc;
+		rxDelivered |= 1<<seq;
+		replyLen[seq] = 0;
+		replySeq = seq;
+		if (replyCacheSize)
+			replyState = REPLY_WAITING;
+	}
+
+	static inline void endDelivery(uint8_t seq)
+	{
+		if (replyCacheSize) {
+			if (replyState!=REPLY_KEPT)
+				replyLen[seq] = 0;
+			replyState = REPLY_NONE;
+		}
+	}
+
+	/* The same I-frame as before, with what we acknowledge now */
+	static bool sendReplyAgain(uint8_t seq)
+	{
+		if (!replyCacheSize || replyLen[seq]==0)
+			return false;
+		const unsigned char *r = &replyBuf[seq*replyCacheSize];
+		uint8_t v = (r[0] & 0x1F) | rxNextSeqNum<<5;
+		uint16_t i;
+
+		startPacket(0);
+		Serial::write( frameFlag );
+		sendByte( linkAddress );
+		outcrc.update( linkAddress );
+		sendByte(v);
+		outcrc.update(v);
+		for (i=1; i<replyLen[seq]; i++) {
+			outcrc.update(r[i]);
+			sendByte(r[i]);
+		}
+		sendSUPostamble();
+		ackSent();
+		return true;
 	}
 
 	static void preProcessPacket()
@@ -416,8 +1986,10 @@ public:
 			return;
 		}
 
-		/* Make sure packet is meant for us. We can safely check
-		 this before actually computing CRC */
+		/* Address was already checked in processData() */
+
+		if (fecMax && fecParity)
+			fecDecode();
 
 		packet_size_t i;
 		incrc.reset();
@@ -428,23 +2000,26 @@ public:
 		if (pcrc!=incrc.get()) {
 			/* CRC error */
 			LOG("CRC ERROR, expected 0x%04x, got 0x%04x\n",incrc.get(),pcrc);
+			crcErrors++;
 			return;
 		}
 		LOG("CRC MATCH 0x%04x, got 0x%04x\n",incrc.get(),pcrc);
 		lastPacketSize = pBufPtr-4;
+		inAddressField = h->address;
+		inControlField = h->control.value;
+		rxFrames++;
 		LOG("Packet details: destination ID %u, control 0x%02x\n", h->address,h->control.value);
 
 		if ((h->control.frame_type.flag & 1) == 0) {
 			/* Information  */
 			LOG("Information frame\n");
+			if (linkFlags & LINK_FLAG_LINKUP)
+				ackReceived(h->control.iframe.rxseq);
 
 			/* Ensure this packet comes in sequence */
 
 			if (rxNextSeqNum != h->control.iframe.txseq) {
-				// Reject frame here ????
-				sendSupervisoryFrame(REJ);
-
-				LOG("************* INVALID FRAME RECEIVED ***************\n");
+				outOfSequence(h->control.iframe.txseq,pcrc);
 			} else {
 				// Check acks
 
@@ -454,18 +2029,19 @@ public:
 
 
 				if (linkFlags & LINK_FLAG_LINKUP) {
+					uint8_t seq = h->control.iframe.txseq;
 					rxNextSeqNum++;
 					rxNextSeqNum&=0x7;
 
 					linkFlags &= ~LINK_FLAG_PACKETSENT;
 
-					Implementation::processPacket(pBuf+2,pBufPtr-4);
+					startDelivery(seq,pcrc);
+					dispatch(pBuf+2,pBufPtr-4);
+					endDelivery(seq);
 
-					if (!(linkFlags & LINK_FLAG_PACKETSENT)) {
-						ackLastFrame();
-					}
+					answerFrame();
 				} else {
-					sendSupervisoryFrame(REJ);
+					sendSupervisoryFrame(REJ,config_option_pollSecondary<Config>::value);
 					LOG("Link down, dropping frame\n");
 				}
 			}
@@ -484,6 +2060,111 @@ public:
 		pBufPtr=0;
 	}
 
+	/* Streaming: frames for a streaming function (see SerPro.h) are
+	 handed over in chunks as they come in, so they can be much larger
+	 than pBuf, and work on them starts before they end. We only know
+	 the last two bytes are the CRC when the closing flag arrives, so
+	 those are always held back. The CRC is computed as we go, and
+	 given to the function on commit.
+
+	 An I-frame we delivered already may come again, if our ack got lost.
+	 Only its CRC tells whether it is the same frame, so it is streamed
+	 without handing anything over, and answered at the end as
+	 preProcessPacket() would. */
+
+	static void startStream()
+	{
+		HDLC_header *h = (HDLC_header*)pBuf;
+		if (fecMax && fecParity) {
+			/* Needs the whole frame before it can be checked */
+			return;
+		}
+		streamAgain = false;
+		if (h->control.frame_type.flag & 1) {
+			if ((h->control.value & 0xEF) != ((uint8_t)UI | 0x03))
+				return;
+		} else if (!(linkFlags & LINK_FLAG_LINKUP)) {
+			/* Let preProcessPacket() reject it */
+			return;
+		} else if (h->control.iframe.txseq != rxNextSeqNum) {
+			if (!wasDelivered(h->control.iframe.txseq))
+				return;
+			streamAgain = true;
+		}
+		if (!Implementation::isStreaming(pBuf[2]))
+			return;
+
+		inStream = true;
+		incrc.reset();
+		incrc.update(pBuf[0]);
+		incrc.update(pBuf[1]);
+		incrc.update(pBuf[2]);
+	}
+
+	/* Hand over payload up to 'end', keep the rest */
+	static void streamData(buffer_size_t end)
+	{
+		buffer_size_t i;
+		for (i=3;i<end;i++)
+			incrc.update(pBuf[i]);
+		if (end>3 && !streamAgain)
+			Implementation::streamChunk(pBuf[2],pBuf+3,end-3);
+		for (i=end;i<pBufPtr;i++)
+			pBuf[3+i-end] = pBuf[i];
+		pBufPtr = 3+pBufPtr-end;
+	}
+
+	static void endStream()
+	{
+		HDLC_header *h = (HDLC_header*)pBuf;
+		command_t command = pBuf[2];
+
+		inStream = false;
+		if (pBufPtr<5) {
+			LOG("Short streamed frame\n");
+			if (!streamAgain)
+				Implementation::streamAbort(command);
+			return;
+		}
+		streamData(pBufPtr-2);
+
+		crc_t pcrc = *((crc_t*)&pBuf[3]);
+		if (pcrc!=incrc.get()) {
+			LOG("CRC ERROR on streamed frame, expected 0x%04x, got 0x%04x\n",incrc.get(),pcrc);
+			crcErrors++;
+			if (!streamAgain)
+				Implementation::streamCommit(command,false);
+			return;
+		}
+
+		inAddressField = h->address;
+		inControlField = h->control.value;
+		rxFrames++;
+
+		if (h->control.frame_type.flag & 1) {
+			/* UI */
+			Implementation::streamCommit(command,true);
+			return;
+		}
+
+		uint8_t seq = h->control.iframe.txseq;
+		ackReceived(h->control.iframe.rxseq);
+		if (streamAgain) {
+			outOfSequence(seq,pcrc);
+			return;
+		}
+
+		rxNextSeqNum++;
+		rxNextSeqNum&=0x7;
+		linkFlags &= ~LINK_FLAG_PACKETSENT;
+
+		startDelivery(seq,pcrc);
+		Implementation::streamCommit(command,true);
+		endDelivery(seq);
+
+		answerFrame();
+	}
+
 	static void processData(uint8_t bIn)
 	{
 		LOG("Process data: %d (0x%02x)\n",bIn,bIn);
@@ -492,11 +2173,26 @@ public:
 			return;
 		}
 
+		if (bIn==frameFlag && unEscaping) {
+			/* Abort sequence. Drop the frame, this flag starts a new one */
+			LOG("Frame aborted\n");
+			unEscaping = false;
+			inPacket = false;
+			if (inStream) {
+				inStream = false;
+				if (!streamAgain)
+					Implementation::streamAbort(pBuf[2]);
+			}
+		}
+
 		// Check unescape error ?
 		if (bIn==frameFlag && !unEscaping) {
 			if (inPacket) {
 				/* End of packet */
-				if (pBufPtr) {
+				if (inStream) {
+					endStream();
+					inPacket = false;
+				} else if (pBufPtr) {
 					preProcessPacket();
 					inPacket = false;
 				}
@@ -510,29 +2206,132 @@ public:
 			if (unEscaping) {
 				bIn^=escapeXOR;
 				unEscaping=false;
+			} else if (escapeRxCheck && inEscapeMap(escapeLocal,bIn)) {
+				/* Should have come escaped, the line put it there */
+				LOG("Unescaped 0x%02x, dropping it\n",bIn);
+				return;
+			}
+
+			if (!inPacket)
+				return;
+
+			if (pBufPtr==0 && (config_option_filterAddress<Config>::value ||
+							   config_option_pollSecondary<Config>::value) &&
+				bIn!=linkAddress && bIn!=allStations) {
+				/* Not for us. Skip until next flag */
+				LOG("Frame for station %u, ignoring\n",bIn);
+				inPacket = false;
+				return;
 			}
 
 			if (pBufPtr<Config::maxPacketSize) {
 				pBuf[pBufPtr++]=bIn;
+				if (pBufPtr==3)
+					startStream();
+			} else if (inStream) {
+				streamData(pBufPtr-2);
+				pBuf[pBufPtr++]=bIn;
 			} else {
-				// Process overrun error
+				/* Too long for us, skip until next flag. Larger
+				 commands must come in fragments. */
+				LOG("Frame overrun, dropping it\n");
+				inPacket = false;
 			}
 		}
 	}
 };
 
+#ifndef AVR
+#define IMPLEMENT_ESCAPE_TABLE(SerPro) \
+	template<> bool SerPro::MyProtocol::escapeTable[256] = { \
+		0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, \
+		0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, \
+		0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, \
+		0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,0 };
+#else
+#define IMPLEMENT_ESCAPE_TABLE(SerPro)
+#endif
+
 #define IMPLEMENT_PROTOCOL_SerProHDLC(SerPro) \
 	template<> SerPro::MyProtocol::buffer_size_t SerPro::MyProtocol::pBufPtr=0; \
 	template<> uint8_t SerPro::MyProtocol::txSeqNum=0; \
+	template<> uint8_t SerPro::MyProtocol::txAcked=0; \
 	template<> uint8_t SerPro::MyProtocol::rxNextSeqNum=0; \
 	template<> uint8_t SerPro::MyProtocol::linkFlags=0; \
+	template<> uint8_t SerPro::MyProtocol::inAddressField=0; \
+	template<> uint8_t SerPro::MyProtocol::inControlField=0; \
+	template<> uint8_t SerPro::MyProtocol::rxFrames=0; \
+	template<> uint16_t SerPro::MyProtocol::crcErrors=0; \
+	template<> uint8_t SerPro::MyProtocol::linkAddress=SerPro::MyProtocol::config_type::stationId; \
+	template<> SerPro::MyProtocol::packet_size_t SerPro::MyProtocol::maxFrame=SerPro::MyProtocol::config_type::maxPacketSize; \
+	template<> uint8_t SerPro::MyProtocol::window=config_option_windowSize<SerPro::MyProtocol::config_type>::value; \
+	template<> uint8_t SerPro::MyProtocol::features=0; \
+	template<> bool SerPro::MyProtocol::featuresKnown=false; \
+	template<> uint8_t SerPro::MyProtocol::ackTimer=0; \
+	template<> uint8_t SerPro::MyProtocol::ackPending=0; \
+	template<> uint16_t SerPro::MyProtocol::busyTimer=0; \
+	template<> SerPro::MyProtocol::crc_t SerPro::MyProtocol::rxFrameCRC[8]={0}; \
+	template<> uint8_t SerPro::MyProtocol::rxDelivered=0; \
+	template<> unsigned char SerPro::MyProtocol::replyBuf[]={0}; \
+	template<> uint16_t SerPro::MyProtocol::replyLen[8]={0}; \
+	template<> uint8_t SerPro::MyProtocol::replySeq=0; \
+	template<> uint8_t SerPro::MyProtocol::replyState=0; \
+	template<> bool SerPro::MyProtocol::linkManaged=false; \
+	template<> bool SerPro::MyProtocol::linkBalanced=false; \
+	template<> uint16_t SerPro::MyProtocol::linkTimer=0; \
+	template<> uint16_t SerPro::MyProtocol::linkRetry=0; \
+	template<> uint8_t SerPro::MyProtocol::linkMisses=0; \
+	template<> uint8_t SerPro::MyProtocol::linkRxFrames=0; \
+	template<> bool SerPro::MyProtocol::xidRefused=false; \
+	template<> SerPro::MyProtocol::test_handler_t SerPro::MyProtocol::testHandler=0; \
+	template<> uint8_t SerPro::MyProtocol::fecParity=0; \
+	template<> SerPro::MyProtocol::FEC SerPro::MyProtocol::infec=SerPro::MyProtocol::FEC(); \
+	template<> SerPro::MyProtocol::FEC SerPro::MyProtocol::outfec=SerPro::MyProtocol::FEC(); \
+	template<> uint8_t SerPro::MyProtocol::fecTxParity[]={0}; \
+	template<> uint8_t SerPro::MyProtocol::fecTxUsed=0; \
+	template<> uint8_t SerPro::MyProtocol::fecTxBlocks=0; \
+	template<> uint16_t SerPro::MyProtocol::fecCorrected=0; \
+	template<> uint8_t SerPro::MyProtocol::txFlags=0; \
+	template<> bool SerPro::MyProtocol::txRefused=false; \
+	template<> unsigned char SerPro::MyProtocol::bundleBuf[]={0}; \
+	template<> SerPro::MyProtocol::buffer_size_t SerPro::MyProtocol::bundlePtr=0; \
+	template<> SerPro::MyProtocol::buffer_size_t SerPro::MyProtocol::bundleRecord=0; \
+	template<> uint8_t SerPro::MyProtocol::bundleTimer=0; \
+	template<> uint8_t SerPro::MyProtocol::txFragSeq=0; \
+	template<> SerPro::MyProtocol::packet_size_t SerPro::MyProtocol::txFragUsed=0; \
+	template<> bool SerPro::MyProtocol::inFragments=false; \
+	template<> uint8_t SerPro::MyProtocol::rxFragSeq=0; \
+	template<> uint32_t SerPro::MyProtocol::rxFragOffset=0; \
+	template<> bool SerPro::MyProtocol::fragStream=false; \
+	template<> SerPro::MyProtocol::command_t SerPro::MyProtocol::fragCommand=0; \
+	template<> unsigned char *SerPro::MyProtocol::reassemblyBuf=0; \
+	template<> SerPro::MyProtocol::buffer_size_t SerPro::MyProtocol::reassemblySize=0; \
+	template<> SerPro::MyProtocol::fragment_handler_t SerPro::MyProtocol::fragmentHandler=0; \
+	template<> SerPro::MyProtocol::Compressor SerPro::MyProtocol::compressor=SerPro::MyProtocol::Compressor(); \
+	template<> unsigned char SerPro::MyProtocol::compressBuf[]={0}; \
+	template<> unsigned char SerPro::MyProtocol::compressOut[]={0}; \
+	template<> uint16_t SerPro::MyProtocol::compressPtr=0; \
+	template<> uint8_t SerPro::MyProtocol::compressCommands[32]={0}; \
+	template<> bool SerPro::MyProtocol::compressAny=false; \
+	template<> bool SerPro::MyProtocol::compressSending=false; \
+	template<> uint32_t SerPro::MyProtocol::compressRaw=0; \
+	template<> uint32_t SerPro::MyProtocol::compressPacked=0; \
+	template<> unsigned char SerPro::MyProtocol::decompressBuf[]={0}; \
+	template<> const unsigned char *SerPro::MyProtocol::rawData=0; \
+	template<> SerPro::MyProtocol::buffer_size_t SerPro::MyProtocol::rawSize=0; \
 	template<> SerPro::MyProtocol::packet_size_t SerPro::MyProtocol::pSize=0; \
 	template<> SerPro::MyProtocol::packet_size_t SerPro::MyProtocol::lastPacketSize=0; \
 	template<> SerPro::MyProtocol::CRCTYPE SerPro::MyProtocol::incrc=CRCTYPE(); \
 	template<> SerPro::MyProtocol::CRCTYPE SerPro::MyProtocol::outcrc=CRCTYPE(); \
 	template<> bool SerPro::MyProtocol::unEscaping = false; \
-	template<> bool SerPro::MyProtocol::forceEscapingLow = false; \
+	template<> uint8_t SerPro::MyProtocol::escapeLocal[32] = {0}; \
+	template<> uint8_t SerPro::MyProtocol::escapeTx[32] = { \
+		0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x60 /* 0x7D, 0x7E */ }; \
+	template<> bool SerPro::MyProtocol::escapeRxCheck = false; \
+	IMPLEMENT_ESCAPE_TABLE(SerPro) \
 	template<> bool SerPro::MyProtocol::inPacket = false; \
+	template<> bool SerPro::MyProtocol::inStream = false; \
+	template<> bool SerPro::MyProtocol::streamAgain = false; \
 	template<> unsigned char SerPro::MyProtocol::pBuf[]={0};
 
 #endif
@@ -0,0 +1,497 @@
+/*
+ Microbenchmarks for the building blocks under a command: the CRCs, HDLC
+ escaping, argument deserialization and dispatch through the callbacks
+ table, plus a whole frame out and in for scale.
+
+ Each case is run in a loop long enough to time, several times over, and
+ the best run is reported, per byte for the ones that go over a buffer
+ and per call for the others. Inputs include the bad cases: payloads of
+ nothing but flags or escapes, control characters with low escaping on,
+ argument packs starting at an odd address, and varints of the longest
+ kind or too close to the end of the buffer for the fast path.
+
+ -w saves the results to a file; -b compares against such a file, and
+ exits with 1 if any case got slower by more than -t percent (default
+ 10). -f runs only the cases whose name contains the given text.
+
+ Build: g++ -O2 -o micro-bench SerProMicro-bench.cpp crc16.cpp
+ Run:   ./micro-bench [-f filter] [-m ms] [-w file] [-b file] [-t percent]
+ */
+
+#define SERPRO_NO_LOG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <string>
+#include <map>
+#include "SerProHDLC.h"
+#include "SerPro.h"
+
+/* Whatever the code under test produces ends up here, so it can't be
+ optimized away */
+static volatile uint32_t sink;
+
+/* Sent bytes go round a small buffer */
+static unsigned char outBuf[4096];
+static unsigned int outPos;
+
+class SerialWrapper
+{
+public:
+	static inline void write(uint8_t v) {
+		outBuf[outPos++ & (sizeof(outBuf)-1)] = v;
+	}
+	static inline void flush() {
+	}
+};
+
+struct BenchConfig {
+	static unsigned int const maxFunctions = 4;
+	static unsigned int const maxPacketSize = 4096;
+	static unsigned int const stationId = 3;
+};
+
+struct CompactConfig: public BenchConfig {
+	typedef CompactEncoding encoding;
+};
+
+DECLARE_SERPRO(BenchConfig,SerialWrapper,SerProHDLC,SerPro);
+
+/* Only its deserializers are used */
+typedef protocolImplementation<CompactConfig,SerialWrapper,SerProHDLC> Compact;
+
+typedef SerPro::MyProtocol Protocol;
+
+DECLARE_FUNCTION(0)(void) {
+	sink++;
+}
+END_FUNCTION
+
+DECLARE_FUNCTION(1)(uint32_t a) {
+	sink += a;
+}
+END_FUNCTION
+
+DECLARE_FUNCTION(2)(uint8_t a, uint32_t b, uint16_t c, uint64_t d, uint32_t e) {
+	sink += a+b+c+(uint32_t)d+e;
+}
+END_FUNCTION
+
+DECLARE_FUNCTION(3)(CountedBuffer data) {
+	sink += data.size;
+}
+END_FUNCTION
+
+IMPLEMENT_SERPRO(4,SerPro,SerProHDLC);
+
+/* Inputs. Not static, as some are template arguments. */
+
+unsigned char noise[4096+8];
+unsigned char flags[4096];
+unsigned char escapes[4096];
+unsigned char control[4096];
+unsigned char text[4096];
+
+/* Argument packs, as they come after the command byte */
+static unsigned char packRaw[64];
+static unsigned int packSize;
+unsigned char compactSmall[64], compactLarge[64];
+unsigned int compactSmallSize, compactLargeSize;
+static unsigned char bufferPack[128];
+static unsigned int bufferPackSize;
+
+/* A frame as it comes off the line */
+static unsigned char frame[8192];
+static unsigned int frameSize;
+
+static void fillInputs()
+{
+	uint32_t r = 2463534242U;
+	unsigned int i;
+	for (i=0; i<sizeof(noise); i++) {
+		r ^= r<<13;
+		r ^= r>>17;
+		r ^= r<<5;
+		noise[i] = r;
+	}
+	memset(flags,0x7E,sizeof(flags));
+	memset(escapes,0x7D,sizeof(escapes));
+	for (i=0; i<sizeof(control); i++) {
+		control[i] = i & 0x1F;
+		text[i] = "The quick brown fox jumps over the lazy dog. "[i%45];
+	}
+
+	/* uint8_t, uint32_t, uint16_t, uint64_t, uint32_t */
+	uint8_t a = 0x12;
+	uint32_t b = 0x89ABCDEF, e = 0x01020304;
+	uint16_t c = 0x4567;
+	uint64_t d = 0x0123456789ABCDEFULL;
+	unsigned char *p = packRaw;
+	memcpy(p,&a,1); p += 1;
+	memcpy(p,&b,4); p += 4;
+	memcpy(p,&c,2); p += 2;
+	memcpy(p,&d,8); p += 8;
+	memcpy(p,&e,4); p += 4;
+	packSize = p-packRaw;
+
+	/* The same arguments as varints, all one byte long, then all as long
+	 as they get */
+	compactSmallSize = 0;
+	compactSmall[compactSmallSize++] = 0x12;
+	compactSmall[compactSmallSize++] = 0x05;
+	compactSmall[compactSmallSize++] = 0x06;
+	compactSmall[compactSmallSize++] = 0x07;
+	compactSmall[compactSmallSize++] = 0x08;
+	compactLargeSize = 0;
+	compactLarge[compactLargeSize++] = 0xFF;
+	for (i=0; i<4; i++)
+		compactLarge[compactLargeSize++] = 0xFF;
+	compactLarge[compactLargeSize++] = 0x0F;
+	compactLarge[compactLargeSize++] = 0xFF;
+	compactLarge[compactLargeSize++] = 0xFF;
+	compactLarge[compactLargeSize++] = 0x03;
+	for (i=0; i<9; i++)
+		compactLarge[compactLargeSize++] = 0xFF;
+	compactLarge[compactLargeSize++] = 0x01;
+	for (i=0; i<4; i++)
+		compactLarge[compactLargeSize++] = 0xFF;
+	compactLarge[compactLargeSize++] = 0x0F;
+
+	/* CountedBuffer: varint length, then the bytes */
+	bufferPack[0] = 64;
+	memcpy(bufferPack+1,noise,64);
+	bufferPackSize = 65;
+
+	/* Command 3 with 256 noise bytes, framed by our own sender */
+	Protocol::linkFlags |= LINK_FLAG_LINKUP;
+	outPos = 0;
+	SerPro::send(3,CountedBuffer(noise,256));
+	frameSize = outPos;
+	memcpy(frame,outBuf,frameSize);
+	Protocol::txSeqNum = 0;
+}
+
+/* Cases. Each runs its body n times. */
+
+template<class CRC, unsigned int size>
+static void crcCase(unsigned long n)
+{
+	CRC crc;
+	crc.reset();
+	while (n--) {
+		unsigned int i;
+		for (i=0; i<size; i++)
+			crc.update(noise[i]);
+	}
+	sink += crc.get();
+}
+
+template<unsigned char *data, unsigned int size, bool low>
+static void escapeCase(unsigned long n)
+{
+	Protocol::setEscapeLow(low);
+	while (n--) {
+		unsigned int i;
+		for (i=0; i<size; i++)
+			Protocol::sendByte(data[i]);
+	}
+	Protocol::setEscapeLow(false);
+	sink += outPos;
+}
+
+static void onInt(uint32_t v)
+{
+	sink += v;
+}
+
+static void onPack(uint8_t a, uint32_t b, uint16_t c, uint64_t d, uint32_t e)
+{
+	sink += a+b+c+(uint32_t)d+e;
+}
+
+static void onBuffer(CountedBuffer v)
+{
+	sink += v.size;
+}
+
+typedef void (pack_type)(uint8_t, uint32_t, uint16_t, uint64_t, uint32_t);
+
+/* Word-aligned scratch space for the argument cases */
+union Aligned {
+	uint64_t align;
+	unsigned char b[128];
+};
+
+/* Fixed encoding uint32_t, at an offset from a word boundary */
+template<unsigned int offset>
+static void deserInt(unsigned long n)
+{
+	Aligned buf;
+	memcpy(buf.b+offset,noise,4);
+	while (n--) {
+		SerPro::buffer_size_t pos = 0;
+		deserializer<SerPro,void (uint32_t)>::handle(buf.b+offset,pos,4,&onInt);
+	}
+}
+
+/* The five-argument pack, its first byte at an offset from a word
+ boundary. Past the first argument nothing is aligned anyway. */
+template<unsigned int offset>
+static void deserPack(unsigned long n)
+{
+	Aligned buf;
+	memcpy(buf.b+offset,packRaw,packSize);
+	while (n--) {
+		SerPro::buffer_size_t pos = 0;
+		deserializer<SerPro,pack_type>::handle(buf.b+offset,pos,packSize,&onPack);
+	}
+}
+
+/* Cut short, so it fails the bounds check on the last argument */
+static void deserPackShort(unsigned long n)
+{
+	while (n--) {
+		SerPro::buffer_size_t pos = 0;
+		deserializer<SerPro,pack_type>::handle(packRaw,pos,packSize-1,&onPack);
+	}
+}
+
+/* Compact encoding. With 'tail', the pack sits at the very end of the
+ buffer, so no varint has 8 bytes after it and none takes the fast path. */
+template<unsigned char *data, unsigned int *size, bool tail>
+static void deserCompact(unsigned long n)
+{
+	Aligned buf;
+	unsigned int start = tail ? 0 : 1;
+	memcpy(buf.b+start,data,*size);
+	memset(buf.b+start+*size,0,8);
+	while (n--) {
+		Compact::buffer_size_t pos = 0;
+		deserializer<Compact,pack_type>::handle(buf.b+start,pos,*size+(tail ? 0 : 8),&onPack);
+	}
+}
+
+static void deserBuffer(unsigned long n)
+{
+	while (n--) {
+		SerPro::buffer_size_t pos = 0;
+		deserializer<SerPro,void (CountedBuffer)>::handle(bufferPack,pos,bufferPackSize,&onBuffer);
+	}
+}
+
+template<int index>
+static void dispatchCase(unsigned long n)
+{
+	const unsigned char *data;
+	unsigned int size;
+	switch (index) {
+	case 1:
+		data = noise;
+		size = 4;
+		break;
+	case 2:
+		data = packRaw;
+		size = packSize;
+		break;
+	case 3:
+		data = bufferPack;
+		size = bufferPackSize;
+		break;
+	default:
+		data = 0;
+		size = 0;
+	}
+	while (n--) {
+		SerPro::callFunction(index,data,size);
+		/* An index out of range does nothing, but should still cost */
+		__asm__ __volatile__("" ::: "memory");
+	}
+}
+
+static void sendFrame(unsigned long n)
+{
+	while (n--) {
+		SerPro::send(3,CountedBuffer(noise,256));
+		Protocol::txSeqNum = 0;
+	}
+}
+
+static void receiveFrame(unsigned long n)
+{
+	while (n--) {
+		Protocol::rxNextSeqNum = 0;
+		unsigned int i;
+		for (i=0; i<frameSize; i++)
+			Protocol::processData(frame[i]);
+	}
+}
+
+struct Case {
+	const char *name;
+	unsigned int bytes;     // Per run of the body, zero to report per call
+	void (*run)(unsigned long);
+};
+
+static Case const cases[] = {
+	{ "crc/ccitt/16",            16,   &crcCase<CRC16_ccitt,16> },
+	{ "crc/ccitt/256",           256,  &crcCase<CRC16_ccitt,256> },
+	{ "crc/ccitt/4096",          4096, &crcCase<CRC16_ccitt,4096> },
+	{ "crc/crc16/16",            16,   &crcCase<CRC16,16> },
+	{ "crc/crc16/256",           256,  &crcCase<CRC16,256> },
+	{ "crc/crc16/4096",          4096, &crcCase<CRC16,4096> },
+	{ "crc/rfc1549/16",          16,   &crcCase<CRC16_rfc1549,16> },
+	{ "crc/rfc1549/256",         256,  &crcCase<CRC16_rfc1549,256> },
+	{ "crc/rfc1549/4096",        4096, &crcCase<CRC16_rfc1549,4096> },
+
+	{ "escape/noise/256",       256,  &escapeCase<noise,256,false> },
+	{ "escape/text/256",         256,  &escapeCase<text,256,false> },
+	{ "escape/all-7e/256",       256,  &escapeCase<flags,256,false> },
+	{ "escape/all-7d/256",       256,  &escapeCase<escapes,256,false> },
+	{ "escape/control/256",      256,  &escapeCase<control,256,false> },
+	{ "escape/control-low/256",  256,  &escapeCase<control,256,true> },
+	{ "escape/noise/4096",      4096, &escapeCase<noise,4096,false> },
+	{ "escape/all-7e/4096",      4096, &escapeCase<flags,4096,false> },
+
+	{ "deser/u32/aligned",       0,    &deserInt<0> },
+	{ "deser/u32/offset-1",      0,    &deserInt<1> },
+	{ "deser/u32/offset-3",      0,    &deserInt<3> },
+	{ "deser/pack5/aligned",     0,    &deserPack<0> },
+	{ "deser/pack5/offset-1",    0,    &deserPack<1> },
+	{ "deser/pack5/offset-3",    0,    &deserPack<3> },
+	{ "deser/pack5/short",       0,    &deserPackShort },
+	{ "deser/compact5/small",    0,    &deserCompact<compactSmall,&compactSmallSize,false> },
+	{ "deser/compact5/large",    0,    &deserCompact<compactLarge,&compactLargeSize,false> },
+	{ "deser/compact5/small-tail", 0,  &deserCompact<compactSmall,&compactSmallSize,true> },
+	{ "deser/compact5/large-tail", 0,  &deserCompact<compactLarge,&compactLargeSize,true> },
+	{ "deser/buffer/64",         0,    &deserBuffer },
+
+	{ "dispatch/void",           0,    &dispatchCase<0> },
+	{ "dispatch/u32",            0,    &dispatchCase<1> },
+	{ "dispatch/pack5",          0,    &dispatchCase<2> },
+	{ "dispatch/buffer",         0,    &dispatchCase<3> },
+	{ "dispatch/out-of-range",   0,    &dispatchCase<BenchConfig::maxFunctions> },
+
+	{ "frame/send/256",          256,  &sendFrame },
+	{ "frame/receive/256",       256,  &receiveFrame },
+};
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Nanoseconds per call of the body, best of several runs of at least
+ 'minTime' seconds each */
+static double measure(void (*run)(unsigned long), double minTime)
+{
+	unsigned long n = 1;
+	double t;
+	while (true) {
+		double start = now();
+		run(n);
+		t = now()-start;
+		if (t>=minTime/4 || n>=1UL<<30)
+			break;
+		n *= 2;
+	}
+	n = (unsigned long)(n*minTime/t)+1;
+	double best = 0;
+	int i;
+	for (i=0; i<5; i++) {
+		double start = now();
+		run(n);
+		t = (now()-start)/n;
+		if (i==0 || t<best)
+			best = t;
+	}
+	return best*1e9;
+}
+
+static bool loadBaseline(const char *file, std::map<std::string,double> &out)
+{
+	FILE *f = fopen(file,"r");
+	if (!f)
+		return false;
+	char name[128];
+	double v;
+	while (fscanf(f,"%127s %lf%*[^\n]",name,&v)==2)
+		out[name] = v;
+	fclose(f);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	const char *filter = 0, *save = 0, *baseline = 0;
+	double minTime = 0.02, threshold = 10;
+	int c;
+	while ((c = getopt(argc,argv,"f:m:w:b:t:"))!=-1) {
+		switch (c) {
+		case 'f':
+			filter = optarg;
+			break;
+		case 'm':
+			minTime = atof(optarg)/1000;
+			break;
+		case 'w':
+			save = optarg;
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 't':
+			threshold = atof(optarg);
+			break;
+		default:
+			fprintf(stderr,"Usage: %s [-f filter] [-m ms] [-w file] [-b file] [-t percent]\n",argv[0]);
+			return 1;
+		}
+	}
+
+	std::map<std::string,double> base;
+	if (baseline && !loadBaseline(baseline,base)) {
+		perror(baseline);
+		return 1;
+	}
+	FILE *out = 0;
+	if (save && !(out = fopen(save,"w"))) {
+		perror(save);
+		return 1;
+	}
+
+	fillInputs();
+
+	unsigned int i, slower = 0;
+	for (i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+		const Case &k = cases[i];
+		if (filter && !strstr(k.name,filter))
+			continue;
+		double ns = measure(k.run,minTime);
+		if (k.bytes)
+			ns /= k.bytes;
+		const char *unit = k.bytes ? "ns/byte" : "ns/call";
+		printf("%-28s %9.3f %s",k.name,ns,unit);
+		if (out)
+			fprintf(out,"%s %.4f %s\n",k.name,ns,unit);
+		std::map<std::string,double>::const_iterator b = base.find(k.name);
+		if (b!=base.end() && b->second>0) {
+			double change = (ns/b->second-1)*100;
+			printf("  %+6.1f%%",change);
+			if (change>threshold) {
+				printf("  SLOWER");
+				slower++;
+			}
+		}
+		printf("\n");
+	}
+	if (out)
+		fclose(out);
+	if (baseline)
+		printf("%u slower than the baseline by more than %.0f%%\n",slower,threshold);
+	return slower ? 1 : 0;
+}
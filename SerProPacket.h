@@ -55,6 +55,46 @@ public:
 		uint8_t size;
 	};
 
+	/* No link setup here, so always use the little-endian wire format */
+	static inline bool wireSwap()
+	{
+		return true;
+	}
+
+	/* Every packet is unacknowledged here, and there's no addressing */
+	static inline void startUnacknowledged(bool)
+	{
+	}
+
+	/* No bundles, commands go out as they are sent */
+	static inline void beginBundle()
+	{
+	}
+
+	static inline void flushBundle()
+	{
+	}
+
+	/* Nothing time-dependent here */
+	static inline void timerTick()
+	{
+	}
+
+	/* No flow control either */
+	static inline void setBacklog(uint16_t)
+	{
+	}
+
+	static inline bool peerBusy()
+	{
+		return false;
+	}
+
+	static inline bool sendRefused()
+	{
+		return false;
+	}
+
 	static inline RawBuffer getRawBuffer()
 	{
 		RawBuffer r;
@@ -0,0 +1,327 @@
+/*
+ SerPro - A serial protocol for arduino intercommunication
+ Copyright (C) 2009 Alvaro Lopes <alvieboy@alvie.com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 3 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General
+ Public License along with this library; if not, write to the
+ Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301 USA
+ */
+
+/*
+ Primary station for a multi-drop bus (SerProHDLC only).
+
+ The primary talks to one secondary at a time, in Normal Response Mode:
+ it sends either a command or a poll (RR with P bit) to a station, and
+ waits for its answer (or a timeout) before moving on. Each station has
+ its own sequence numbers and link state, which we swap in and out of
+ SerProHDLC, so the same framing code serves all of them.
+
+ Scheduling: every station has an interval between polls. Stations that
+ answered with data are polled again after pollMinInterval; idle ones
+ back off, doubling up to pollMaxInterval; silent ones drop straight to
+ pollMaxInterval. Of all stations due, the one due longest is served,
+ and ties go round-robin, so no station starves. The response timeout
+ follows each station's smoothed response time.
+
+ All times are in timerTick() calls. Feed received bytes through
+ processData() here, not the protocol's, so we see answers as soon as
+ they arrive.
+
+ Handler must provide:
+
+   static void pollStation(uint8_t address);
+
+ which is called at the start of each turn. It may send commands to
+ that station with SerPro::send(); if it sends nothing, we poll.
+
+ A turn ends when the station sends a frame with the F bit set, or on
+ timeout, so secondaries must set F on their last frame of an answer,
+ and only there. SerProHDLC secondaries do so with the pollSecondary
+ config option, which also makes them ignore frames for other stations
+ (filterAddress). Secondaries without it need filterAddress set.
+ */
+
+#ifndef __SERPRO_POLLER_H__
+#define __SERPRO_POLLER_H__
+
+#include "config_options.h"
+
+CONFIG_OPTION(pollMinInterval, uint16_t, 0)
+CONFIG_OPTION(pollMaxInterval, uint16_t, 100)
+CONFIG_OPTION(pollMinTimeout, uint16_t, 10)
+CONFIG_OPTION(pollMaxMisses, uint8_t, 3)
+
+template<class SerPro, class Handler, unsigned int maxStations>
+class SerProPoller
+{
+public:
+	typedef typename SerPro::MyProtocol MyProtocol;
+	typedef typename MyProtocol::config_type Config;
+	typedef typename MyProtocol::packet_size_t packet_size_t;
+	typedef typename MyProtocol::crc_t crc_t;
+
+	struct Station {
+		uint8_t address;
+		/* Link state, swapped in and out of the protocol */
+		uint8_t txSeqNum;
+		uint8_t txAcked;
+		uint8_t rxNextSeqNum;
+		uint8_t linkFlags;
+		packet_size_t maxFrame;
+		uint8_t window;
+		uint8_t features;
+		bool featuresKnown;
+		uint8_t fecParity;
+		uint8_t escapeTx[32];
+		bool escapeRxCheck;
+		uint8_t rxDelivered;  // Duplicate frames, see wasDelivered()
+		crc_t rxFrameCRC[8];
+		/* Scheduling */
+		uint16_t due;       // When the next poll is due
+		uint16_t interval;  // Current interval between polls
+		uint16_t rtt;       // Smoothed response time, times 8
+		uint8_t misses;     // Polls in a row without answer
+	};
+
+	static Station stations[maxStations];
+	static uint8_t numStations;
+	static int16_t current;     // Station being served, -1 if none
+	static uint8_t lastServed;
+	static uint16_t now;
+	static uint16_t turnStart;
+	static uint8_t rxFramesSeen;
+	static bool turnData;       // Station sent I-frames this turn
+
+	static bool addStation(uint8_t address)
+	{
+		if (numStations>=maxStations)
+			return false;
+		Station &s = stations[numStations++];
+		s.address = address;
+		s.txSeqNum = 0;
+		s.txAcked = 0;
+		s.rxNextSeqNum = 0;
+		s.linkFlags = LINK_FLAG_PRIMARY;
+		s.maxFrame = Config::maxPacketSize;
+		s.window = config_option_windowSize<Config>::value;
+		s.features = 0;
+		s.featuresKnown = false;
+		s.fecParity = 0;
+		memcpy(s.escapeTx,MyProtocol::escapeLocal,sizeof(s.escapeTx));
+		s.escapeTx[MyProtocol::frameFlag>>3] |= 1<<(MyProtocol::frameFlag&7);
+		s.escapeTx[MyProtocol::escapeFlag>>3] |= 1<<(MyProtocol::escapeFlag&7);
+		s.escapeRxCheck = false;
+		s.rxDelivered = 0;
+		s.due = now;
+		s.interval = config_option_pollMinInterval<Config>::value;
+		s.rtt = 0;
+		s.misses = 0;
+		return true;
+	}
+
+	/* Ask for a station to be served as soon as the bus is free, e.g.
+	 because we have commands queued for it. */
+	static void wakeStation(uint8_t address)
+	{
+		uint8_t i;
+		for (i=0; i<numStations; i++) {
+			if (stations[i].address==address)
+				stations[i].due = now;
+		}
+	}
+
+	static inline bool isLinkUp(uint8_t index)
+	{
+		return stations[index].linkFlags & LINK_FLAG_LINKUP;
+	}
+
+	static void processData(uint8_t bIn)
+	{
+		MyProtocol::processData(bIn);
+		if (current<0 || MyProtocol::rxFrames==rxFramesSeen)
+			return;
+		rxFramesSeen = MyProtocol::rxFrames;
+		if ((MyProtocol::inControlField & 1)==0)
+			turnData = true;
+		/* Last frame of the answer */
+		if (MyProtocol::inControlField & 0x10) {
+			answered();
+			endTurn();
+			startTurn();
+		}
+	}
+
+	static void timerTick()
+	{
+		now++;
+		MyProtocol::timerTick();
+		if (current>=0 && (uint16_t)(now-turnStart) >= timeout(stations[current])) {
+			missed();
+			endTurn();
+		}
+		if (current<0)
+			startTurn();
+	}
+
+protected:
+	static inline uint16_t timeout(const Station &s)
+	{
+		/* Twice the smoothed response time */
+		return config_option_pollMinTimeout<Config>::value + (s.rtt>>2);
+	}
+
+	static void load(const Station &s)
+	{
+		MyProtocol::linkAddress = s.address;
+		MyProtocol::txSeqNum = s.txSeqNum;
+		MyProtocol::txAcked = s.txAcked;
+		MyProtocol::rxNextSeqNum = s.rxNextSeqNum;
+		MyProtocol::linkFlags = s.linkFlags;
+		MyProtocol::maxFrame = s.maxFrame;
+		MyProtocol::window = s.window;
+		MyProtocol::features = s.features;
+		MyProtocol::featuresKnown = s.featuresKnown;
+		MyProtocol::setFEC(s.fecParity);
+		memcpy(MyProtocol::escapeTx,s.escapeTx,sizeof(s.escapeTx));
+		MyProtocol::escapeTxChanged();
+		MyProtocol::escapeRxCheck = s.escapeRxCheck;
+		MyProtocol::rxDelivered = s.rxDelivered;
+		memcpy(MyProtocol::rxFrameCRC,s.rxFrameCRC,sizeof(s.rxFrameCRC));
+
+		/* Too large to keep for every station, or only good within a
+		 turn: start over */
+		memset(MyProtocol::replyLen,0,sizeof(MyProtocol::replyLen));
+		MyProtocol::replyState = 0;
+		MyProtocol::ackTimer = 0;
+		MyProtocol::ackPending = 0;
+		MyProtocol::busyTimer = 0;
+		MyProtocol::abortFragments();
+	}
+
+	static void save(Station &s)
+	{
+		/* Bundled commands are for this station, or for nobody */
+		MyProtocol::flushBundle();
+		MyProtocol::bundlePtr = 0;
+		MyProtocol::bundleTimer = 0;
+
+		s.txSeqNum = MyProtocol::txSeqNum;
+		s.txAcked = MyProtocol::txAcked;
+		s.rxNextSeqNum = MyProtocol::rxNextSeqNum;
+		s.linkFlags = MyProtocol::linkFlags | LINK_FLAG_PRIMARY;
+		s.maxFrame = MyProtocol::maxFrame;
+		s.window = MyProtocol::window;
+		s.features = MyProtocol::features;
+		s.featuresKnown = MyProtocol::featuresKnown;
+		s.fecParity = MyProtocol::fecParity;
+		memcpy(s.escapeTx,MyProtocol::escapeTx,sizeof(s.escapeTx));
+		s.escapeRxCheck = MyProtocol::escapeRxCheck;
+		s.rxDelivered = MyProtocol::rxDelivered;
+		memcpy(s.rxFrameCRC,MyProtocol::rxFrameCRC,sizeof(s.rxFrameCRC));
+	}
+
+	/* Pick the station due the longest. Scan starts after the last one
+	 served, so ties go round-robin. */
+	static int16_t pick()
+	{
+		int16_t best = -1;
+		int16_t bestLate = 0;
+		uint8_t n, i;
+		for (n=1; n<=numStations; n++) {
+			i = (lastServed+n) % numStations;
+			int16_t late = (int16_t)(now - stations[i].due);
+			if (late>=0 && (best<0 || late>bestLate)) {
+				best = i;
+				bestLate = late;
+			}
+		}
+		return best;
+	}
+
+	static void startTurn()
+	{
+		int16_t i = pick();
+		if (i<0)
+			return;
+
+		Station &s = stations[i];
+		current = i;
+		lastServed = i;
+		turnStart = now;
+		rxFramesSeen = MyProtocol::rxFrames;
+		turnData = false;
+		load(s);
+
+		if (!(s.linkFlags & LINK_FLAG_LINKUP)) {
+			/* With P, so UA comes with F */
+			MyProtocol::sendUnnumberedFrame((typename MyProtocol::unnumbered_command)(MyProtocol::SNRM|0x10));
+			return;
+		}
+
+		MyProtocol::linkFlags &= ~LINK_FLAG_PACKETSENT;
+		Handler::pollStation(s.address);
+		if (!(MyProtocol::linkFlags & LINK_FLAG_PACKETSENT))
+			MyProtocol::sendSupervisoryFrame(MyProtocol::RR,true);
+	}
+
+	static void answered()
+	{
+		Station &s = stations[current];
+		uint16_t sample = now - turnStart;
+
+		/* rtt is kept times 8, gain is 1/8 */
+		s.rtt += sample - (s.rtt>>3);
+		s.misses = 0;
+
+		if (turnData) {
+			/* Station had data, come back soon */
+			s.interval = config_option_pollMinInterval<Config>::value;
+		} else {
+			s.interval = s.interval ? s.interval<<1 : 1;
+			if (s.interval > config_option_pollMaxInterval<Config>::value)
+				s.interval = config_option_pollMaxInterval<Config>::value;
+		}
+	}
+
+	static void missed()
+	{
+		Station &s = stations[current];
+		LOG("Station %u did not answer\n", s.address);
+		s.interval = config_option_pollMaxInterval<Config>::value;
+		if (++s.misses >= config_option_pollMaxMisses<Config>::value) {
+			/* Consider it gone, start over with SNRM */
+			MyProtocol::linkFlags &= ~LINK_FLAG_LINKUP;
+		}
+	}
+
+	static void endTurn()
+	{
+		Station &s = stations[current];
+		save(s);
+		s.due = now + s.interval;
+		current = -1;
+	}
+};
+
+#define IMPLEMENT_POLLER(name) \
+	template<> name::Station name::stations[]={}; \
+	template<> uint8_t name::numStations=0; \
+	template<> int16_t name::current=-1; \
+	template<> uint8_t name::lastServed=0; \
+	template<> uint16_t name::now=0; \
+	template<> uint16_t name::turnStart=0; \
+	template<> uint8_t name::rxFramesSeen=0; \
+	template<> bool name::turnData=false;
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ SerPro - A serial protocol for arduino intercommunication
+ Copyright (C) 2009 Alvaro Lopes <alvieboy@alvie.com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 3 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General
+ Public License along with this library; if not, write to the
+ Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301 USA
+ */
+
+/*
+ Round trip time of a SerProHDLC link, measured with TEST frames. Host
+ only; the other side just has to be SerProHDLC (or the Java one),
+ which sends TEST frames back as soon as they are received, so what we
+ measure is the line and the peer's receive path, not its handlers.
+
+ Each probe carries a sequence number and the time it was sent, by our
+ own clock, so nothing is kept per probe and late answers still count.
+ Round trips go into a histogram, and into a smoothed estimate and
+ deviation as TCP keeps them, from which timeout() gives a timeout to
+ use for the link.
+
+ Everything is updated on the protocol's thread (from timerTick() and
+ processData()), and can be read from any other without locks: the
+ numbers are updated one by one, so a reader may see one round trip
+ counted in some and not yet in others, but never a torn value.
+
+ One instance per link (per SerPro instance):
+
+ typedef SerProRTT<SerPro> RTT;
+ IMPLEMENT_RTT(RTT);
+ ...
+ RTT::begin();
+ ... RTT::timerTick() next to SerPro::timerTick()
+ ... elsewhere: RTT::histogram.percentile(99)
+ */
+
+#ifndef __SERPRO_RTT_H__
+#define __SERPRO_RTT_H__
+
+#include <inttypes.h>
+#include <time.h>
+#include "config_options.h"
+
+/* Ticks between probes, zero sends them only when probe() is called */
+CONFIG_OPTION(rttInterval, uint16_t, 100)
+
+template<typename T>
+static inline T rtt_load(const T *p)
+{
+	return __atomic_load_n(p,__ATOMIC_RELAXED);
+}
+
+template<typename T>
+static inline void rtt_store(T *p, T v)
+{
+	__atomic_store_n(p,v,__ATOMIC_RELAXED);
+}
+
+/* Counts of 32-bit values, in the manner of HdrHistogram: exact below
+ 2^subBits, and above that, each power of two is split in 2^subBits
+ buckets, so any value is off by less than 1 part in 2^subBits (3% for
+ the default). Written by one thread, read by any. */
+
+template<unsigned int subBits=5>
+struct SerProHistogram
+{
+	static unsigned int const subBuckets = 1<<subBits;
+	static unsigned int const buckets = (33-subBits)*subBuckets;
+
+	uint32_t counts[buckets];
+	uint32_t total;
+	uint64_t sum;
+	uint32_t minimum, maximum;
+
+	SerProHistogram()
+	{
+		reset();
+	}
+
+	/* Writer side only */
+	void reset()
+	{
+		unsigned int i;
+		for (i=0; i<buckets; i++)
+			rtt_store(&counts[i],(uint32_t)0);
+		rtt_store(&total,(uint32_t)0);
+		rtt_store(&sum,(uint64_t)0);
+		rtt_store(&minimum,(uint32_t)0xFFFFFFFF);
+		rtt_store(&maximum,(uint32_t)0);
+	}
+
+	static inline unsigned int index(uint32_t v)
+	{
+		if (v<subBuckets)
+			return v;
+		unsigned int shift = (31-__builtin_clz(v))-subBits;
+		return (shift+1)*subBuckets + (v>>shift) - subBuckets;
+	}
+
+	/* Smallest and largest value that go in a bucket */
+	static inline uint32_t low(unsigned int i)
+	{
+		if (i<2*subBuckets)
+			return i;
+		unsigned int shift = i/subBuckets-1;
+		return (uint32_t)(subBuckets + i%subBuckets) << shift;
+	}
+
+	static inline uint32_t high(unsigned int i)
+	{
+		if (i<2*subBuckets)
+			return i;
+		return low(i) + ((uint32_t)1 << (i/subBuckets-1)) - 1;
+	}
+
+	/* Writer side only */
+	void record(uint32_t v)
+	{
+		unsigned int i = index(v);
+		rtt_store(&counts[i],counts[i]+1);
+		rtt_store(&sum,sum+v);
+		if (v<minimum)
+			rtt_store(&minimum,v);
+		if (v>maximum)
+			rtt_store(&maximum,v);
+		rtt_store(&total,total+1);
+	}
+
+	inline uint32_t count() const
+	{
+		return rtt_load(&total);
+	}
+
+	inline uint32_t min() const
+	{
+		return rtt_load(&total) ? rtt_load(&minimum) : 0;
+	}
+
+	inline uint32_t max() const
+	{
+		return rtt_load(&maximum);
+	}
+
+	inline uint32_t mean() const
+	{
+		uint32_t n = rtt_load(&total);
+		return n ? rtt_load(&sum)/n : 0;
+	}
+
+	/* Largest value of the bucket that holds the given percentile, so
+	 it never reads lower than the real one. Zero when empty. */
+	uint32_t percentile(double p) const
+	{
+		uint32_t n = rtt_load(&total);
+		if (!n)
+			return 0;
+		uint64_t want = (uint64_t)(p/100*n+0.5);
+		if (want<1)
+			want = 1;
+		uint64_t seen = 0;
+		unsigned int i;
+		for (i=0; i<buckets; i++) {
+			seen += rtt_load(&counts[i]);
+			if (seen>=want) {
+				uint32_t h = high(i), m = rtt_load(&maximum);
+				return h<m ? h : m;
+			}
+		}
+		return rtt_load(&maximum);
+	}
+};
+
+template<class SerPro, unsigned int subBits=5>
+class SerProRTT
+{
+public:
+	typedef typename SerPro::MyProtocol MyProtocol;
+	typedef typename MyProtocol::config_type Config;
+
+	/* Probe: sequence number, then send time in microseconds, both
+	 little-endian */
+	static unsigned int const probeSize = 12;
+
+	typedef SerProHistogram<subBits> histogram_type;
+
+	static histogram_type histogram;    // Microseconds
+	static uint32_t sent, received;
+	static uint32_t last;       // Latest round trip, microseconds
+	static uint32_t srtt;       // Smoothed, in 1/8 microseconds
+	static uint32_t rttvar;     // Deviation, in 1/4 microseconds
+	static uint32_t seq;
+	static uint16_t timer;
+
+	static void begin()
+	{
+		MyProtocol::setTestHandler(&reply);
+		timer = config_option_rttInterval<Config>::value;
+	}
+
+	static void probe()
+	{
+		unsigned char info[probeSize];
+		uint64_t t = now();
+		unsigned int i;
+		seq++;
+		for (i=0; i<4; i++)
+			info[i] = seq >> (8*i);
+		for (i=0; i<8; i++)
+			info[4+i] = t >> (8*i);
+		MyProtocol::sendTest(info,probeSize);
+		rtt_store(&sent,sent+1);
+	}
+
+	static void timerTick()
+	{
+		if (!config_option_rttInterval<Config>::value || --timer)
+			return;
+		timer = config_option_rttInterval<Config>::value;
+		probe();
+	}
+
+	/* Probes sent and not answered, so far; answers still on their way
+	 count too */
+	static inline uint32_t lost()
+	{
+		return rtt_load(&sent)-rtt_load(&received);
+	}
+
+	static inline uint32_t smoothed()
+	{
+		return rtt_load(&srtt)>>3;
+	}
+
+	/* Smoothed round trip plus four deviations, in microseconds; zero
+	 until the first answer */
+	static inline uint32_t timeout()
+	{
+		return (rtt_load(&srtt)>>3) + rtt_load(&rttvar);
+	}
+
+	static inline uint64_t now()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC,&ts);
+		return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+	}
+
+protected:
+	static void reply(const unsigned char *data, typename MyProtocol::packet_size_t size)
+	{
+		if (size!=probeSize)
+			return;
+		uint64_t t = 0;
+		unsigned int i;
+		for (i=0; i<8; i++)
+			t |= (uint64_t)data[4+i] << (8*i);
+		uint64_t n = now();
+		if (t>n)
+			return;
+		uint32_t rtt = n-t > 0xFFFFFFFFULL ? 0xFFFFFFFF : (uint32_t)(n-t);
+
+		histogram.record(rtt);
+		rtt_store(&last,rtt);
+		/* RFC 6298, in fixed point */
+		if (!received) {
+			rtt_store(&srtt,rtt<<3);
+			rtt_store(&rttvar,rtt<<1);
+		} else {
+			int32_t err = (int32_t)rtt - (int32_t)(srtt>>3);
+			rtt_store(&srtt,(uint32_t)((int32_t)srtt + err));
+			if (err<0)
+				err = -err;
+			rtt_store(&rttvar,(uint32_t)((int32_t)rttvar + (err - (int32_t)(rttvar>>2))));
+		}
+		rtt_store(&received,received+1);
+	}
+};
+
+#define IMPLEMENT_RTT(name) \
+	template<> name::histogram_type name::histogram=name::histogram_type(); \
+	template<> uint32_t name::sent=0; \
+	template<> uint32_t name::received=0; \
+	template<> uint32_t name::last=0; \
+	template<> uint32_t name::srtt=0; \
+	template<> uint32_t name::rttvar=0; \
+	template<> uint32_t name::seq=0; \
+	template<> uint16_t name::timer=0;
+
+#endif
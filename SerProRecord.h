@@ -0,0 +1,228 @@
+/*
+ SerPro - A serial protocol for arduino intercommunication
+ Copyright (C) 2009 Alvaro Lopes <alvieboy@alvie.com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 3 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General
+ Public License along with this library; if not, write to the
+ Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301 USA
+ */
+
+/*
+ Bare command records, for transports that lose and corrupt nothing,
+ like SerProShm or a pipe: a 16-bit little-endian length, then the
+ command and its payload. No escaping, no checksum, no link state.
+ Each record is flushed on its own, so transports that keep record
+ boundaries get one command per record.
+
+ Records are in the little-endian wire format, so their payload is the
+ same as a SerProHDLC frame's on a little-endian link, and a broker
+ can pass it on without taking it apart.
+
+ Bytes can come in one by one through processData(), or, when the
+ transport hands over whole records, through processRecord(), which
+ dispatches them in place without copying.
+ */
+
+#ifndef __SERPRO_RECORD_H__
+#define __SERPRO_RECORD_H__
+
+#include <inttypes.h>
+
+template<class Config,
+	class Serial,
+	class Implementation>
+	class SerProRecord
+{
+public:
+	typedef Config config_type;
+	typedef uint8_t command_t;
+	typedef uint16_t packet_size_t;
+	typedef uint16_t buffer_size_t;
+
+	struct RawBuffer {
+		unsigned char *buffer;
+		buffer_size_t size;
+	};
+
+	enum state {
+		SIZE,
+		SIZE2,
+		BODY,
+		SKIP
+	};
+
+	static unsigned char pBuf[Config::maxPacketSize];
+	static packet_size_t pSize,pBufPtr,pOutSize;
+	static enum state st;
+	/* Payload of the command being handled */
+	static unsigned char *rawBuffer;
+	static buffer_size_t rawSize;
+
+	static inline bool wireSwap()
+	{
+		return true;
+	}
+
+	/* Nothing is acknowledged, bundled, or timed here */
+	static inline void startUnacknowledged(bool)
+	{
+	}
+
+	static inline void beginBundle()
+	{
+	}
+
+	static inline void flushBundle()
+	{
+	}
+
+	static inline void timerTick()
+	{
+	}
+
+	static inline void deferReply()
+	{
+	}
+
+	static inline void setBacklog(uint16_t)
+	{
+	}
+
+	static inline bool peerBusy()
+	{
+		return false;
+	}
+
+	static inline bool sendRefused()
+	{
+		return false;
+	}
+
+	static inline packet_size_t getMaxFrame()
+	{
+		return Config::maxPacketSize;
+	}
+
+	static inline RawBuffer getRawBuffer()
+	{
+		RawBuffer r;
+		r.buffer = rawBuffer;
+		r.size = rawSize;
+		return r;
+	}
+
+	static inline void startPacket(packet_size_t size)
+	{
+		pOutSize = size;
+	}
+
+	static inline void sendPreamble()
+	{
+		Serial::write(pOutSize & 0xff);
+		Serial::write(pOutSize >> 8);
+	}
+
+	static inline void sendData(const unsigned char *buf, packet_size_t size)
+	{
+		Serial::write(buf,size);
+	}
+
+	static inline void sendData(uint8_t c)
+	{
+		Serial::write(c);
+	}
+
+	static inline void sendPostamble()
+	{
+		Serial::flush();
+	}
+
+	static void processData(uint8_t bIn)
+	{
+		switch (st) {
+		case SIZE:
+			pSize = bIn;
+			st = SIZE2;
+			break;
+
+		case SIZE2:
+			pSize |= (packet_size_t)bIn << 8;
+			pBufPtr = 0;
+			if (pSize==0) {
+				st = SIZE;
+			} else if (pSize>Config::maxPacketSize) {
+				/* Too large for us, skip it */
+				st = SKIP;
+			} else {
+				st = BODY;
+			}
+			break;
+
+		case BODY:
+			pBuf[pBufPtr++] = bIn;
+			if (pBufPtr==pSize) {
+				st = SIZE;
+				dispatch(pBuf,pSize);
+			}
+			break;
+
+		case SKIP:
+			if (++pBufPtr==pSize)
+				st = SIZE;
+			break;
+		}
+	}
+
+	/* One or more whole records, as the transport received them. A
+	 record cut short goes through processData(). */
+	static void processRecord(const unsigned char *buf, unsigned int size)
+	{
+		while (size>0) {
+			if (st!=SIZE || size<2) {
+				processData(*buf++);
+				size--;
+				continue;
+			}
+			packet_size_t len = buf[0] | ((packet_size_t)buf[1] << 8);
+			if (len>size-2 || len>Config::maxPacketSize) {
+				processData(*buf++);
+				size--;
+				continue;
+			}
+			if (len)
+				dispatch(buf+2,len);
+			buf += 2+len;
+			size -= 2+len;
+		}
+	}
+
+protected:
+	static void dispatch(const unsigned char *buf, packet_size_t size)
+	{
+		rawBuffer = (unsigned char*)buf+1;
+		rawSize = size-1;
+		Implementation::processPacket(buf,size);
+	}
+};
+
+#define IMPLEMENT_PROTOCOL_SerProRecord(SerPro) \
+	template<> unsigned char SerPro::MyProtocol::pBuf[]={0}; \
+	template<> SerPro::MyProtocol::packet_size_t SerPro::MyProtocol::pSize=0; \
+	template<> SerPro::MyProtocol::packet_size_t SerPro::MyProtocol::pBufPtr=0; \
+	template<> SerPro::MyProtocol::packet_size_t SerPro::MyProtocol::pOutSize=0; \
+	template<> SerPro::MyProtocol::state SerPro::MyProtocol::st=SIZE; \
+	template<> unsigned char *SerPro::MyProtocol::rawBuffer=0; \
+	template<> SerPro::MyProtocol::buffer_size_t SerPro::MyProtocol::rawSize=0;
+
+#endif
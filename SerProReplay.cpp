@@ -0,0 +1,442 @@
+/*
+ Plays back a capture made with SerProTap (see SerProCapture.h)
+ through the receive side of a framing engine, to look at what a link
+ did frame by frame, or to see how fast the engine decodes it.
+
+ One direction of the capture is fed to processData(): what the tapped
+ side received (-d rx, the default) or what it sent (-d tx). The engine
+ is set up as if the link were already up, in sequence with the first
+ I-frame, and without address filtering, so a capture taken mid-session
+ plays back too. What the engine sends in answer is not put anywhere,
+ but REJs in it are counted, as they mean it saw a frame out of order.
+
+ For each frame (with -v) and in total we report whether it was
+ dispatched, and as which command, or dropped for a bad CRC, or
+ answered with REJ. Then the whole direction is fed -n more times,
+ timed, for decode throughput. With -r it is also played once at the
+ speed it was recorded.
+
+ -p plays it through SerProPacket, -s through SerProRecord, instead of
+ SerProHDLC. Those have no frame flags, so only totals are reported.
+
+ Build: g++ -O2 -o serpro-replay SerProReplay.cpp crc16.cpp reedsolomon.cpp
+ Run:   ./serpro-replay [-d rx|tx] [-p|-s] [-v] [-r] [-n repeats] capture
+ */
+
+#define SERPRO_NO_LOG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "SerProHDLC.h"
+#include "SerProPacket.h"
+#include "SerProRecord.h"
+#include "SerProCapture.h"
+
+/* Counts what the engine hands over */
+static unsigned long dispatched;
+static unsigned long perCommand[256];
+static int lastCommand;
+
+struct Sink
+{
+	static void processPacket(const unsigned char *buf, unsigned int size)
+	{
+		if (size==0)
+			return;
+		dispatched++;
+		perCommand[buf[0]]++;
+		lastCommand = buf[0];
+	}
+
+	static void processPacket(uint8_t command, const unsigned char *, unsigned int)
+	{
+		dispatched++;
+		perCommand[command]++;
+		lastCommand = command;
+	}
+
+	static inline bool isStreaming(uint8_t)
+	{
+		return false;
+	}
+
+	static inline void streamChunk(uint8_t, const unsigned char *, unsigned int)
+	{
+	}
+
+	static inline void streamCommit(uint8_t, bool)
+	{
+	}
+
+	static inline void streamAbort(uint8_t)
+	{
+	}
+};
+
+/* Takes what the engine sends, only looking for REJ */
+static unsigned long rejects;
+
+struct ReplySerial
+{
+	static unsigned int pos;
+	static bool escaped;
+
+	static void write(uint8_t v)
+	{
+		if (v==0x7E) {
+			pos = 0;
+			return;
+		}
+		if (v==0x7D) {
+			escaped = true;
+			return;
+		}
+		if (escaped) {
+			v ^= 0x20;
+			escaped = false;
+		}
+		if (pos++==1 && (v & 0x0F)==0x09)
+			rejects++;
+	}
+
+	static inline void write(const unsigned char *buf, unsigned int size)
+	{
+		unsigned int i;
+		for (i=0; i<size; i++)
+			write(buf[i]);
+	}
+
+	static inline void flush()
+	{
+	}
+};
+
+unsigned int ReplySerial::pos = 0;
+bool ReplySerial::escaped = false;
+
+struct HDLCConfig {
+	/* 253 to 255 are SerProHDLC's own */
+	static unsigned int const maxFunctions = 253;
+	static unsigned int const maxPacketSize = 4096;
+	static unsigned int const stationId = 3;
+	static bool const filterAddress = false;
+	static uint8_t const fecParity = 32;
+};
+
+struct PacketConfig {
+	static unsigned int const maxFunctions = 255;
+	static unsigned int const maxPacketSize = 255;
+};
+
+struct RecordConfig {
+	static unsigned int const maxFunctions = 255;
+	static unsigned int const maxPacketSize = 65535;
+};
+
+/* What the IMPLEMENT_PROTOCOL_ macros expect */
+struct ReplayHDLC {
+	typedef SerProHDLC<HDLCConfig,ReplySerial,Sink> MyProtocol;
+};
+struct ReplayPacket {
+	typedef SerProPacket<PacketConfig,ReplySerial,Sink> MyProtocol;
+};
+struct ReplayRecord {
+	typedef SerProRecord<RecordConfig,ReplySerial,Sink> MyProtocol;
+};
+
+IMPLEMENT_PROTOCOL_SerProHDLC(ReplayHDLC);
+IMPLEMENT_PROTOCOL_SerProPacket(ReplayPacket);
+IMPLEMENT_PROTOCOL_SerProRecord(ReplayRecord);
+
+typedef ReplayHDLC::MyProtocol HDLC;
+
+enum engine { ENGINE_HDLC, ENGINE_PACKET, ENGINE_RECORD };
+
+static enum engine engine = ENGINE_HDLC;
+
+static inline void feed(uint8_t v)
+{
+	switch (engine) {
+	case ENGINE_HDLC:
+		HDLC::processData(v);
+		break;
+	case ENGINE_PACKET:
+		ReplayPacket::MyProtocol::processData(v);
+		break;
+	case ENGINE_RECORD:
+		ReplayRecord::MyProtocol::processData(v);
+		break;
+	}
+}
+
+/* One run of bytes from the capture */
+struct Chunk {
+	uint64_t time;          // Microseconds since the capture started
+	const unsigned char *data;
+	uint32_t size;
+	bool lost;
+};
+
+static bool parse(const unsigned char *p, const unsigned char *end, bool sent, std::vector<Chunk> &out, unsigned long &gaps)
+{
+	if (end-p<(long)SerProCaptureFormat::headerSize || memcmp(p,"SPCAP\x01",6)!=0) {
+		fprintf(stderr,"Not a capture\n");
+		return false;
+	}
+	p += SerProCaptureFormat::headerSize;
+	uint64_t t = 0;
+	while (p<end) {
+		uint8_t type = *p++;
+		uint64_t delta, size;
+		unsigned int n = SerProCaptureFormat::getVarint(p,end,delta);
+		if (n)
+			p += n;
+		unsigned int m = n ? SerProCaptureFormat::getVarint(p,end,size) : 0;
+		if (!m || size>(uint64_t)(end-p-m)) {
+			fprintf(stderr,"Capture cut short\n");
+			break;
+		}
+		p += m;
+		t += delta;
+		if (type & SerProCaptureFormat::typeLost)
+			gaps++;
+		if (((type & SerProCaptureFormat::typeSent)!=0)==sent) {
+			Chunk c;
+			c.time = t;
+			c.data = p;
+			c.size = size;
+			c.lost = type & SerProCaptureFormat::typeLost;
+			out.push_back(c);
+		}
+		p += size;
+	}
+	return true;
+}
+
+/* Link up, expecting the first I-frame in the stream */
+static void resetHDLC(const std::vector<Chunk> &chunks)
+{
+	uint8_t seq = 0;
+	unsigned int pos = 0;
+	bool escaped = false, found = false;
+	size_t i;
+	uint32_t j;
+	for (i=0; i<chunks.size() && !found; i++) {
+		for (j=0; j<chunks[i].size; j++) {
+			uint8_t v = chunks[i].data[j];
+			if (v==0x7E) {
+				pos = 0;
+				escaped = false;
+				continue;
+			}
+			if (v==0x7D) {
+				escaped = true;
+				continue;
+			}
+			if (escaped) {
+				v ^= 0x20;
+				escaped = false;
+			}
+			if (pos++==1 && !(v & 1)) {
+				seq = (v>>1) & 7;
+				found = true;
+				break;
+			}
+		}
+	}
+	HDLC::linkFlags = LINK_FLAG_LINKUP;
+	HDLC::rxNextSeqNum = seq;
+	HDLC::rxDelivered = 0;
+	HDLC::inPacket = false;
+	HDLC::unEscaping = false;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void sleepUntil(double t)
+{
+	double d = t-now();
+	if (d<=0)
+		return;
+	struct timespec ts;
+	ts.tv_sec = (time_t)d;
+	ts.tv_nsec = (long)((d-ts.tv_sec)*1e9);
+	nanosleep(&ts,0);
+}
+
+/* What happened to the HDLC frames, the engine's counters wrap */
+static unsigned long frames, goodFrames, badFrames, rejFrames;
+
+/* Feed every chunk once. If tracking, look at what happened to each
+ HDLC frame, and tell if verbose. Returns bytes fed. */
+static uint64_t play(const std::vector<Chunk> &chunks, bool track, bool verbose, bool realTime)
+{
+	uint64_t bytes = 0, frameStart = 0;
+	double start = now();
+	size_t i;
+	uint32_t j;
+	for (i=0; i<chunks.size(); i++) {
+		const Chunk &c = chunks[i];
+		if (realTime)
+			sleepUntil(start+(c.time-chunks[0].time)/1e6);
+		if (verbose && c.lost)
+			printf("%10.6f  -- capture lost data here --\n",c.time/1e6);
+		for (j=0; j<c.size; j++) {
+			uint8_t v = c.data[j];
+			if (!track || engine!=ENGINE_HDLC || v!=0x7E) {
+				feed(v);
+				continue;
+			}
+			unsigned long d = dispatched, r = rejects;
+			uint16_t crc = HDLC::crcErrors;
+			uint8_t good = HDLC::rxFrames;
+			bool ending = HDLC::inPacket && HDLC::pBufPtr;
+			feed(v);
+			if (!ending)
+				continue;
+			frames++;
+			if (HDLC::rxFrames!=good)
+				goodFrames++;
+			if (HDLC::crcErrors!=crc)
+				badFrames++;
+			if (rejects!=r)
+				rejFrames++;
+			if (verbose) {
+				printf("%10.6f  frame %lu at %llu, %llu bytes: ",c.time/1e6,frames,
+					   (unsigned long long)frameStart,(unsigned long long)(bytes+j-frameStart));
+				if (HDLC::crcErrors!=crc)
+					printf("bad CRC");
+				else if (rejects!=r)
+					printf("out of sequence, REJ");
+				else if (dispatched!=d)
+					printf("command %d",lastCommand);
+				else if (HDLC::rxFrames!=good)
+					printf("control 0x%02x",HDLC::inControlField);
+				else
+					printf("dropped");
+				printf("\n");
+			}
+			frameStart = bytes+j;
+		}
+		bytes += c.size;
+	}
+	return bytes;
+}
+
+static void reset(const std::vector<Chunk> &chunks)
+{
+	switch (engine) {
+	case ENGINE_HDLC:
+		resetHDLC(chunks);
+		break;
+	case ENGINE_PACKET:
+		ReplayPacket::MyProtocol::st = ReplayPacket::MyProtocol::SIZE;
+		break;
+	case ENGINE_RECORD:
+		ReplayRecord::MyProtocol::st = ReplayRecord::MyProtocol::SIZE;
+		break;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	bool sent = false, verbose = false, realTime = false;
+	unsigned int repeats = 10;
+	int c;
+	while ((c = getopt(argc,argv,"d:psvrn:"))!=-1) {
+		switch (c) {
+		case 'd':
+			sent = strcmp(optarg,"tx")==0;
+			break;
+		case 'p':
+			engine = ENGINE_PACKET;
+			break;
+		case 's':
+			engine = ENGINE_RECORD;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'r':
+			realTime = true;
+			break;
+		case 'n':
+			repeats = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,"Usage: %s [-d rx|tx] [-p|-s] [-v] [-r] [-n repeats] capture\n",argv[0]);
+			return 1;
+		}
+	}
+	if (optind>=argc) {
+		fprintf(stderr,"No capture given\n");
+		return 1;
+	}
+
+	int fd = open(argv[optind],O_RDONLY);
+	struct stat st;
+	if (fd<0 || fstat(fd,&st)<0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	const unsigned char *map = (const unsigned char*)mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	if (map==MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	close(fd);
+
+	std::vector<Chunk> chunks;
+	unsigned long gaps = 0;
+	if (!parse(map,map+st.st_size,sent,chunks,gaps))
+		return 1;
+
+	reset(chunks);
+	uint64_t bytes = play(chunks,true,verbose,false);
+
+	unsigned long cmds = dispatched;
+	printf("%s: %llu bytes in %lu runs, %lu gaps in the capture\n",sent ? "sent" : "received",
+		   (unsigned long long)bytes,(unsigned long)chunks.size(),gaps);
+	printf("%lu commands dispatched", cmds);
+	if (engine==ENGINE_HDLC)
+		printf(", %lu frames: %lu intact, %lu bad CRC, %lu answered with REJ",
+			   frames,goodFrames,badFrames,rejFrames);
+	printf("\n");
+	for (c=0; c<256; c++)
+		if (perCommand[c])
+			printf("  command %3d: %lu\n",c,perCommand[c]);
+
+	if (repeats && bytes) {
+		unsigned int n;
+		double start = now();
+		for (n=0; n<repeats; n++) {
+			reset(chunks);
+			play(chunks,false,false,false);
+		}
+		double elapsed = now()-start;
+		printf("decode: %.1f MiB/s, %.1f ns/byte, %.0f commands/s\n",
+			   bytes*(double)repeats/elapsed/(1<<20), elapsed*1e9/(bytes*(double)repeats),
+			   cmds*(double)repeats/elapsed);
+	}
+	if (realTime) {
+		printf("playing at recorded speed...\n");
+		reset(chunks);
+		dispatched = 0;
+		double start = now();
+		play(chunks,false,false,true);
+		printf("%lu commands dispatched in %.3f s\n",dispatched,now()-start);
+	}
+	return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ Latency and throughput of SerProRecord over SerProShm.
+
+ The parent makes the shared memory and the child attaches to it. For
+ latency the parent sends a command, the child's handler sends one
+ back, and the parent waits for it, -n times. For throughput the
+ parent sends -n commands with a -s byte payload without waiting, and
+ the child answers after the last one.
+
+ Build: g++ -O2 -o shm-bench SerProShm-bench.cpp
+ Run:   ./shm-bench [-n count] [-s payload]
+ */
+
+#define SERPRO_NO_LOG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "SerPro.h"
+#include "SerProRecord.h"
+#include "SerProShm.h"
+
+typedef SerProShm<> Shm;
+
+struct BenchConfig {
+	static unsigned int const maxFunctions = 4;
+	static unsigned int const maxPacketSize = 4096;
+};
+
+DECLARE_SERPRO(BenchConfig,Shm,SerProRecord,SerPro);
+
+static uint32_t lastPing;
+static uint32_t received;
+static bool done;
+
+/* Child: answer pings */
+DECLARE_FUNCTION(0)(uint32_t seq) {
+	SerPro::send(1,seq);
+}
+END_FUNCTION
+
+/* Parent: pong */
+DECLARE_FUNCTION(1)(uint32_t seq) {
+	lastPing = seq;
+}
+END_FUNCTION
+
+/* Child: bulk, answered after the last */
+DECLARE_FUNCTION(2)(uint32_t seq, uint32_t last, CountedBuffer data) {
+	received++;
+	if (seq==last)
+		SerPro::send(3,received);
+}
+END_FUNCTION
+
+/* Parent: bulk is in */
+DECLARE_FUNCTION(3)(uint32_t count) {
+	received = count;
+	done = true;
+}
+END_FUNCTION
+
+IMPLEMENT_SERPRO(4,SerPro,SerProRecord);
+IMPLEMENT_SHM(Shm);
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t count = 200000, payload = 64;
+	int i;
+	for (i=1; i+1<argc; i+=2) {
+		if (strcmp(argv[i],"-n")==0)
+			count = atol(argv[i+1]);
+		else if (strcmp(argv[i],"-s")==0)
+			payload = atol(argv[i+1]);
+	}
+	if (payload+13>BenchConfig::maxPacketSize) {
+		fprintf(stderr,"Payload too large\n");
+		return 1;
+	}
+
+	char name[64];
+	snprintf(name,sizeof(name),"/serpro-bench-%d",(int)getpid());
+	if (!Shm::create(name,1<<20)) {
+		perror(name);
+		return 1;
+	}
+
+	pid_t child = fork();
+	if (child==0) {
+		Shm::close();
+		if (!Shm::open(name))
+			return 1;
+		while (Shm::dispatch<SerPro::MyProtocol>(1000));
+		return 0;
+	}
+
+	double start = now();
+	uint32_t n;
+	for (n=1; n<=count; n++) {
+		SerPro::send(0,n);
+		while (lastPing!=n)
+			Shm::dispatch<SerPro::MyProtocol>(-1);
+	}
+	double rtt = (now()-start)/count;
+
+	unsigned char *data = (unsigned char*)calloc(1,payload);
+	start = now();
+	for (n=1; n<=count; n++)
+		SerPro::send(2,n,count,CountedBuffer(data,payload));
+	while (!done)
+		Shm::dispatch<SerPro::MyProtocol>(-1);
+	double elapsed = now()-start;
+
+	printf("round trip: %.2f us\n",rtt*1e6);
+	printf("one way: %u commands of %u bytes in %.3f s, %.2f M commands/s, %.1f MiB/s%s\n",
+		   count, payload, elapsed, count/elapsed/1e6, count*(double)payload/elapsed/(1<<20),
+		   received==count ? "" : ", LOST SOME");
+
+	Shm::unlink(name);
+	int status;
+	waitpid(child,&status,0);
+	return received==count ? 0 : 1;
+}
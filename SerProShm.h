@@ -0,0 +1,381 @@
+/*
+ SerPro - A serial protocol for arduino intercommunication
+ Copyright (C) 2009 Alvaro Lopes <alvieboy@alvie.com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 3 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General
+ Public License along with this library; if not, write to the
+ Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301 USA
+ */
+
+/*
+ Shared memory transport between two processes on one (Linux) host.
+
+ SerProShm is a Serial class. The two sides share one POSIX shared
+ memory object holding a ring for each direction, with one writer and
+ one reader each. Whatever is written between two flush() calls is a
+ record; it goes into the ring as it is written and is made visible to
+ the other side at flush(), so records arrive whole or not at all.
+ Nothing is escaped or checked, there is no line to get it wrong.
+
+ With SerProRecord as the protocol a record is one command, and
+ dispatch() hands it to the protocol in place, so a command costs a
+ copy into the ring and a function call. SerProHDLC works too, each
+ record being one of its frames: then a broker can pass frames on to a
+ serial line as they are.
+
+ A reader with nothing to read spins for a moment, then sleeps on a
+ futex; a writer only calls into the kernel when the reader sleeps.
+ Writers wait the same way when the ring is full. Records can take up
+ to a quarter of the ring.
+
+ One side calls create(), the other open(), with the same name. The id
+ template parameter tells apart several connections in one process.
+
+ typedef SerProShm<> Shm;
+ DECLARE_SERPRO(Config, Shm, SerProRecord, SerPro);
+ ...
+ Shm::open("/gateway");
+ while (Shm::dispatch<SerPro::MyProtocol>(-1));
+ */
+
+#ifndef __SERPRO_SHM_H__
+#define __SERPRO_SHM_H__
+
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+struct SerProShmRing
+{
+	static uint32_t const magic = 0x53505231;   // "SPR1"
+	static uint32_t const padRecord = 0xFFFFFFFF;
+
+	uint32_t tag;
+	uint32_t size;          // Data bytes, a power of two
+	uint8_t pad0[56];
+	/* Written by the writer only, on its own cache line */
+	uint32_t head;
+	uint32_t headWaiting;   // Reader sleeps on head
+	uint8_t pad1[56];
+	/* Written by the reader only */
+	uint32_t tail;
+	uint32_t tailWaiting;   // Writer sleeps on tail
+	uint8_t pad2[56];
+	unsigned char data[0];
+
+	static inline uint32_t load(const uint32_t *p)
+	{
+		return __atomic_load_n(p,__ATOMIC_SEQ_CST);
+	}
+
+	static inline void store(uint32_t *p, uint32_t v)
+	{
+		__atomic_store_n(p,v,__ATOMIC_SEQ_CST);
+	}
+
+	static inline void wake(uint32_t *p)
+	{
+		syscall(SYS_futex,p,FUTEX_WAKE,1,0,0,0);
+	}
+
+	/* Wait for *p to change from v, spinning first. Returns false on
+	 timeout (in milliseconds, negative waits forever). */
+	static bool wait(uint32_t *p, uint32_t v, uint32_t *waiting, int timeout)
+	{
+		/* Spinning only helps if the other side runs meanwhile */
+		static unsigned int const spins = sysconf(_SC_NPROCESSORS_ONLN)>1 ? 4000 : 0;
+		unsigned int spin;
+		for (spin=0; spin<spins; spin++) {
+			if (load(p)!=v)
+				return true;
+#if defined(__i386__) || defined(__x86_64__)
+			__builtin_ia32_pause();
+#endif
+		}
+		if (timeout==0)
+			return load(p)!=v;
+
+		/* Wakeups can be spurious, or meant for an earlier wait */
+		struct timespec deadline, ts, *tsp = 0;
+		if (timeout>0) {
+			clock_gettime(CLOCK_MONOTONIC,&deadline);
+			deadline.tv_sec += timeout/1000;
+			deadline.tv_nsec += (timeout%1000)*1000000L;
+			if (deadline.tv_nsec>=1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			tsp = &ts;
+		}
+		store(waiting,1);
+		while (load(p)==v) {
+			if (tsp) {
+				clock_gettime(CLOCK_MONOTONIC,&ts);
+				ts.tv_sec = deadline.tv_sec-ts.tv_sec;
+				ts.tv_nsec = deadline.tv_nsec-ts.tv_nsec;
+				if (ts.tv_nsec<0) {
+					ts.tv_sec--;
+					ts.tv_nsec += 1000000000L;
+				}
+				if (ts.tv_sec<0)
+					break;
+			}
+			/* The other side stores before it looks at 'waiting' */
+			syscall(SYS_futex,p,FUTEX_WAIT,v,tsp,0,0);
+		}
+		store(waiting,0);
+		return load(p)!=v;
+	}
+};
+
+template<unsigned int id=0>
+class SerProShm
+{
+public:
+	static unsigned char *mapping;
+	static size_t mappingSize;
+	static SerProShmRing *tx, *rx;
+	static uint32_t txHead;         // Ours, published at flush()
+	static uint32_t txStart;        // Where the record being written starts
+	static uint32_t txLength;
+	static bool txOpen;
+	static uint32_t rxTail;         // Ours, published at release()
+	static uint32_t maxRecord;
+	static unsigned long dropped;
+
+	/* Make the shared object, 'size' bytes for each direction (a power
+	 of two), and be its first side */
+	static bool create(const char *name, uint32_t size=65536)
+	{
+		if (size<4096 || (size & (size-1)))
+			return false;
+		int fd = shm_open(name,O_RDWR|O_CREAT|O_TRUNC,0600);
+		if (fd<0)
+			return false;
+		size_t total = 2*(sizeof(SerProShmRing)+size);
+		if (ftruncate(fd,total)<0 || !map(fd,total)) {
+			::close(fd);
+			shm_unlink(name);
+			return false;
+		}
+		::close(fd);
+		SerProShmRing *a = ring(0);
+		a->size = size;
+		SerProShmRing *b = ring(1);
+		b->size = size;
+		SerProShmRing::store(&a->tag,SerProShmRing::magic);
+		SerProShmRing::store(&b->tag,SerProShmRing::magic);
+		attach(a,b);
+		return true;
+	}
+
+	/* Be the other side of an object made with create() */
+	static bool open(const char *name)
+	{
+		int fd = shm_open(name,O_RDWR,0);
+		if (fd<0)
+			return false;
+		struct stat st;
+		if (fstat(fd,&st)<0 || st.st_size<(off_t)(2*sizeof(SerProShmRing)) || !map(fd,st.st_size)) {
+			::close(fd);
+			return false;
+		}
+		::close(fd);
+		SerProShmRing *a = ring(0);
+		if (SerProShmRing::load(&a->tag)!=SerProShmRing::magic ||
+			mappingSize != 2*(sizeof(SerProShmRing)+a->size)) {
+			close();
+			return false;
+		}
+		attach(ring(1),a);
+		return true;
+	}
+
+	static void close()
+	{
+		if (mapping)
+			munmap(mapping,mappingSize);
+		mapping = 0;
+		tx = rx = 0;
+	}
+
+	static inline void unlink(const char *name)
+	{
+		shm_unlink(name);
+	}
+
+	/* Serial interface */
+
+	static inline void write(uint8_t v)
+	{
+		if (!txOpen)
+			begin();
+		if (txLength<maxRecord)
+			tx->data[txStart+4+txLength] = v;
+		txLength++;
+	}
+
+	static void write(const unsigned char *buf, unsigned int size)
+	{
+		if (!txOpen)
+			begin();
+		if (txLength+size<=maxRecord)
+			memcpy(&tx->data[txStart+4+txLength],buf,size);
+		txLength += size;
+	}
+
+	static void flush()
+	{
+		if (!txOpen)
+			return;
+		txOpen = false;
+		if (txLength>maxRecord) {
+			dropped++;
+		} else {
+			memcpy(&tx->data[txStart],&txLength,4);
+			txHead += 4+align(txLength);
+		}
+		SerProShmRing::store(&tx->head,txHead);
+		if (SerProShmRing::load(&tx->headWaiting))
+			SerProShmRing::wake(&tx->head);
+	}
+
+	/* Receiving */
+
+	/* Next record, waiting up to 'timeout' ms for it (negative waits
+	 for ever). It stays valid until release(). */
+	static const unsigned char *receive(uint32_t &size, int timeout=-1)
+	{
+		while (true) {
+			uint32_t head = SerProShmRing::load(&rx->head);
+			if (head==rxTail) {
+				if (!SerProShmRing::wait(&rx->head,head,&rx->headWaiting,timeout))
+					return 0;
+				continue;
+			}
+			uint32_t pos = rxTail & (rx->size-1);
+			uint32_t len;
+			memcpy(&len,&rx->data[pos],4);
+			if (len==SerProShmRing::padRecord) {
+				rxTail += rx->size-pos;
+				continue;
+			}
+			size = len;
+			return &rx->data[pos+4];
+		}
+	}
+
+	static void release()
+	{
+		uint32_t len;
+		memcpy(&len,&rx->data[rxTail & (rx->size-1)],4);
+		rxTail += 4+align(len);
+		SerProShmRing::store(&rx->tail,rxTail);
+		if (SerProShmRing::load(&rx->tailWaiting))
+			SerProShmRing::wake(&rx->tail);
+	}
+
+	/* Hand the next record to a protocol with processRecord(), like
+	 SerProRecord. False if none came in time. */
+	template<class Protocol>
+	static bool dispatch(int timeout=-1)
+	{
+		uint32_t size;
+		const unsigned char *r = receive(size,timeout);
+		if (!r)
+			return false;
+		Protocol::processRecord(r,size);
+		release();
+		return true;
+	}
+
+protected:
+	static bool map(int fd, size_t size)
+	{
+		void *m = mmap(0,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+		if (m==MAP_FAILED)
+			return false;
+		mapping = (unsigned char*)m;
+		mappingSize = size;
+		return true;
+	}
+
+	static inline SerProShmRing *ring(unsigned int n)
+	{
+		SerProShmRing *a = (SerProShmRing*)mapping;
+		return n ? (SerProShmRing*)(mapping+sizeof(SerProShmRing)+a->size) : a;
+	}
+
+	static void attach(SerProShmRing *out, SerProShmRing *in)
+	{
+		tx = out;
+		rx = in;
+		txHead = SerProShmRing::load(&tx->head);
+		rxTail = SerProShmRing::load(&rx->tail);
+		txOpen = false;
+		maxRecord = tx->size/4-4;
+	}
+
+	static inline uint32_t align(uint32_t len)
+	{
+		return (len+7) & ~7U;
+	}
+
+	static inline uint32_t space()
+	{
+		return tx->size - (txHead - SerProShmRing::load(&tx->tail));
+	}
+
+	/* Room for the largest record, in one piece */
+	static void begin()
+	{
+		uint32_t need = 4+align(maxRecord);
+		uint32_t pos = txHead & (tx->size-1);
+		uint32_t end = tx->size-pos;
+		if (end<need) {
+			while (space()<end)
+				SerProShmRing::wait(&tx->tail,SerProShmRing::load(&tx->tail),&tx->tailWaiting,-1);
+			uint32_t marker = SerProShmRing::padRecord;
+			memcpy(&tx->data[pos],&marker,4);
+			txHead += end;
+		}
+		while (space()<need)
+			SerProShmRing::wait(&tx->tail,SerProShmRing::load(&tx->tail),&tx->tailWaiting,-1);
+		txStart = txHead & (tx->size-1);
+		txLength = 0;
+		txOpen = true;
+	}
+};
+
+#define IMPLEMENT_SHM(name) \
+	template<> unsigned char *name::mapping=0; \
+	template<> size_t name::mappingSize=0; \
+	template<> SerProShmRing *name::tx=0; \
+	template<> SerProShmRing *name::rx=0; \
+	template<> uint32_t name::txHead=0; \
+	template<> uint32_t name::txStart=0; \
+	template<> uint32_t name::txLength=0; \
+	template<> bool name::txOpen=false; \
+	template<> uint32_t name::rxTail=0; \
+	template<> uint32_t name::maxRecord=0; \
+	template<> unsigned long name::dropped=0;
+
+#endif
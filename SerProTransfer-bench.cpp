@@ -0,0 +1,149 @@
+/*
+ Throughput benchmark for SerProTransfer over a pty pair.
+
+ The parent maps the file and sends it, the child receives it into
+ memory, checks it against the file, and both report. Without a file,
+ 1 MiB of pseudo-random data is sent. A pty has no baud rate, so this
+ measures what the protocol and the CPU can do. With -l, that percent
+ of frames is thrown away in both directions, to exercise resume.
+
+ Build: g++ -O2 -o transfer-bench SerProTransfer-bench.cpp crc16.cpp
+ Run:   ./transfer-bench [-l percent] [file]
+ */
+
+#define SERPRO_NO_LOG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include "SerProHDLC.h"
+#include "SerPro.h"
+#include "SerProTransfer.h"
+#include "SerProBench.h"
+
+static int fd = -1;
+static unsigned char outBuf[4096];
+static unsigned int outLen = 0;
+static int lossPercent = 0;
+
+class SerialWrapper
+{
+public:
+	static void write(uint8_t v) {
+		if (outLen==sizeof(outBuf))
+			flush();
+		outBuf[outLen++] = v;
+	}
+	static void flush() {
+		unsigned int off = 0;
+		if (lossPercent && rand()%100 < lossPercent)
+			outLen = 0;
+		while (off<outLen) {
+			ssize_t r = ::write(fd,outBuf+off,outLen-off);
+			if (r<=0)
+				exit(1);
+			off += r;
+		}
+		outLen = 0;
+	}
+};
+
+struct BenchConfig {
+	static unsigned int const maxFunctions = 5;
+	static unsigned int const maxPacketSize = 255;
+	static unsigned int const stationId = 3;
+	static uint8_t const transferWindow = 32;
+	static uint16_t const transferTimeout = 100;
+};
+
+DECLARE_SERPRO(BenchConfig,SerialWrapper,SerProHDLC,SerPro);
+
+typedef SerProTransfer<SerPro,0,(16UL<<20)/64,MemoryStorage> Transfer;
+
+DECLARE_TRANSFER_FUNCTIONS(0,Transfer)
+
+IMPLEMENT_SERPRO(5,SerPro,SerProHDLC);
+IMPLEMENT_TRANSFER(Transfer);
+
+/* Feed received bytes, and tick once per millisecond */
+static void run(double &lastTick)
+{
+	unsigned char buf[4096];
+	struct pollfd p;
+	p.fd = fd;
+	p.events = POLLIN;
+	if (poll(&p,1,1)>0) {
+		ssize_t r = read(fd,buf,sizeof(buf));
+		if (r<=0)
+			exit(1);
+		for (ssize_t i=0;i<r;i++)
+			SerPro::processData(buf[i]);
+	}
+	unsigned int ticks = ticksDue(lastTick);
+	while (ticks--) {
+		SerPro::timerTick();
+		Transfer::timerTick();
+	}
+}
+
+int main(int argc, char **argv)
+{
+	MappedFile file;
+	const unsigned char *data;
+	uint32_t size;
+
+	int arg = 1;
+	if (argc>2 && strcmp(argv[1],"-l")==0) {
+		lossPercent = atoi(argv[2]);
+		arg = 3;
+	}
+
+	size = 1<<20;
+	if (!benchData(argc>arg ? argv[arg] : 0,file,data,size))
+		return 1;
+
+	int master, slave;
+	if (!openPty(master,slave))
+		return 1;
+
+	double lastTick = now();
+
+	pid_t child = fork();
+	srand(child ? 1 : 2);
+	if (child==0) {
+		/* Receiver */
+		close(master);
+		fd = slave;
+		while (!receiveEnded)
+			run(lastTick);
+		/* Let the final status get out */
+		double until = now()+0.2;
+		while (now()<until)
+			run(lastTick);
+		bool same = receivedMatches(data,size);
+		printf("receiver: %u bytes, %s\n",receivedSize,same ? "match" : "MISMATCH");
+		return same ? 0 : 1;
+	}
+
+	/* Sender */
+	close(slave);
+	fd = master;
+
+	double start = now();
+	Transfer::start(1,data,size);
+	while (Transfer::getRole()==Transfer::SENDING)
+		run(lastTick);
+	double elapsed = now()-start;
+
+	printf("sender: %u bytes in %u chunks of %u, %.3f s, %.1f KiB/s, %s\n",
+		   size, Transfer::total(), Transfer::chunkSize, elapsed,
+		   size/elapsed/1024, Transfer::getRole()==Transfer::DONE ? "done" : "FAILED");
+
+	int status;
+	waitpid(child,&status,0);
+	file.close();
+	return Transfer::getRole()==Transfer::DONE && WIFEXITED(status) && WEXITSTATUS(status)==0 ? 0 : 1;
+}
@@ -0,0 +1,533 @@
+/*
+ SerPro - A serial protocol for arduino intercommunication
+ Copyright (C) 2009 Alvaro Lopes <alvieboy@alvie.com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 3 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General
+ Public License along with this library; if not, write to the
+ Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301 USA
+ */
+
+/*
+ Bulk transfers (firmware images, log dumps) over SerPro, resumable.
+
+ The object is cut in chunks, numbered from zero. The sender announces
+ it with BEGIN (id, size, chunk size and CRC-32 of the whole thing),
+ then sends a window of chunks as DATA, followed by QUERY. The receiver
+ answers QUERY with STATUS: the first chunk it's missing, and a bitmap
+ of the ones after it. The sender fills the holes and carries on from
+ there. When nothing is missing it sends END, and the receiver reads
+ the object back, checks the CRC-32, and answers with the outcome.
+
+ Everything goes in UI frames. A lost chunk is just a hole in the
+ bitmap, other lost messages are sent again on timeout, and none of
+ them can hold the link up. Frames are never reordered on a serial
+ line, so QUERY still arrives after the DATA sent before it.
+
+ Both sides keep the bitmap, so if the link goes away the sender just
+ keeps asking (every transferTimeout ticks), and when the receiver
+ answers again, only what's missing is sent. A BEGIN for the transfer
+ the receiver already has going resumes it, anything else starts over.
+
+ One instance handles one transfer at a time, in either direction. It
+ takes numCommands function numbers from commandBase on, which must be
+ declared with DECLARE_TRANSFER_FUNCTIONS(commandBase, Transfer).
+
+ Receivers must provide a Storage class:
+
+   static bool begin(uint32_t id, uint32_t size);  // false to refuse
+   static void write(uint32_t offset, const unsigned char *data, unsigned int size);
+   static void read(uint32_t offset, unsigned char *data, unsigned int size);
+   static void end(uint32_t id, bool ok);
+
+ Chunks may be written in any order, and more than once after a CRC
+ failure. Senders need no storage: data is sent straight from the
+ given memory, which on hosts can be a mapped file (see MappedFile).
+ */
+
+#ifndef __SERPRO_TRANSFER_H__
+#define __SERPRO_TRANSFER_H__
+
+#include "config_options.h"
+#include "crc16.h"
+
+/* Chunk size, zero means as much as fits in one frame. Larger chunks
+ go in fragments. */
+CONFIG_OPTION(transferChunkSize, uint16_t, 0)
+/* Chunks sent before asking for status */
+CONFIG_OPTION(transferWindow, uint8_t, 8)
+/* Ticks to wait for status before asking again */
+CONFIG_OPTION(transferTimeout, uint16_t, 200)
+
+/* For instances that only send */
+struct SerProTransferNoStorage {
+	static bool begin(uint32_t, uint32_t) { return false; }
+	static void write(uint32_t, const unsigned char *, unsigned int) {}
+	static void read(uint32_t, unsigned char *, unsigned int) {}
+	static void end(uint32_t, bool) {}
+};
+
+template<class SerPro, unsigned int commandBase, unsigned long maxChunks,
+	class Storage = SerProTransferNoStorage>
+class SerProTransfer
+{
+public:
+	typedef typename SerPro::MyProtocol MyProtocol;
+	typedef typename MyProtocol::config_type Config;
+
+	enum command {
+		cmdBegin,
+		cmdData,
+		cmdQuery,
+		cmdEnd,
+		cmdStatus,
+		numCommands
+	};
+
+	enum role {
+		IDLE,
+		SENDING,
+		RECEIVING,
+		DONE,        // Last transfer went fine
+		FAILED       // Last transfer was refused
+	};
+
+	/* What STATUS tells the sender */
+	enum status {
+		STATUS_UNKNOWN,    // No such transfer here
+		STATUS_REFUSED,    // Can't take it
+		STATUS_RECEIVING,  // Carry on
+		STATUS_COMPLETE,   // All there, CRC matches
+		STATUS_BADCRC      // All there, but CRC does not match
+	};
+
+	/* Bitmap bytes in each STATUS. Windows larger than this many chunks
+	 times 8 gain nothing. */
+	static uint8_t const statusBytes = 8;
+
+	static uint8_t bitmap[(maxChunks+7)/8];
+	static uint8_t currentRole;
+	static uint32_t id;
+	static uint32_t size;
+	static uint16_t chunkSize;
+	static uint32_t chunks;
+	static uint32_t crc;
+	static uint32_t done;           // Chunks received, or acknowledged
+
+	/* Sender only */
+	static const unsigned char *source;
+	static uint32_t firstMissing;
+	static uint16_t timer;
+	static bool ending;             // END sent
+
+	static inline uint8_t getRole()
+	{
+		return currentRole;
+	}
+
+	static inline uint32_t progress()
+	{
+		return done;
+	}
+
+	static inline uint32_t total()
+	{
+		return chunks;
+	}
+
+	/* Start sending. 'data' must stay valid until getRole() is no longer
+	 SENDING. */
+	static bool start(uint32_t transferId, const unsigned char *data, uint32_t length)
+	{
+		if (currentRole==SENDING || currentRole==RECEIVING)
+			return false;
+
+		uint16_t c = config_option_transferChunkSize<Config>::value;
+		if (!c) {
+			/* Address, control, CRC, command, tag, index and
+			 length, with room for varints */
+			c = MyProtocol::getMaxFrame()-14;
+		}
+		uint32_t n = (length+c-1)/c;
+		if (n>maxChunks)
+			return false;
+
+		CRC32 check;
+		check.reset();
+		check.update(data,length);
+
+		id = transferId;
+		size = length;
+		chunkSize = c;
+		chunks = n;
+		crc = check.get();
+		source = data;
+		clearBitmap();
+		firstMissing = 0;
+		ending = false;
+		currentRole = SENDING;
+
+		sendBegin();
+		return true;
+	}
+
+	static void abort()
+	{
+		if (currentRole==RECEIVING)
+			Storage::end(id,false);
+		currentRole = FAILED;
+	}
+
+	static void timerTick()
+	{
+		if (currentRole!=SENDING || !timer || --timer)
+			return;
+		LOG("Transfer %u: no status, asking again\n", (unsigned)id);
+		if (ending)
+			sendEnd();
+		else
+			sendQuery();
+	}
+
+	/* Receiver */
+
+	static void handleBegin(uint32_t transferId, uint32_t length, uint16_t c, uint32_t check)
+	{
+		if (currentRole==SENDING)
+			return;
+
+		if (currentRole==RECEIVING && transferId==id && length==size &&
+			c==chunkSize && check==crc) {
+			/* Resume */
+			sendStatus(STATUS_RECEIVING);
+			return;
+		}
+
+		if (currentRole==RECEIVING)
+			Storage::end(id,false);
+
+		uint32_t n = c ? (length+c-1)/c : 0;
+		id = transferId;
+		if (!c || n>maxChunks || !Storage::begin(transferId,length)) {
+			currentRole = FAILED;
+			sendStatus(STATUS_REFUSED);
+			return;
+		}
+
+		size = length;
+		chunkSize = c;
+		chunks = n;
+		crc = check;
+		clearBitmap();
+		currentRole = RECEIVING;
+		sendStatus(STATUS_RECEIVING);
+	}
+
+	static void handleData(uint8_t tag, uint32_t index, CountedBuffer data)
+	{
+		if (currentRole!=RECEIVING || tag!=(uint8_t)id || index>=chunks)
+			return;
+		if (data.size!=chunkLength(index) || isSet(index))
+			return;
+		Storage::write(index*chunkSize,data.buffer,data.size);
+		set(index);
+	}
+
+	static void handleQuery(uint32_t transferId)
+	{
+		if (currentRole==SENDING)
+			return;
+		if (transferId!=id || (currentRole!=RECEIVING && currentRole!=DONE)) {
+			sendStatus(STATUS_UNKNOWN,transferId);
+			return;
+		}
+		sendStatus(currentRole==DONE ? STATUS_COMPLETE : STATUS_RECEIVING);
+	}
+
+	static void handleEnd(uint32_t transferId)
+	{
+		if (currentRole==SENDING)
+			return;
+		if (transferId!=id || (currentRole!=RECEIVING && currentRole!=DONE)) {
+			sendStatus(STATUS_UNKNOWN,transferId);
+			return;
+		}
+		if (currentRole==DONE) {
+			/* Our answer got lost */
+			sendStatus(STATUS_COMPLETE);
+			return;
+		}
+		if (done!=chunks) {
+			sendStatus(STATUS_RECEIVING);
+			return;
+		}
+
+		if (readBackCRC()!=crc) {
+			LOG("Transfer %u: CRC mismatch, starting over\n", (unsigned)id);
+			clearBitmap();
+			sendStatus(STATUS_BADCRC);
+			return;
+		}
+		currentRole = DONE;
+		Storage::end(id,true);
+		sendStatus(STATUS_COMPLETE);
+	}
+
+	/* Sender */
+
+	static void handleStatus(uint32_t transferId, uint8_t st, uint32_t missing, CountedBuffer bits)
+	{
+		if (currentRole!=SENDING || transferId!=id)
+			return;
+
+		switch (st) {
+		case STATUS_UNKNOWN:
+			/* Receiver lost it, or never got BEGIN */
+			clearBitmap();
+			firstMissing = 0;
+			ending = false;
+			sendBegin();
+			return;
+		case STATUS_REFUSED:
+			currentRole = FAILED;
+			return;
+		case STATUS_COMPLETE:
+			currentRole = DONE;
+			return;
+		case STATUS_BADCRC:
+			clearBitmap();
+			missing = 0;
+			bits = CountedBuffer();
+			break;
+		default:
+			break;
+		}
+
+		ending = false;
+		mergeStatus(missing,bits);
+		sendWindow();
+	}
+
+protected:
+	static inline bool isSet(uint32_t index)
+	{
+		return bitmap[index>>3] & (1<<(index&7));
+	}
+
+	static inline void set(uint32_t index)
+	{
+		bitmap[index>>3] |= (1<<(index&7));
+		done++;
+	}
+
+	static void clearBitmap()
+	{
+		memset(bitmap,0,sizeof(bitmap));
+		done = 0;
+	}
+
+	static inline uint16_t chunkLength(uint32_t index)
+	{
+		if (index==chunks-1)
+			return size - index*chunkSize;
+		return chunkSize;
+	}
+
+	static uint32_t readBackCRC()
+	{
+		unsigned char buf[32];
+		CRC32 check;
+		uint32_t offset = 0;
+		check.reset();
+		while (offset<size) {
+			unsigned int len = size-offset > sizeof(buf) ? sizeof(buf) : size-offset;
+			Storage::read(offset,buf,len);
+			check.update(buf,len);
+			offset += len;
+		}
+		return check.get();
+	}
+
+	static uint32_t getFirstMissing()
+	{
+		uint32_t i = 0;
+		while (i<chunks && bitmap[i>>3]==0xFF)
+			i+=8;
+		while (i<chunks && isSet(i))
+			i++;
+		return i < chunks ? i : chunks;
+	}
+
+	static void sendStatus(uint8_t st)
+	{
+		sendStatus(st,id);
+	}
+
+	static void sendStatus(uint8_t st, uint32_t transferId)
+	{
+		uint32_t missing = 0;
+		unsigned int len = 0;
+		if (st==STATUS_RECEIVING) {
+			missing = getFirstMissing();
+			uint32_t first = missing>>3;
+			uint32_t last = (chunks+7)>>3;
+			len = last-first > statusBytes ? statusBytes : last-first;
+		}
+		SerPro::sendUnacknowledged(commandBase+cmdStatus, transferId, st, missing,
+								   CountedBuffer(&bitmap[missing>>3],len));
+	}
+
+	/* Everything before 'missing' is there; 'bits' covers the chunks
+	 from the start of its byte on */
+	static void mergeStatus(uint32_t missing, const CountedBuffer &bits)
+	{
+		uint32_t i;
+		if (missing>chunks)
+			missing = chunks;
+		for (i=firstMissing; i<missing; i++) {
+			if (!isSet(i))
+				set(i);
+		}
+		firstMissing = missing;
+
+		uint32_t base = missing & ~7UL;
+		for (i=0; i<bits.size && (base>>3)+i < sizeof(bitmap); i++) {
+			uint8_t had = bitmap[(base>>3)+i];
+			uint8_t now = had | bits[i];
+			uint8_t bit;
+			for (bit=0; bit<8; bit++) {
+				if ((now & ~had) & (1<<bit))
+					done++;
+			}
+			bitmap[(base>>3)+i] = now;
+		}
+	}
+
+	static void sendBegin()
+	{
+		SerPro::sendUnacknowledged(commandBase+cmdBegin, id, size, chunkSize, crc);
+		timer = config_option_transferTimeout<Config>::value;
+	}
+
+	static void sendQuery()
+	{
+		SerPro::sendUnacknowledged(commandBase+cmdQuery, id);
+		timer = config_option_transferTimeout<Config>::value;
+	}
+
+	static void sendEnd()
+	{
+		ending = true;
+		SerPro::sendUnacknowledged(commandBase+cmdEnd, id);
+		timer = config_option_transferTimeout<Config>::value;
+	}
+
+	static void sendWindow()
+	{
+		uint8_t sent = 0;
+		uint32_t i;
+		if (firstMissing>=chunks) {
+			sendEnd();
+			return;
+		}
+		for (i=firstMissing; i<chunks && sent<config_option_transferWindow<Config>::value; i++) {
+			if (isSet(i))
+				continue;
+			/* Straight from the source, no copies */
+			SerPro::sendUnacknowledged(commandBase+cmdData, (uint8_t)id, i,
+									   CountedBuffer(source+i*chunkSize,chunkLength(i)));
+			sent++;
+		}
+		sendQuery();
+	}
+};
+
+#define DECLARE_TRANSFER_FUNCTIONS(base,Transfer) \
+	DECLARE_FUNCTION((base)+Transfer::cmdBegin)(uint32_t id, uint32_t size, uint16_t chunk, uint32_t crc) { \
+		Transfer::handleBegin(id,size,chunk,crc); \
+	} \
+	END_FUNCTION \
+	DECLARE_FUNCTION((base)+Transfer::cmdData)(uint8_t tag, uint32_t index, CountedBuffer data) { \
+		Transfer::handleData(tag,index,data); \
+	} \
+	END_FUNCTION \
+	DECLARE_FUNCTION((base)+Transfer::cmdQuery)(uint32_t id) { \
+		Transfer::handleQuery(id); \
+	} \
+	END_FUNCTION \
+	DECLARE_FUNCTION((base)+Transfer::cmdEnd)(uint32_t id) { \
+		Transfer::handleEnd(id); \
+	} \
+	END_FUNCTION \
+	DECLARE_FUNCTION((base)+Transfer::cmdStatus)(uint32_t id, uint8_t status, uint32_t missing, CountedBuffer bits) { \
+		Transfer::handleStatus(id,status,missing,bits); \
+	} \
+	END_FUNCTION
+
+#define IMPLEMENT_TRANSFER(name) \
+	template<> uint8_t name::bitmap[]={0}; \
+	template<> uint8_t name::currentRole=name::IDLE; \
+	template<> uint32_t name::id=0; \
+	template<> uint32_t name::size=0; \
+	template<> uint16_t name::chunkSize=0; \
+	template<> uint32_t name::chunks=0; \
+	template<> uint32_t name::crc=0; \
+	template<> uint32_t name::done=0; \
+	template<> const unsigned char *name::source=0; \
+	template<> uint32_t name::firstMissing=0; \
+	template<> uint16_t name::timer=0; \
+	template<> bool name::ending=false;
+
+#ifndef AVR
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/* Read-only view of a whole file, for sending it without copies */
+struct MappedFile {
+	const unsigned char *data;
+	uint32_t size;
+
+	MappedFile(): data(0), size(0) {}
+
+	bool open(const char *path)
+	{
+		struct stat st;
+		int fd = ::open(path,O_RDONLY);
+		if (fd<0)
+			return false;
+		if (fstat(fd,&st)<0 || st.st_size==0 || (uint64_t)st.st_size>0xFFFFFFFFULL) {
+			::close(fd);
+			return false;
+		}
+		void *m = mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		::close(fd);
+		if (m==MAP_FAILED)
+			return false;
+		madvise(m,st.st_size,MADV_SEQUENTIAL);
+		data = (const unsigned char*)m;
+		size = st.st_size;
+		return true;
+	}
+
+	void close()
+	{
+		if (data)
+			munmap((void*)data,size);
+		data = 0;
+		size = 0;
+	}
+};
+#endif
+
+#endif
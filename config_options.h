@@ -0,0 +1,57 @@
+/*
+ SerPro - A serial protocol for arduino intercommunication
+ Copyright (C) 2009 Alvaro Lopes <alvieboy@alvie.com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 3 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General
+ Public License along with this library; if not, write to the
+ Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301 USA
+ */
+
+#ifndef __CONFIG_OPTIONS_H__
+#define __CONFIG_OPTIONS_H__
+
+/*
+ Optional configuration values.
+
+ Only maxFunctions, maxPacketSize and stationId are mandatory in the
+ configuration structure. Everything else is declared here with a
+ default, and read through config_option_NAME<Config>, which picks
+ Config::NAME if it exists. This way old configurations keep working.
+
+ CONFIG_OPTION(name,type,default) is for static constants, and gives
+ config_option_name<Config>::value.
+
+ CONFIG_TYPE_OPTION(name,default) is for typedefs, and gives
+ config_option_name<Config>::type.
+ */
+
+#define CONFIG_OPTION(name,type,def) \
+	template<class Config> struct config_option_##name { \
+	template<class C> static char (&probe(char (*)[sizeof(C::name)]))[2]; \
+	template<class C> static char probe(...); \
+	template<class C, bool> struct get { static type const value = def; }; \
+	template<class C> struct get<C,true> { static type const value = C::name; }; \
+	static type const value = get<Config, sizeof(probe<Config>(0))==2>::value; \
+	};
+
+#define CONFIG_TYPE_OPTION(name,def) \
+	template<class Config> struct config_option_##name { \
+	template<class C> static char (&probe(typename C::name*))[2]; \
+	template<class C> static char probe(...); \
+	template<class C, bool> struct get { typedef def type; }; \
+	template<class C> struct get<C,true> { typedef typename C::name type; }; \
+	typedef typename get<Config, sizeof(probe<Config>(0))==2>::type type; \
+	};
+
+#endif
@@ -42,3 +42,25 @@ void CRC16_rfc1549::update(uint8_t data)
 			crc = (crc >> 1);
 	}
 }
+
+/* Four bits at a time: small enough for AVR, and fast enough on a host
+ to keep up with any serial line */
+static const uint32_t crc32_nibble[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+	0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+	0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+void CRC32::update(uint8_t data)
+{
+	crc ^= data;
+	crc = (crc >> 4) ^ crc32_nibble[crc & 0x0F];
+	crc = (crc >> 4) ^ crc32_nibble[crc & 0x0F];
+}
+
+void CRC32::update(const unsigned char *data, unsigned long size)
+{
+	while (size--)
+		update(*data++);
+}
@@ -63,4 +63,26 @@ struct CRC16_rfc1549 {
 	}
 };
 
+/* IEEE 802.3 CRC-32, as used by zlib. Used to check bulk transfers end
+ to end, so it also takes whole blocks. */
+
+struct CRC32 {
+
+	typedef uint32_t crc_t;
+
+	crc_t crc;
+
+	inline void reset() {
+		crc = 0xffffffff;
+	}
+
+	void update(uint8_t data);
+
+	void update(const unsigned char *data, unsigned long size);
+
+	inline crc_t get() {
+		return ~crc;
+	}
+};
+
 #endif
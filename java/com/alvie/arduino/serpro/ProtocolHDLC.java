@@ -45,7 +45,13 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
     int txSeqNum;
     int rxSeqNum;
 
-    Timer retransmit_timer,link_timer;
+    // Device sent RNR: hold I-frames, poll it until it sends RR
+    boolean peerBusy;
+
+    // Retransmit (T1) and link setup timers, on a wheel shared by all links
+    TimerWheel wheel;
+    RetransmitTask retransmit_timer;
+    LinkCheckTask link_timer;
 
     static final byte frameFlag = 0x7E;
     static final byte escapeFlag = 0x7D;
@@ -55,6 +61,17 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
     HDLCPacketQueue txQueue;
     HDLCPacketQueue ackQueue;
 
+    // Fragments. Packets larger than the device frame are sent in
+    // pieces, each with fragmentCommand, the data, and a trailer with
+    // the fragment sequence and first/last flags.
+    static final byte fragmentCommand = (byte)0xFE;
+    static final int fragmentFirst = 0x80;
+    static final int fragmentLast = 0x40;
+    static final int fragmentSeqMask = 0x3F;
+    int maxFrame = 32;
+    ByteArrayOutputStream reassembly;
+    int rxFragSeq;
+
     static class Lock extends Object {
     };
 
@@ -69,6 +86,17 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
         ackQueue= new HDLCPacketQueue();
         linkUp = false;
         txLock = new Lock();
+        wheel = TimerWheel.getDefault();
+        retransmit_timer = new RetransmitTask();
+        link_timer = new LinkCheckTask();
+    }
+
+    /* Run timers on another wheel, e.g. a virtual one in tests */
+    public void setTimerWheel(TimerWheel w)
+    {
+        wheel.cancel(retransmit_timer);
+        wheel.cancel(link_timer);
+        wheel = w;
     }
 
     public void setPort(SerialPort iport, int baudrate) {
@@ -76,10 +104,8 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
             port.close();
         port = iport;
         try {
-            if (null!=link_timer)
-                link_timer.cancel();
-            if (null!=retransmit_timer)
-                retransmit_timer.cancel();
+            wheel.cancel(link_timer);
+            wheel.cancel(retransmit_timer);
             input = port.getInputStream();
             output = port.getOutputStream();
             port.setSerialPortParams(baudrate, SerialPort.DATABITS_8, SerialPort.STOPBITS_1, SerialPort.PARITY_NONE);
@@ -159,16 +185,17 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
             System.out.println("Got Information frame");
             handleInformationFrame(pBuf);
             if (lastPacketSize>0) {
-                synchronized(txLock) {
-                    noXmitCheck=true;
-                    packetListener.handlePacket(pBuf[2],payload);
-                    noXmitCheck=false;
-                }
+                deliverPacket(pBuf[2],payload);
             }
         } else if ((pBuf[1]&0x3) == 0x1) {
             // Supervisory frame
             System.out.println("Got Supervisory frame");
             handleSupervisoryFrame(pBuf);
+        } else if ((pBuf[1]&0xEF) == 0x03) {
+            // Unnumbered information. No sequence, no ack.
+            if (lastPacketSize>0) {
+                deliverPacket(pBuf[2],payload);
+            }
         } else {
             // Unnnumbered fram
             System.out.println("Got Unnnumbered frame");
@@ -179,6 +206,61 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
         checkXmit();
     }
 
+    void deliverPacket(byte command, byte [] payload)
+    {
+        if (command==fragmentCommand) {
+            reassemble(payload);
+            return;
+        }
+        synchronized(txLock) {
+            noXmitCheck=true;
+            packetListener.handlePacket(command,payload);
+            noXmitCheck=false;
+        }
+    }
+
+    void reassemble(byte [] payload)
+    {
+        if (payload==null)
+            return;
+        int trailer = bytetoint(payload[payload.length-1]);
+
+        if ((trailer & fragmentFirst)!=0) {
+            if (null!=reassembly)
+                System.out.println("Fragmented message cut short");
+            reassembly = new ByteArrayOutputStream();
+            rxFragSeq = 0;
+        } else if (null==reassembly) {
+            return;
+        } else if ((trailer & fragmentSeqMask) != (rxFragSeq & fragmentSeqMask)) {
+            System.out.println("Lost fragment "+rxFragSeq);
+            reassembly = null;
+            return;
+        }
+        rxFragSeq++;
+        reassembly.write(payload,0,payload.length-1);
+
+        if ((trailer & fragmentLast)!=0) {
+            byte [] message = reassembly.toByteArray();
+            reassembly = null;
+            if (message.length==0)
+                return;
+            byte [] rest = null;
+            if (message.length>1) {
+                rest = new byte[message.length-1];
+                System.arraycopy(message,1,rest,0,rest.length);
+            }
+            deliverPacket(message[0],rest);
+        }
+    }
+
+    // Largest frame the device takes, address, control and CRC
+    // included. This is its maxPacketSize.
+    public void setMaxFrame(int size)
+    {
+        maxFrame = size;
+    }
+
     int bytetoint(byte b)
     {
         if (b>=0)
@@ -200,10 +282,7 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
                 // Must be one.
                 System.out.println("Removing "+(seq&0x7)+" from queue");
                 ackQueue.remove(p);
-                if (null!=retransmit_timer) {
-                    retransmit_timer.cancel();
-                    retransmit_timer=null;
-                }
+                wheel.cancel(retransmit_timer);
                 return;
             }
         }
@@ -229,18 +308,33 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
         case 0: // RR
             seq = r>>5;
             ackUpTo(seq);
+            if (peerBusy) {
+                System.out.println("Device ready again");
+                peerBusy = false;
+                if (ackQueue.size()>0)
+                    startRetransmitTimer();
+                checkXmit();
+            }
             break;
         case 1: // RNR
-            System.out.println("Got NRN frame???, disconnecting");
-            disconnect();
+            seq = r>>5;
+            ackUpTo(seq);
+            if (!peerBusy)
+                System.out.println("Device not ready");
+            peerBusy = true;
+            startRetransmitTimer();
             break;
         case 2: // REJ
             seq = r>>5;
             System.out.println("Got REJ for sequence "+seq);
+            // N(R) acknowledges what came before it. Sending that again,
+            // renumbered, would have the device run it twice.
+            ackUpTo(seq);
             // Now, what we must do here is ask arduino to retransmit data.
             // But since it does not retransmit, we need to resend queued
             // frame.
             retransmit_queue_updated();
+            checkXmit();
 
             break;
         default:
@@ -258,10 +352,7 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
 
     void setLinkUp()
     {
-        if (null!=link_timer) {
-            link_timer.cancel();
-            link_timer=null;
-        }
+        wheel.cancel(link_timer);
         linkUp=true;
     }
 
@@ -279,17 +370,28 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
             System.out.println("Link up, NRM\n");
             txSeqNum=0;
             rxSeqNum=0;
+            peerBusy=false;
             setLinkUp();
             checkXmit();
+        } else if ((buf[1] & 0xEF)==0xE3) {
+            // TEST. A probe (poll bit set) goes back as it is, without
+            // the poll bit, so the peer can time the round trip.
+            if ((buf[1] & 0x10)!=0) {
+                HDLCPacket p = new HDLCPacket();
+                int i;
+                for (i=0;i<lastPacketSize;i++)
+                    p.append(buf[2+i]);
+                p.send(output, 0xE3);
+            }
         } else {
             System.out.println("Got unknown U frame???, disconnecting");
             disconnect();
         }
     }
 
-    class LinkCheckTask extends TimerTask
+    class LinkCheckTask extends TimerWheel.Timeout
     {
-        public void run()
+        public void expired()
         {
             System.out.println("No response, retrying....");
             startLink();
@@ -300,8 +402,7 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
         // Send request
         HDLCPacket p = new HDLCPacket();
         p.send(output, 0x83); // SNRM - Set Normal Response Mode
-        link_timer = new Timer();
-        link_timer.schedule( new LinkCheckTask(), 1000 );
+        wheel.schedule(link_timer, 1000);
     }
 
     public void processData(byte bIn) {
@@ -424,6 +525,10 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
         }
 
         public void append(byte b) {
+            if (payload_size==payload.length) {
+                // Large packets go out in fragments, see queueTransmit()
+                payload = Arrays.copyOf(payload,payload.length*2);
+            }
             payload[payload_size++] = b;
         }
         public void append(byte [] array) {
@@ -501,6 +606,27 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
             append((byte)(value>>>24 &0xff));
         }
 
+        // Length, 7 bits at a time, LSB first. MSB set means more follow.
+        public void addLength(int value) {
+            while ((value & ~0x7F) != 0) {
+                append((byte)((value & 0x7F) | 0x80));
+                value>>>=7;
+            }
+            append((byte)value);
+        }
+
+        public void addBlob(byte [] value) {
+            addLength(value.length);
+            append(value);
+        }
+
+        public void addString(String value) {
+            try {
+                addBlob(value.getBytes("UTF-8"));
+            } catch (java.io.UnsupportedEncodingException e) {
+            }
+        }
+
 
         public byte [] payload;
         int payload_size;
@@ -545,21 +671,46 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
 
     public void queueTransmit(SerProPacket packet)
     {
-        txQueue.append(packet);
+        HDLCPacket p = (HDLCPacket)packet;
+        // Address, control and CRC
+        if (p.getSize() > maxFrame-4) {
+            // Fragment command and trailer too
+            int capacity = maxFrame-6;
+            int offset = 0;
+            int seq = fragmentFirst;
+            do {
+                int size = Math.min(capacity, p.getSize()-offset);
+                HDLCPacket f = new HDLCPacket();
+                f.append(fragmentCommand);
+                f.append(Arrays.copyOfRange(p.payload,offset,offset+size));
+                offset += size;
+                if (offset==p.getSize())
+                    seq |= fragmentLast;
+                f.addU8(seq);
+                txQueue.append(f);
+                seq = (seq+1) & fragmentSeqMask;
+            } while (offset<p.getSize());
+        } else {
+            txQueue.append(packet);
+        }
         checkXmit();
     }
 
 
     void startRetransmitTimer()
     {
-        if (retransmit_timer!=null)
-            retransmit_timer.cancel();
-        retransmit_timer=new Timer();
-        retransmit_timer.schedule(new RetransmitTask(), 500);
+        wheel.schedule(retransmit_timer, 500);
     }
 
-    class RetransmitTask extends TimerTask {
-        public void run() {
+    class RetransmitTask extends TimerWheel.Timeout {
+        public void expired() {
+            if (peerBusy) {
+                // Ask whether it is ready now
+                HDLCPacket p = new HDLCPacket();
+                p.send(output, 0x11 | (rxSeqNum & 0x7)<<5); // RR, poll
+                startRetransmitTimer();
+                return;
+            }
             System.out.println("Timeout waiting for acknowledge");
             retransmit_queue();
         }
@@ -614,7 +765,7 @@ public class ProtocolHDLC implements SerialPortEventListener, SerProProtocol
 
     void checkXmit()
     {
-        if (!linkUp || noXmitCheck)
+        if (!linkUp || noXmitCheck || peerBusy)
             return;
 
         if (ackQueue.size()==0) {
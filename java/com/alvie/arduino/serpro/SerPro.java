@@ -58,6 +58,33 @@ public class SerPro implements SerProProtocol.SerProPacketListener {
             byte h = payload[pos++];
             return (int)l + ((int)h << 8);
         }
+        public int getLength() {
+            int value = 0, shift = 0;
+            byte b;
+            do {
+                b = payload[pos++];
+                value |= (b & 0x7F) << shift;
+                shift += 7;
+            } while ((b & 0x80) != 0);
+            return value;
+        }
+
+        public byte [] getBlob() {
+            int len = getLength();
+            byte [] value = new byte[len];
+            System.arraycopy(payload,pos,value,0,len);
+            pos+=len;
+            return value;
+        }
+
+        public String getString() {
+            try {
+                return new String(getBlob(),"UTF-8");
+            } catch (java.io.UnsupportedEncodingException e) {
+                return null;
+            }
+        }
+
         public byte [] getAll() {
             return payload;
         }
@@ -33,4 +33,6 @@ public interface SerProPacket
     public void addU8(int value);
     public void addU8(byte value);
     public void addS32(int value);
+    public void addBlob(byte [] value);
+    public void addString(String value);
 };
@@ -0,0 +1,327 @@
+/*
+ SerPro - A serial protocol for arduino intercommunication
+ Copyright (C) 2009-2010 Alvaro Lopes <alvieboy@alvie.com>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 3 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General
+ Public License along with this library; if not, write to the
+ Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301 USA
+ */
+
+package com.alvie.arduino.serpro;
+
+import java.util.*;
+
+/*
+ Hierarchical timing wheel, shared by all links.
+
+ Four wheels of 64 slots each. The first holds timers due within 64
+ ticks, one slot per tick; each next one covers 64 times as much, and
+ its slots are moved down a wheel when the one below wraps around.
+ Timers are linked into their slot, so arming and cancelling are O(1),
+ and a tick only looks at one slot (and rarely cascades one slot per
+ wheel). Timers further away than the wheels reach are parked in the
+ last slot and placed again when it cascades.
+
+ A real-time wheel runs on one daemon thread, following the monotonic
+ clock. A virtual wheel only moves on advance(), so tests can drive all
+ timers deterministically.
+
+ Expired timers run on the thread that advanced the wheel, outside its
+ lock, so they may arm or cancel timers themselves.
+ */
+
+public class TimerWheel
+{
+    static final int SLOT_BITS = 6;
+    static final int SLOTS = 1<<SLOT_BITS;
+    static final int SLOT_MASK = SLOTS-1;
+    static final int LEVELS = 4;
+
+    public static abstract class Timeout {
+        Timeout next, prev;
+        long deadline;
+        boolean due;        // Expired, about to run
+
+        public abstract void expired();
+
+        public boolean isArmed() {
+            return prev!=null;
+        }
+    }
+
+    // Slot heads are sentinels, lists are circular
+    Timeout [][] wheel;
+    long now;
+    final long tickMillis;
+    final boolean virtual;
+
+    static TimerWheel defaultWheel;
+
+    /* Virtual clock: one tick per millisecond, moved by advance() only */
+    public TimerWheel()
+    {
+        this(1, true);
+    }
+
+    /* Real time, one tick every tickMillis */
+    public TimerWheel(long tickMillis)
+    {
+        this(tickMillis, false);
+        Thread t = new Thread(new Runnable() {
+            public void run() {
+                clockLoop();
+            }
+        }, "SerPro timer wheel");
+        t.setDaemon(true);
+        t.start();
+    }
+
+    TimerWheel(long tickMillis, boolean virtual)
+    {
+        this.tickMillis = tickMillis;
+        this.virtual = virtual;
+        wheel = new Timeout[LEVELS][SLOTS];
+        for (int l=0; l<LEVELS; l++) {
+            for (int s=0; s<SLOTS; s++) {
+                Timeout head = new Timeout() {
+                    public void expired() {}
+                };
+                head.next = head.prev = head;
+                wheel[l][s] = head;
+            }
+        }
+    }
+
+    /* Wheel used by links that are not given one, 10ms ticks */
+    public static synchronized TimerWheel getDefault()
+    {
+        if (defaultWheel==null)
+            defaultWheel = new TimerWheel(10);
+        return defaultWheel;
+    }
+
+    public boolean isVirtual()
+    {
+        return virtual;
+    }
+
+    public synchronized long now()
+    {
+        return now;
+    }
+
+    /* Arm (or re-arm) a timer to expire in at least 'millis' */
+    public synchronized void schedule(Timeout t, long millis)
+    {
+        unlink(t);
+        t.due = false;
+        long ticks = (millis + tickMillis - 1) / tickMillis;
+        t.deadline = now + Math.max(ticks, 1);
+        place(t);
+    }
+
+    public synchronized void cancel(Timeout t)
+    {
+        unlink(t);
+        t.due = false;
+    }
+
+    /* Move the clock on, running whatever expires. Virtual wheels are
+     only ever moved by this. */
+    public void advance(long ticks)
+    {
+        ArrayList<Timeout> expired = new ArrayList<Timeout>();
+        while (ticks-- > 0) {
+            synchronized (this) {
+                tick(expired);
+            }
+            for (Timeout t: expired) {
+                // An earlier one may have cancelled or re-armed it
+                synchronized (this) {
+                    if (!t.due)
+                        continue;
+                    t.due = false;
+                }
+                t.expired();
+            }
+            expired.clear();
+        }
+    }
+
+    void place(Timeout t)
+    {
+        long delta = t.deadline - now;
+        int level = 0;
+        while (level<LEVELS-1 && delta >= 1L<<(SLOT_BITS*(level+1)))
+            level++;
+        int slot;
+        if (delta >= 1L<<(SLOT_BITS*LEVELS)) {
+            // Out of reach, park it in the slot that cascades last
+            slot = (int)((now >> (SLOT_BITS*level)) - 1) & SLOT_MASK;
+        } else {
+            slot = (int)(t.deadline >> (SLOT_BITS*level)) & SLOT_MASK;
+        }
+        Timeout head = wheel[level][slot];
+        t.prev = head.prev;
+        t.next = head;
+        head.prev.next = t;
+        head.prev = t;
+    }
+
+    void unlink(Timeout t)
+    {
+        if (t.prev==null)
+            return;
+        t.prev.next = t.next;
+        t.next.prev = t.prev;
+        t.next = t.prev = null;
+    }
+
+    /* Move the timers of one slot down, placing them again */
+    void cascade(int level, int slot)
+    {
+        Timeout head = wheel[level][slot];
+        Timeout t = head.next;
+        head.next = head.prev = head;
+        while (t!=head) {
+            Timeout n = t.next;
+            place(t);
+            t = n;
+        }
+    }
+
+    /* One tick, adding the expired timers to 'expired' */
+    void tick(ArrayList<Timeout> expired)
+    {
+        now++;
+        for (int level=1; level<LEVELS; level++) {
+            if ((now & ((1L<<(SLOT_BITS*level))-1))!=0)
+                break;
+            cascade(level, (int)(now >> (SLOT_BITS*level)) & SLOT_MASK);
+        }
+
+        Timeout head = wheel[0][(int)now & SLOT_MASK];
+        while (head.next!=head) {
+            Timeout t = head.next;
+            unlink(t);
+            t.due = true;
+            expired.add(t);
+        }
+    }
+
+    void clockLoop()
+    {
+        long start = System.nanoTime();
+        long done = 0;
+        while (true) {
+            try {
+                Thread.sleep(tickMillis);
+            } catch (InterruptedException x) {
+            }
+            long due = (System.nanoTime()-start) / (tickMillis*1000000L);
+            advance(due-done);
+            done = due;
+        }
+    }
+
+    /* Self-check, as there are no Java tests:
+       java com.alvie.arduino.serpro.TimerWheel
+     Timers at the edges of every wheel, and beyond, must fire on their
+     tick and once only, after any number of cascades; cancelled ones,
+     before or after they cascaded, must not fire at all. */
+
+    static class Check extends Timeout {
+        final TimerWheel wheel;
+        final String name;
+        long expect;
+        long fired = -1;
+        int runs;
+        long rearm;         // Arm again this far on, when it first expires
+
+        Check(TimerWheel wheel, String name, long millis) {
+            this.wheel = wheel;
+            this.name = name;
+            expect = wheel.now() + millis;
+            wheel.schedule(this, millis);
+        }
+
+        public void expired() {
+            runs++;
+            fired = wheel.now();
+            if (rearm>0) {
+                expect = fired + rearm;
+                wheel.schedule(this, rearm);
+                rearm = 0;
+            }
+        }
+    }
+
+    public static void main(String [] args)
+    {
+        final TimerWheel w = new TimerWheel();
+        w.advance(1000);    // Off the wheel boundaries
+        long [] delays = { 1, 2, 63, 64, 65, 4095, 4096, 4097,
+                           262143, 262144, 262145,
+                           16777215, 16777216, 16777217, 20000000 };
+        ArrayList<Check> live = new ArrayList<Check>();
+        ArrayList<Check> dead = new ArrayList<Check>();
+
+        for (long d: delays) {
+            live.add(new Check(w, "at "+d, d));
+
+            // Cancelled at once, and a tick before it is due
+            Check early = new Check(w, "cancelled at once, at "+d, d);
+            w.cancel(early);
+            dead.add(early);
+            final Check late = new Check(w, "cancelled late, at "+d, d);
+            dead.add(late);
+            if (d>1) {
+                w.schedule(new Timeout() {
+                    public void expired() {
+                        w.cancel(late);
+                    }
+                }, d-1);
+            } else {
+                w.cancel(late);
+            }
+        }
+
+        Check again = new Check(w, "re-armed from expired()", 100);
+        again.rearm = 5000;
+        live.add(again);
+        Check moved = new Check(w, "re-armed before due", 10);
+        moved.expect = w.now() + 70000;
+        w.schedule(moved, 70000);
+        live.add(moved);
+
+        w.advance(20000000 + 64);
+
+        int failed = 0;
+        for (Check c: live) {
+            int runs = c==again ? 2 : 1;
+            if (c.runs!=runs || c.fired!=c.expect) {
+                System.out.println(c.name+": ran "+c.runs+" times, last at "+c.fired+", expected "+runs+" at "+c.expect);
+                failed++;
+            }
+        }
+        for (Check c: dead) {
+            if (c.runs!=0 || c.isArmed()) {
+                System.out.println(c.name+": ran "+c.runs+" times");
+                failed++;
+            }
+        }
+        System.out.println(failed==0 ? "TimerWheel: OK" : "TimerWheel: "+failed+" failed");
+        System.exit(failed==0 ? 0 : 1);
+    }
+}
@@ -0,0 +1,204 @@
+#include "reedsolomon.h"
+
+const uint8_t GF256::expTable[512] GF_TABLE = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
+	0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0,
+	0x9d, 0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23,
+	0x46, 0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1,
+	0x5f, 0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0,
+	0xfd, 0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2,
+	0xd9, 0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce,
+	0x81, 0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc,
+	0x85, 0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54,
+	0xa8, 0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73,
+	0xe6, 0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff,
+	0xe3, 0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41,
+	0x82, 0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6,
+	0x51, 0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09,
+	0x12, 0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16,
+	0x2c, 0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01,
+	0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26, 0x4c,
+	0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0, 0x9d,
+	0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23, 0x46,
+	0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1, 0x5f,
+	0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0, 0xfd,
+	0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2, 0xd9,
+	0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce, 0x81,
+	0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc, 0x85,
+	0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54, 0xa8,
+	0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73, 0xe6,
+	0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff, 0xe3,
+	0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41, 0x82,
+	0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6, 0x51,
+	0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09, 0x12,
+	0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16, 0x2c,
+	0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01, 0x02
+};
+
+const uint8_t GF256::logTable[256] GF_TABLE = {
+	0x00, 0x00, 0x01, 0x19, 0x02, 0x32, 0x1a, 0xc6, 0x03, 0xdf, 0x33, 0xee, 0x1b, 0x68, 0xc7, 0x4b,
+	0x04, 0x64, 0xe0, 0x0e, 0x34, 0x8d, 0xef, 0x81, 0x1c, 0xc1, 0x69, 0xf8, 0xc8, 0x08, 0x4c, 0x71,
+	0x05, 0x8a, 0x65, 0x2f, 0xe1, 0x24, 0x0f, 0x21, 0x35, 0x93, 0x8e, 0xda, 0xf0, 0x12, 0x82, 0x45,
+	0x1d, 0xb5, 0xc2, 0x7d, 0x6a, 0x27, 0xf9, 0xb9, 0xc9, 0x9a, 0x09, 0x78, 0x4d, 0xe4, 0x72, 0xa6,
+	0x06, 0xbf, 0x8b, 0x62, 0x66, 0xdd, 0x30, 0xfd, 0xe2, 0x98, 0x25, 0xb3, 0x10, 0x91, 0x22, 0x88,
+	0x36, 0xd0, 0x94, 0xce, 0x8f, 0x96, 0xdb, 0xbd, 0xf1, 0xd2, 0x13, 0x5c, 0x83, 0x38, 0x46, 0x40,
+	0x1e, 0x42, 0xb6, 0xa3, 0xc3, 0x48, 0x7e, 0x6e, 0x6b, 0x3a, 0x28, 0x54, 0xfa, 0x85, 0xba, 0x3d,
+	0xca, 0x5e, 0x9b, 0x9f, 0x0a, 0x15, 0x79, 0x2b, 0x4e, 0xd4, 0xe5, 0xac, 0x73, 0xf3, 0xa7, 0x57,
+	0x07, 0x70, 0xc0, 0xf7, 0x8c, 0x80, 0x63, 0x0d, 0x67, 0x4a, 0xde, 0xed, 0x31, 0xc5, 0xfe, 0x18,
+	0xe3, 0xa5, 0x99, 0x77, 0x26, 0xb8, 0xb4, 0x7c, 0x11, 0x44, 0x92, 0xd9, 0x23, 0x20, 0x89, 0x2e,
+	0x37, 0x3f, 0xd1, 0x5b, 0x95, 0xbc, 0xcf, 0xcd, 0x90, 0x87, 0x97, 0xb2, 0xdc, 0xfc, 0xbe, 0x61,
+	0xf2, 0x56, 0xd3, 0xab, 0x14, 0x2a, 0x5d, 0x9e, 0x84, 0x3c, 0x39, 0x53, 0x47, 0x6d, 0x41, 0xa2,
+	0x1f, 0x2d, 0x43, 0xd8, 0xb7, 0x7b, 0xa4, 0x76, 0xc4, 0x17, 0x49, 0xec, 0x7f, 0x0c, 0x6f, 0xf6,
+	0x6c, 0xa1, 0x3b, 0x52, 0x29, 0x9d, 0x55, 0xaa, 0xfb, 0x60, 0x86, 0xb1, 0xbb, 0xcc, 0x3e, 0x5a,
+	0xcb, 0x59, 0x5f, 0xb0, 0x9c, 0xa9, 0xa0, 0x51, 0x0b, 0xf5, 0x16, 0xeb, 0x7a, 0x75, 0x2c, 0xd7,
+	0x4f, 0xae, 0xd5, 0xe9, 0xe6, 0xe7, 0xad, 0xe8, 0x74, 0xd6, 0xf4, 0xea, 0xa8, 0x50, 0x58, 0xaf
+};
+
+void ReedSolomon::setParity(uint8_t n)
+{
+	uint8_t i, j;
+	if (n>maxParity)
+		n = maxParity;
+	nsym = n;
+
+	/* g(x) = (x - a^0)(x - a^1)...(x - a^(n-1)), built one root at a
+	 time. g[0] is x^n's coefficient (always 1) while building. */
+	uint8_t g[maxParity+1];
+	g[0] = 1;
+	for (i=0; i<n; i++) {
+		g[i+1] = 0;
+		for (j=i+1; j>0; j--)
+			g[j] ^= GF256::mul(g[j-1],GF256::exp(i));
+	}
+	for (i=0; i<maxParity; i++)
+		gen[i] = i<n ? g[i+1] : 0;
+
+#ifndef AVR
+	unsigned int v;
+	for (v=0; v<256; v++) {
+		for (i=0; i<maxParity; i++)
+			rows[v][i] = GF256::mul(gen[i],v);
+	}
+#endif
+	reset();
+}
+
+void ReedSolomon::update(const uint8_t *data, unsigned int size)
+{
+	while (size--)
+		update(*data++);
+}
+
+int ReedSolomon::decode(uint8_t *data, unsigned int size, uint8_t *parity)
+{
+	uint8_t S[maxParity];
+	uint8_t C[maxParity+1], B[maxParity+1], T[maxParity+1];
+	unsigned int N = size+nsym;
+	unsigned int i, k;
+	uint8_t L, m, b;
+	int n;
+
+	reset();
+	update(data,size);
+	for (i=0; i<nsym && get()[i]==parity[i]; i++);
+	reset();
+	if (i==nsym)
+		return 0;
+
+	if (N>255)
+		return -1;
+
+	/* Syndromes S_j = c(a^j), Horner over the codeword */
+	for (n=0; n<nsym; n++) {
+		uint8_t s = 0;
+		uint8_t aj = GF256::exp(n);
+		for (i=0; i<N; i++)
+			s = GF256::mul(s,aj) ^ (i<size ? data[i] : parity[i-size]);
+		S[n] = s;
+	}
+
+	/* Berlekamp-Massey, error locator C(x) lowest degree first */
+	for (i=0; i<=maxParity; i++)
+		C[i] = B[i] = 0;
+	C[0] = B[0] = 1;
+	L = 0;
+	m = 1;
+	b = 1;
+	for (n=0; n<nsym; n++) {
+		uint8_t d = S[n];
+		for (i=1; i<=L; i++)
+			d ^= GF256::mul(C[i],S[n-i]);
+		if (d==0) {
+			m++;
+			continue;
+		}
+		uint8_t coef = GF256::div(d,b);
+		if (2*L <= n) {
+			for (i=0; i<=maxParity; i++)
+				T[i] = C[i];
+			for (i=0; i+m<=maxParity; i++)
+				C[i+m] ^= GF256::mul(coef,B[i]);
+			L = n+1-L;
+			for (i=0; i<=maxParity; i++)
+				B[i] = T[i];
+			b = d;
+			m = 1;
+		} else {
+			for (i=0; i+m<=maxParity; i++)
+				C[i+m] ^= GF256::mul(coef,B[i]);
+			m++;
+		}
+	}
+	if (2*L > nsym)
+		return -1;
+
+	/* Error evaluator, S(x)C(x) mod x^nsym */
+	uint8_t O[maxParity];
+	for (i=0; i<nsym; i++) {
+		uint8_t o = 0;
+		for (k=0; k<=i && k<=L; k++)
+			o ^= GF256::mul(S[i-k],C[k]);
+		O[i] = o;
+	}
+
+	/* Chien search over the positions we have, Forney for the value */
+	uint8_t found = 0;
+	for (i=0; i<N; i++) {
+		unsigned int power = N-1-i;            // X = a^power
+		unsigned int xinvLog = (255-power) % 255;
+		uint8_t xinv = GF256::exp(xinvLog);
+		uint8_t xk = 1, sum = 0, deriv = 0, omega = 0;
+		for (k=0; k<=L; k++) {
+			sum ^= GF256::mul(C[k],xk);
+			/* Formal derivative: only odd terms survive */
+			if ((k & 1) && k>0) {
+				/* C[k] x^(k-1) at x = X^-1 */
+				deriv ^= GF256::mul(C[k],GF256::div(xk,xinv));
+			}
+			xk = GF256::mul(xk,xinv);
+		}
+		if (sum)
+			continue;
+		xk = 1;
+		for (k=0; k<nsym; k++) {
+			omega ^= GF256::mul(O[k],xk);
+			xk = GF256::mul(xk,xinv);
+		}
+		if (!deriv)
+			return -1;
+		uint8_t e = GF256::mul(GF256::exp(power),GF256::div(omega,deriv));
+		if (i<size)
+			data[i] ^= e;
+		else
+			parity[i-size] ^= e;
+		found++;
+	}
+	if (found!=L)
+		return -1;
+
+	/* Make sure we ended up with a codeword */
+	update(data,size);
+	for (i=0; i<nsym && get()[i]==parity[i]; i++);
+	reset();
+	return i==nsym ? (int)found : -1;
+}
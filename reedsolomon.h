@@ -0,0 +1,133 @@
+#include <inttypes.h>
+
+/*
+ Reed-Solomon code over GF(256), field polynomial 0x11d, generator
+ roots alpha^0 .. alpha^(nsym-1). Codewords are at most 255 bytes, of
+ which nsym are parity, so up to nsym/2 wrong bytes can be corrected.
+ Shorter blocks work as if padded with leading zeros.
+
+ Encoding is the usual shift register, one byte at a time. Decoding
+ first checks the parity, which is all that is needed when nothing went
+ wrong; only then syndromes, Berlekamp-Massey, Chien search and Forney.
+ Field arithmetic uses log/exp tables (in flash on AVR). On the host,
+ each encoder also keeps the generator multiplied by every byte value,
+ so a step is one table row XORed into the register as a vector.
+ */
+
+#ifndef __REEDSOLOMON_H__
+#define __REEDSOLOMON_H__
+
+#ifdef AVR
+#include <avr/pgmspace.h>
+#define GF_TABLE PROGMEM
+#define GF_READ(t,i) pgm_read_byte(&(t)[i])
+#else
+#define GF_TABLE
+#define GF_READ(t,i) ((t)[i])
+#endif
+
+struct GF256
+{
+	static const uint8_t expTable[512];
+	static const uint8_t logTable[256];
+
+	static inline uint8_t exp(unsigned int i)
+	{
+		return GF_READ(expTable,i);
+	}
+
+	static inline uint8_t log(uint8_t a)
+	{
+		return GF_READ(logTable,a);
+	}
+
+	static inline uint8_t mul(uint8_t a, uint8_t b)
+	{
+		if (!a || !b)
+			return 0;
+		return exp((unsigned int)log(a)+log(b));
+	}
+
+	static inline uint8_t div(uint8_t a, uint8_t b)
+	{
+		if (!a)
+			return 0;
+		return exp((unsigned int)log(a)+255-log(b));
+	}
+
+	static inline uint8_t inv(uint8_t a)
+	{
+		return exp(255-log(a));
+	}
+};
+
+struct ReedSolomon
+{
+	static uint8_t const maxParity = 32;
+
+	uint8_t nsym;
+	uint8_t gen[maxParity];       // Generator, highest degree first, without x^nsym
+
+	/* Encoder register, a window sliding over a longer buffer so
+	 shifting is just moving the start */
+	uint8_t reg[2*maxParity+1];
+	uint8_t regStart;
+
+#ifndef AVR
+	typedef uint8_t row_t __attribute__((vector_size(maxParity)));
+	row_t rows[256];              // gen times every byte value
+#endif
+
+	void setParity(uint8_t nsym);
+
+	inline void reset()
+	{
+		uint8_t i;
+		for (i=0; i<=nsym; i++)
+			reg[i] = 0;
+		regStart = 0;
+	}
+
+	inline void update(uint8_t data)
+	{
+		uint8_t *r = &reg[regStart];
+		uint8_t fb = data ^ r[0];
+		r[nsym] = 0;
+#ifndef AVR
+		row_t v;
+		__builtin_memcpy(&v,r+1,sizeof(v));
+		v ^= rows[fb];
+		__builtin_memcpy(r+1,&v,sizeof(v));
+#else
+		if (fb) {
+			uint8_t lfb = GF256::log(fb);
+			uint8_t i;
+			for (i=0; i<nsym; i++) {
+				if (gen[i])
+					r[i+1] ^= GF256::exp((unsigned int)lfb+GF256::log(gen[i]));
+			}
+		}
+#endif
+		if (++regStart == maxParity) {
+			uint8_t i;
+			for (i=0; i<nsym; i++)
+				reg[i] = reg[maxParity+i];
+			regStart = 0;
+		}
+	}
+
+	void update(const uint8_t *data, unsigned int size);
+
+	/* Parity of what was given to update() since reset() */
+	inline const uint8_t *get() const
+	{
+		return &reg[regStart];
+	}
+
+	/* Fix a block of 'size' data bytes and its parity, in place.
+	 Returns the number of bytes corrected, or -1 if there were too many
+	 errors. Uses the encoder, so reset() it afterwards. */
+	int decode(uint8_t *data, unsigned int size, uint8_t *parity);
+};
+
+#endif
@@ -27,13 +27,13 @@ struct SerProConfig {
 
 DECLARE_SERPRO(SerProConfig,SerialWrapper,SerProHDLC,SerPro);
 
-DECLARE_FUNCTION(0)(int a, int b, int c) {
-	SerPro::send(0, a+b+c);
+DECLARE_FUNCTION(0)(int16_t a, int16_t b, int16_t c) {
+	SerPro::send(0, (int16_t)(a+b+c));
 }
 END_FUNCTION
 
-DECLARE_FUNCTION(1)(int a, int b) {
-	SerPro::send(1, a+b);
+DECLARE_FUNCTION(1)(int16_t a, int16_t b) {
+	SerPro::send(1, (int16_t)(a+b));
 }
 END_FUNCTION
 
@@ -42,8 +42,8 @@ DECLARE_FUNCTION(2)(void) {
 }
 END_FUNCTION
 
-DECLARE_FUNCTION(3)(int a, char *b) {
-	SerPro::send(3, b, a+1);
+DECLARE_FUNCTION(3)(int16_t a, char *b) {
+	SerPro::send(3, b, (int16_t)(a+1));
 	SerPro::send<uint8_t>(4, a+1);  // Enforce int argument to be a uint8_t
 }
 END_FUNCTION
@@ -64,9 +64,16 @@ void setup()
 
 
 
+unsigned long lastTick;
+
 void loop()
 {
 	if (Serial.available()>0) {
 		SerPro::processData(Serial.read());
 	}
+	// Protocol timers run in milliseconds here
+	if (millis()!=lastTick) {
+		lastTick=millis();
+		SerPro::timerTick();
+	}
 }